@@ -0,0 +1,29 @@
+#ifndef __MYOS__COMMON__ERRORS_H
+#define __MYOS__COMMON__ERRORS_H
+
+namespace myos
+{
+    namespace common
+    {
+
+        // the POSIX numbers, syscalls return them negated
+        enum Error
+        {
+            ENOENT = 2,  // no such file
+            ESRCH = 3,   // no such task
+            EBADF = 9,   // not an open descriptor
+            ECHILD = 10, // no child to wait for
+            EAGAIN = 11, // full for now, try again
+            ENOMEM = 12,
+            EFAULT = 14, // a pointer outside of memory
+            EINVAL = 22,
+            EMFILE = 24, // no descriptor left
+            ENAMETOOLONG = 36, // a path of MAX_PATH or more
+            ENOSYS = 38, // no such syscall, or not in this kernel
+            MAX_ERROR = 4095
+        };
+
+    }
+}
+
+#endif
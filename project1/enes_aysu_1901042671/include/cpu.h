@@ -0,0 +1,93 @@
+#ifndef __MYOS__CPU_H
+#define __MYOS__CPU_H
+
+#include <common/types.h>
+#include <gdt.h>
+
+namespace myos
+{
+
+    const common::uint32_t MAX_CPUS = 8;
+
+    struct ThreadCache;
+
+
+    // cycles spent in something every processor runs (a syscall, an
+    // interrupt vector), counted per processor so no lock is needed
+    struct CycleStatistics
+    {
+        common::uint32_t count;
+        common::uint32_t maxCycles;
+        common::uint64_t totalCycles;
+    };
+
+    // adds one run to the current processor's counters
+    void CountCycles(CycleStatistics* stats, common::uint32_t cycles);
+    // over all processors, of perCPU[0], perCPU[stride], ... perCPU[(MAX_CPUS-1)*stride]
+    void SumCycles(CycleStatistics* total, CycleStatistics* perCPU, common::uint32_t stride);
+
+    // one per processor, its GDT makes %gs point here; interruptstubs.s
+    // uses the first fields by their offsets
+    struct CPU
+    {
+        CPU* self;                         // %gs:0
+        common::uint32_t nextDirectory;    // %gs:4, loaded into cr3 by int_bottom
+        TaskStateSegment taskStateSegment; // %gs:8, its cr3 at %gs:36
+        TaskStateSegment pageFaultTaskStateSegment;
+
+        common::uint32_t index;            // 0 ---> the boot processor
+        common::uint8_t apicId;
+        ThreadCache* heapCache;            // of the task running here
+
+        // constructed in place by the processor itself
+        common::uint8_t gdt[sizeof(GlobalDescriptorTable)] __attribute__((aligned(8)));
+    };
+
+
+    namespace hardwarecommunication
+    {
+        class InterruptManager;
+    }
+
+    // brings up the other processors (INIT, startup IPI, apboot.s) and
+    // moves interrupt delivery from the PIC to the local and I/O APICs
+    class CPUManager
+    {
+    protected:
+        static CPU cpus[MAX_CPUS];
+        static volatile common::uint32_t numOnline;
+
+        common::uint8_t apicIds[MAX_CPUS]; // from the ACPI MADT
+        common::uint32_t numProcessors;
+        bool apic;
+
+        static volatile common::uint32_t booting; // index of the one being started
+        static common::uint8_t timerVector; // 0 ---> no APIC, one processor
+
+        static void ApplicationProcessorMain(); // called by apboot.s
+        bool StartApplicationProcessor(common::uint8_t apicId);
+
+    public:
+        CPUManager();
+        ~CPUManager();
+
+        // the processor this code runs on
+        static inline CPU* Current()
+        {
+            CPU* cpu;
+            asm volatile("mov %%gs:0, %0" : "=r" (cpu));
+            return cpu;
+        }
+        static CPU* Get(common::uint32_t index);
+        // processors 0 to NumOnline()-1 are running
+        static common::uint32_t NumOnline();
+        // a timer interrupt for a processor that may be idle (tickless)
+        static void Wake(common::uint32_t index);
+
+        // once interrupts are active: routes the drivers' interrupts
+        // through the I/O APIC, starts the timer on every processor and the others
+        void Start(hardwarecommunication::InterruptManager* interrupts);
+    };
+}
+
+#endif
@@ -8,6 +8,9 @@
 #include <hardwarecommunication/pci.h>
 #include <hardwarecommunication/interrupts.h>
 #include <hardwarecommunication/port.h>
+#include <hardwarecommunication/deferredwork.h>
+#include <net/packetbuffer.h>
+#include <spinlock.h>
 
 
 namespace myos
@@ -17,6 +20,37 @@ namespace myos
         
         class amd_am79c973;
         
+        // frames a poll takes off the ring, a poll that uses it all
+        // leaves the receive interrupt off and polls again
+        const common::uint32_t NIC_POLL_BUDGET = 16;
+        
+        // log2 of the entries in a descriptor ring, the card takes up to 512
+        const common::uint8_t NIC_MAX_RING_ORDER = 9;
+        const common::uint8_t NIC_SEND_RING_ORDER = 6;
+        const common::uint8_t NIC_RECV_RING_ORDER = 7;
+        // one per descriptor, a whole frame fits
+        const common::uint32_t NIC_BUFFER_SIZE = 2048;
+        
+        // frames waiting for the send ring, beyond that Send says -EAGAIN
+        const common::uint32_t NIC_SEND_QUEUE_LENGTH = 256;
+        
+        struct NetworkSendStatistics
+        {
+            common::uint32_t sent;      // the card is done with them
+            common::uint32_t errors;    // ... but could not send them
+            common::uint32_t queued;    // waited for the ring on the way
+            common::uint32_t refused;   // the queue was full
+            common::uint32_t peakQueue;
+            common::uint32_t pending;   // in the ring or the queue right now
+        };
+        
+        // a piece of a frame, Send puts them together
+        struct NetworkSegment
+        {
+            common::uint8_t* data;
+            common::uint32_t size;
+        };
+        
         class RawDataHandler
         {
         protected:
@@ -66,30 +100,108 @@ namespace myos
             InitializationBlock initBlock;
             
             
+            // both rings share one block, the buffers are in two more
+            common::uint8_t sendRingOrder;
+            common::uint8_t recvRingOrder;
+            
+            // avail: 0 ---> its own buffer, 1 ---> a kept receive buffer,
+            // a PacketBuffer* otherwise, freed once the card sent it
             BufferDescriptor* sendBufferDescr;
-            common::uint8_t sendBufferDescrMemory[2048+15];
-            common::uint8_t sendBuffers[2*1024+15][8];
-            common::uint8_t currentSendBuffer;
+            common::uint8_t* sendBuffers;
+            common::uint32_t numSendBuffers;
+            common::uint32_t currentSendBuffer; // the next one to fill
+            common::uint32_t dirtySendBuffer;   // the oldest not reaped yet
+            common::uint32_t sendInFlight;
+            Spinlock sendLock;
+            
+            // behind a full ring, linked through PacketBuffer::next
+            net::PacketBuffer* sendQueueHead;
+            net::PacketBuffer* sendQueueTail;
+            common::uint32_t sendQueueLength;
+            
+            // on SENT: gives back what the card is done with, then refills
+            // the ring from the queue
+            hardwarecommunication::DeferredWork reapWork;
+            static void Reap(void* nic);
+            void ReapSent();
             
+            common::uint32_t framesSent;
+            common::uint32_t sendErrors;
+            common::uint32_t framesQueued;
+            common::uint32_t sendsRefused;
+            common::uint32_t peakSendQueue;
+            
+            // twice the ring: what a handler keeps is replaced by a spare
             BufferDescriptor* recvBufferDescr;
-            common::uint8_t recvBufferDescrMemory[2048+15];
-            common::uint8_t recvBuffers[2*1024+15][8];
-            common::uint8_t currentRecvBuffer;
+            common::uint8_t* recvBuffers;
+            common::uint32_t numRecvBuffers;
+            common::uint32_t currentRecvBuffer;
+            common::uint8_t* spareRecvBuffers; // linked through their first word
+            common::uint32_t numSpareRecvBuffers;
+            Spinlock spareLock;
+            
+            // the descriptor is the driver's again, gives back what it sent from
+            void Reclaim(BufferDescriptor* descriptor, common::uint32_t index);
+            // true if the next frame can go into the ring right away,
+            // with sendLock held
+            bool SendSlotFree();
+            // hands the current send descriptor to the card
+            void Transmit(common::uint32_t size);
+            void TransmitPacket(net::PacketBuffer* packet);
+            // a kept receive buffer goes out as it is
+            void SendReceiveBuffer(common::uint8_t* frame, common::uint32_t size);
             
             
             RawDataHandler* handler;
             
+            // RAP selects the register RDP reads and writes, the
+            // pair must not be split by the interrupt or another processor
+            Spinlock registerLock;
+            common::uint16_t ReadRegister(common::uint16_t csr);
+            void WriteRegister(common::uint16_t csr, common::uint16_t value);
+            
+            // NAPI: the receive interrupt only masks itself and schedules
+            // the poll, which takes the frames up the stack
+            hardwarecommunication::DeferredWork pollWork;
+            static void Poll(void* nic);
+            void PollReceive();
+            bool polling; // the last poll used up its budget
+            
+            common::uint32_t receiveInterrupts;
+            common::uint32_t polls;
+            common::uint32_t interruptFrames; // by the first poll after an interrupt
+            common::uint32_t pollingFrames;   // by the polls that followed a full one
+            
         public:
+            static amd_am79c973* activeNetworkCard; // the last one found
+            
             amd_am79c973(myos::hardwarecommunication::PeripheralComponentInterconnectDeviceDescriptor *dev,
-                         myos::hardwarecommunication::InterruptManager* interrupts);
+                         myos::hardwarecommunication::InterruptManager* interrupts,
+                         common::uint8_t sendRingOrder = NIC_SEND_RING_ORDER,
+                         common::uint8_t recvRingOrder = NIC_RECV_RING_ORDER);
             ~amd_am79c973();
             
             void Activate();
             int Reset();
             common::uint32_t HandleInterrupt(common::uint32_t esp);
             
-            void Send(common::uint8_t* buffer, int count);
-            void Receive();
+            // 0 once the frame is in the ring or queued behind it,
+            // -EAGAIN if the queue is full too, -ENOMEM if the card got no rings
+            common::int32_t Send(common::uint8_t* buffer, int count);
+            // gathered into the descriptor's buffer, or a packet for the queue
+            common::int32_t Send(NetworkSegment* segments, common::uint32_t numSegments);
+            // sent from where it is, the driver frees it (not on an error)
+            common::int32_t Send(net::PacketBuffer* packet);
+            void GetSendStatistics(NetworkSendStatistics* stats);
+            // frames taken off the ring, at most budget
+            common::uint32_t Receive(common::uint32_t budget = NIC_POLL_BUDGET);
+            // zero copy receive: the frame a handler is given (any pointer into
+            // it) stays its own after OnRawDataReceived, a spare takes its
+            // place in the ring. false ---> no spare left, it has to copy
+            bool KeepReceiveBuffer(common::uint8_t* frame);
+            void ReturnReceiveBuffer(common::uint8_t* frame);
+            // receive mitigation, spares left and the send counters
+            void Report(void (*print)(char*));
             
             void SetHandler(RawDataHandler* handler);
             common::uint64_t GetMACAddress();
@@ -0,0 +1,35 @@
+#ifndef __MYOS__DRIVERS__SERIAL_H
+#define __MYOS__DRIVERS__SERIAL_H
+
+#include <common/types.h>
+#include <hardwarecommunication/port.h>
+
+namespace myos
+{
+    namespace drivers
+    {
+        
+        // 16550 UART, polled and output only (115200 8N1), for reports
+        // that should not end up on the screen (QEMU: -serial stdio)
+        class SerialPort
+        {
+        protected:
+            hardwarecommunication::Port8Bit dataPort;
+            hardwarecommunication::Port8Bit interruptEnablePort;
+            hardwarecommunication::Port8Bit fifoControlPort;
+            hardwarecommunication::Port8Bit lineControlPort;
+            hardwarecommunication::Port8Bit modemControlPort;
+            hardwarecommunication::Port8Bit lineStatusPort;
+        public:
+            
+            SerialPort(common::uint16_t portBase = 0x3F8); // COM1
+            ~SerialPort();
+            
+            void Write(char c);
+            void Write(char* str);
+        };
+        
+    }
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __MYOS__FILES_H
+#define __MYOS__FILES_H
+
+#include <common/types.h>
+#include <common/errors.h>
+
+namespace myos
+{
+
+    const common::uint32_t MAX_FILES = 8; // descriptors per task
+    const common::uint32_t MAX_DEVICE_FILES = 16;
+    const common::uint32_t MAX_PATH = 64; // with the terminating 0
+
+
+    // what a descriptor refers to, shared by fork; the TaskManager takes
+    // and drops the references with its lock held
+    class File
+    {
+    protected:
+        common::uint32_t references;
+
+        // the last reference is gone
+        virtual void Close();
+
+    public:
+        File();
+        virtual ~File();
+
+        void Acquire();
+        void Release();
+
+        // bytes done, or a negative Error
+        virtual common::int32_t Read(common::uint8_t* buffer, common::uint32_t size);
+        virtual common::int32_t Write(const common::uint8_t* buffer, common::uint32_t size);
+    };
+
+
+    // printf, reads give end of file
+    class ConsoleFile : public File
+    {
+    public:
+        ConsoleFile();
+        ~ConsoleFile();
+        virtual common::int32_t Read(common::uint8_t* buffer, common::uint32_t size);
+        virtual common::int32_t Write(const common::uint8_t* buffer, common::uint32_t size);
+    };
+
+    // takes everything, reads give end of file
+    class NullFile : public File
+    {
+    public:
+        NullFile();
+        ~NullFile();
+        virtual common::int32_t Read(common::uint8_t* buffer, common::uint32_t size);
+        virtual common::int32_t Write(const common::uint8_t* buffer, common::uint32_t size);
+    };
+
+
+    // the names open() knows, there is no file system behind them
+    class DeviceFiles
+    {
+    protected:
+        static const char* names[MAX_DEVICE_FILES];
+        static File* files[MAX_DEVICE_FILES];
+        static common::uint32_t numFiles;
+
+    public:
+        // the file has to live as long as the kernel
+        static bool Register(const char* name, File* file);
+        static File* Open(const char* name);
+    };
+}
+
+#endif
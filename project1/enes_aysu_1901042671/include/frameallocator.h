@@ -0,0 +1,79 @@
+#ifndef __MYOS__FRAMEALLOCATOR_H
+#define __MYOS__FRAMEALLOCATOR_H
+
+#include <common/types.h>
+#include <spinlock.h>
+
+namespace myos
+{
+
+    // the parts of the multiboot information we use
+    struct MultibootInformation
+    {
+        common::uint32_t flags;
+        common::uint32_t memLower; // KiB below 1 MiB
+        common::uint32_t memUpper; // KiB above 1 MiB
+        common::uint32_t bootDevice;
+        common::uint32_t cmdline;
+        common::uint32_t modsCount;
+        common::uint32_t modsAddr;
+        common::uint32_t syms[4];
+        common::uint32_t mmapLength;
+        common::uint32_t mmapAddr;
+    } __attribute__((packed));
+
+    struct MultibootMemoryMapEntry
+    {
+        common::uint32_t size; // of the rest of the entry
+        common::uint64_t address;
+        common::uint64_t length;
+        common::uint32_t type; // 1 ---> usable RAM
+    } __attribute__((packed));
+
+
+    // blocks of 2^order frames, order 10 is 4 MiB
+    const common::uint8_t MAX_FRAME_ORDER = 10;
+    const common::uint32_t FRAME_SIZE = 4096;
+
+
+    // buddy system over all usable RAM in the multiboot memory map,
+    // blocks are aligned to their own size
+    class FrameAllocator
+    {
+    protected:
+        struct FreeBlock
+        {
+            FreeBlock* next;
+            FreeBlock* prev;
+        };
+
+        FreeBlock* freeLists[MAX_FRAME_ORDER + 1];
+        common::uint8_t* frameStates; // FRAME_FREE | order at the first frame of a free block
+        common::uint32_t numFrames;   // up to the end of the highest usable region
+        common::uint32_t totalFrames; // usable ones
+        common::uint32_t freeFrames;
+
+        void Push(common::uint32_t frame, common::uint8_t order);
+        void Remove(common::uint32_t frame, common::uint8_t order);
+        void AddRange(common::uint64_t start, common::uint64_t end);
+
+    public:
+        static FrameAllocator* activeFrameAllocator;
+        // also guards PagingManager's reference counts, so that the page
+        // fault task needs no other lock
+        static Spinlock lock;
+
+        FrameAllocator(const void* multiboot_structure);
+        ~FrameAllocator();
+
+        void* Allocate(common::uint8_t order);
+        void Free(void* block, common::uint8_t order);
+        static common::uint8_t Order(common::size_t size); // MAX_FRAME_ORDER + 1 if too big
+
+        common::uint32_t MemoryEnd();
+        common::uint32_t TotalFrames();
+        common::uint32_t FreeFrames();
+    };
+}
+
+#endif
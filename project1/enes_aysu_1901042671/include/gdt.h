@@ -6,6 +6,42 @@
 namespace myos
 {
     
+    // hardware task state, only used for the kernel's own context and for
+    // fault handlers that can't run on the faulting stack
+    struct TaskStateSegment
+    {
+        myos::common::uint32_t previousTask;
+        myos::common::uint32_t esp0;
+        myos::common::uint32_t ss0;
+        myos::common::uint32_t esp1;
+        myos::common::uint32_t ss1;
+        myos::common::uint32_t esp2;
+        myos::common::uint32_t ss2;
+        myos::common::uint32_t cr3;
+        myos::common::uint32_t eip;
+        myos::common::uint32_t eflags;
+        myos::common::uint32_t eax;
+        myos::common::uint32_t ecx;
+        myos::common::uint32_t edx;
+        myos::common::uint32_t ebx;
+        myos::common::uint32_t esp;
+        myos::common::uint32_t ebp;
+        myos::common::uint32_t esi;
+        myos::common::uint32_t edi;
+        myos::common::uint32_t es;
+        myos::common::uint32_t cs;
+        myos::common::uint32_t ss;
+        myos::common::uint32_t ds;
+        myos::common::uint32_t fs;
+        myos::common::uint32_t gs;
+        myos::common::uint32_t ldt;
+        myos::common::uint16_t trap;
+        myos::common::uint16_t iomapBase;
+    } __attribute__((packed));
+    
+    struct CPU;
+    
+    // one per processor, they only differ in the TSS and CPU segments
     class GlobalDescriptorTable
     {
         public:
@@ -31,14 +67,21 @@ namespace myos
             SegmentDescriptor unusedSegmentSelector;
             SegmentDescriptor codeSegmentSelector;
             SegmentDescriptor dataSegmentSelector;
+            SegmentDescriptor taskStateSegmentSelector;
+            SegmentDescriptor pageFaultTaskStateSegmentSelector;
+            SegmentDescriptor cpuSegmentSelector; // loaded into %gs
 
         public:
 
-            GlobalDescriptorTable();
+            // 0 ---> the boot processor
+            GlobalDescriptorTable(CPU* cpu = 0);
             ~GlobalDescriptorTable();
 
             myos::common::uint16_t CodeSegmentSelector();
             myos::common::uint16_t DataSegmentSelector();
+            myos::common::uint16_t TaskStateSegmentSelector();
+            myos::common::uint16_t PageFaultTaskStateSegmentSelector();
+            myos::common::uint16_t CPUSegmentSelector();
     };
 
 }
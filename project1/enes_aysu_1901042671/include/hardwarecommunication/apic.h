@@ -0,0 +1,82 @@
+#ifndef __MYOS__HARDWARECOMMUNICATION__APIC_H
+#define __MYOS__HARDWARECOMMUNICATION__APIC_H
+
+#include <common/types.h>
+#include <cpu.h>
+
+namespace myos
+{
+    namespace hardwarecommunication
+    {
+
+        // what the ACPI MADT says about the processors and interrupt controllers
+        struct APICConfiguration
+        {
+            common::uint32_t localAPICAddress;
+            common::uint32_t ioAPICAddress;
+            common::uint32_t ioAPICBase;       // its first global system interrupt
+            common::uint8_t apicIds[MAX_CPUS]; // enabled processors
+            common::uint32_t numProcessors;
+            common::uint32_t irqToGSI[16];     // ISA IRQ ---> I/O APIC input
+            common::uint16_t irqFlags[16];     // polarity and trigger mode (MPS INTI flags)
+
+            // false ---> no MADT, stay with the PIC
+            static bool Read(APICConfiguration* config);
+        };
+
+
+        // every processor sees its own local APIC at the same address
+        class LocalAPIC
+        {
+        protected:
+            static volatile common::uint32_t* registers;
+
+            static common::uint32_t Read(common::uint32_t offset);
+            static void Write(common::uint32_t offset, common::uint32_t value);
+            static void SendCommand(common::uint8_t apicId, common::uint32_t command);
+
+        public:
+            static void SetAddress(common::uint32_t address);
+
+            // software enable, spurious interrupts go to 0xFF
+            static void Enable();
+            static common::uint8_t Id();
+            static void EndOfInterrupt();
+
+            static void SendInit(common::uint8_t apicId);
+            static void SendStartup(common::uint8_t apicId, common::uint32_t address);
+            static void SendInterrupt(common::uint8_t apicId, common::uint8_t vector);
+
+            // timer counts in 10 ms
+            static common::uint32_t CalibrateTimer();
+            // one interrupt after count timer counts
+            static void StartOneShot(common::uint8_t vector, common::uint32_t count);
+        };
+
+
+        class IOAPIC
+        {
+        protected:
+            volatile common::uint32_t* registers;
+            common::uint32_t gsiBase;
+
+            common::uint32_t Read(common::uint8_t index);
+            void Write(common::uint8_t index, common::uint32_t value);
+
+        public:
+            IOAPIC(common::uint32_t address, common::uint32_t gsiBase);
+            ~IOAPIC();
+
+            common::uint32_t NumInputs();
+            void Route(common::uint32_t gsi, common::uint8_t vector, common::uint8_t apicId, common::uint16_t flags);
+            void Mask(common::uint32_t gsi);
+        };
+
+
+        // busy waits on channel 2 of the PIT, at most 54 ms
+        void PITDelay(common::uint32_t microseconds);
+
+    }
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __MYOS__HARDWARECOMMUNICATION__DEFERREDWORK_H
+#define __MYOS__HARDWARECOMMUNICATION__DEFERREDWORK_H
+
+#include <common/types.h>
+#include <cpu.h>
+
+namespace myos
+{
+    namespace hardwarecommunication
+    {
+
+        // items run per interrupt, what is left (e.g. a poll that keeps
+        // scheduling itself) waits for the next one
+        const common::uint32_t DEFERRED_WORK_BUDGET = 32;
+
+        // the bottom half of a driver: its interrupt handler only acknowledges
+        // the device and schedules this, which then runs with interrupts on
+        // when the outermost interrupt of that processor is about to return
+        class DeferredWork
+        {
+            friend class DeferredWorkQueue;
+            protected:
+                void (*function)(void* data);
+                void* data;
+                DeferredWork* next;
+                bool queued; // cleared before it runs, so it can be scheduled again meanwhile
+
+            public:
+                DeferredWork(void (*function)(void* data), void* data);
+                ~DeferredWork();
+
+                // with interrupts off, on the processor whose interrupt
+                // scheduled it before; nothing if it is still queued
+                void Schedule();
+        };
+
+
+        // one list per processor, only touched by that processor
+        class DeferredWorkQueue
+        {
+            protected:
+                static DeferredWork* head[MAX_CPUS];
+                static DeferredWork* tail[MAX_CPUS];
+                static bool running[MAX_CPUS];
+
+            public:
+                static void Add(DeferredWork* work);
+                // an interrupt that came in while the work runs must not
+                // switch tasks, the work would go on in the wrong one
+                static bool Running();
+                // left over on this processor, its timer has to keep ticking
+                static bool Pending();
+                // called with interrupts off and returns with them off,
+                // the cycles it took
+                static common::uint32_t Run();
+        };
+
+    }
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <multitasking.h>
 #include <common/types.h>
 #include <hardwarecommunication/port.h>
+#include <cpu.h>
 
 
 namespace myos
@@ -15,6 +16,11 @@ namespace myos
 
         class InterruptManager;
 
+        // per vector, read with the getInterruptStats syscall; the cycles
+        // are spent in DoHandleInterrupt with interrupts off, including a
+        // Schedule it ran but not the deferred work
+        typedef CycleStatistics InterruptStatistics;
+
         class InterruptHandler
         {
         protected:
@@ -22,9 +28,13 @@ namespace myos
             InterruptManager* interruptManager;
             common::uint32_t os_getPid();
             common::uint32_t os_getCPid();
-            common::int32_t os_fork(CPUState *cpu);
-            bool os_exit();
-            bool os_waitPid(common::uint32_t wPid);
+            common::int32_t os_fork(CPUState *cpu, const BatchParameters* batch = 0);
+            bool os_exit(common::int32_t status);
+            bool os_waitPid(CPUState* cpu);
+            bool os_sleep(common::uint32_t microseconds);
+            common::uint32_t os_reschedule(common::uint32_t esp);
+            common::int32_t os_getTaskStats(common::uint32_t pid, TaskStatistics* stats);
+            void os_accountSyscall();
             InterruptHandler(InterruptManager *interruptManager, myos::common::uint8_t InterruptNumber);
             ~InterruptHandler();
         public:
@@ -58,7 +68,12 @@ namespace myos
                     myos::common::uint32_t base;
                 } __attribute__((packed));
 
+                // only written by their own processor, with interrupts off
+                static InterruptStatistics statistics[MAX_CPUS][256];
+                bool tickDeferred[MAX_CPUS]; // a tick came in during deferred work
+
                 myos::common::uint16_t hardwareInterruptOffset;
+                bool apic; // acknowledge at the local APIC instead of the PIC
                 static void SetInterruptDescriptorTableEntry(myos::common::uint8_t interrupt,
                     myos::common::uint16_t codeSegmentSelectorOffset, void (*handler)(),
                     myos::common::uint8_t DescriptorPrivilegeLevel, myos::common::uint8_t DescriptorType);
@@ -119,6 +134,14 @@ namespace myos
                 InterruptManager(myos::common::uint16_t hardwareInterruptOffset, myos::GlobalDescriptorTable* globalDescriptorTable, myos::TaskManager* taskManager);
                 ~InterruptManager();
                 myos::common::uint16_t HardwareInterruptOffset();
+                // every processor loads the same table
+                static void LoadInterruptDescriptorTable();
+                // masks the PIC, the I/O APIC delivers from now on
+                void UseAPIC();
+                // summed over the processors
+                static void GetStatistics(myos::common::uint8_t interrupt, InterruptStatistics* stats);
+                // every vector seen so far, with its rate since boot
+                static void Report(void (*print)(char*));
                 void Activate();
                 void Deactivate();
         };
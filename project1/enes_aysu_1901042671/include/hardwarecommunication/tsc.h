@@ -0,0 +1,22 @@
+#ifndef __MYOS__HARDWARECOMMUNICATION__TSC_H
+#define __MYOS__HARDWARECOMMUNICATION__TSC_H
+
+#include <common/types.h>
+
+namespace myos
+{
+    namespace hardwarecommunication
+    {
+
+        // cycle counter of the current CPU, used for benchmarks
+        static inline common::uint64_t ReadTimeStampCounter()
+        {
+            common::uint32_t low, high;
+            __asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
+            return ((common::uint64_t)high << 32) | low;
+        }
+
+    }
+}
+
+#endif
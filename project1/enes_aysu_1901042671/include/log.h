@@ -0,0 +1,75 @@
+#ifndef __MYOS__LOG_H
+#define __MYOS__LOG_H
+
+#include <common/types.h>
+#include <spinlock.h>
+#include <timer.h>
+
+// the most verbose level built in, anything above is gone at compile time
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 3 // LOG_DEBUG
+#endif
+
+// a load and a compare, put in front of whatever builds the message
+#define LOG_ENABLED(subsystem, level) \
+    ((level) <= LOG_MAX_LEVEL && (level) <= myos::Log::levels[subsystem])
+
+namespace myos
+{
+
+    enum LogLevel
+    {
+        LOG_ERROR = 0,
+        LOG_WARNING = 1,
+        LOG_INFO = 2,
+        LOG_DEBUG = 3  // per packet and the like
+    };
+
+    enum LogSubsystem
+    {
+        LOG_KERNEL,
+        LOG_MEMORY,
+        LOG_SCHEDULER,
+        LOG_NETWORK,
+        NUM_LOG_SUBSYSTEMS
+    };
+
+    const common::uint32_t LOG_BUFFER_SIZE = 8192;
+    const common::uint32_t LOG_FLUSH_DELAY = 20000; // us
+
+
+    // messages go into a ring buffer and reach the sink (the screen
+    // unless set otherwise) from a timer a little later, not on the
+    // path of whoever logged them. Before the timers are up, and for
+    // errors, they are written out at once
+    class Log
+    {
+        protected:
+            static char buffer[LOG_BUFFER_SIZE];
+            static common::uint32_t head; // both count up forever
+            static common::uint32_t tail;
+            static common::uint32_t dropped; // the buffer was full
+            static Spinlock lock;
+            static Timer flushTimer;
+            static void (*sink)(char*);
+
+            static void Append(char* text);
+            static void ScheduleFlush(LogLevel level);
+            static void FlushTimer(void* data);
+
+        public:
+            static common::uint8_t levels[NUM_LOG_SUBSYSTEMS]; // the most verbose one kept
+
+            static void SetLevel(LogSubsystem subsystem, LogLevel level);
+            static LogLevel GetLevel(LogSubsystem subsystem);
+            static void SetSink(void (*sink)(char*));
+
+            static void Write(LogSubsystem subsystem, LogLevel level, char* text);
+            // "XX " for every byte
+            static void WriteHex(LogSubsystem subsystem, LogLevel level, common::uint8_t* data, common::uint32_t size);
+            // everything buffered to the sink
+            static void Flush();
+    };
+}
+
+#endif
@@ -3,6 +3,13 @@
 #define __MYOS__MEMORYMANAGEMENT_H
 
 #include <common/types.h>
+#include <frameallocator.h>
+#include <spinlock.h>
+#include <cpu.h>
+
+// counters, per call site accounting and a leak dump for the heap,
+// costs 8 more bytes per chunk and bypasses the task caches
+// #define HEAPSTATISTICS
 
 
 namespace myos
@@ -10,11 +17,72 @@ namespace myos
     
     struct MemoryChunk
     {
-        MemoryChunk *next;
+        MemoryChunk *next; // neighbours in memory
         MemoryChunk *prev;
         bool allocated;
         common::size_t size;
+#ifdef HEAPSTATISTICS
+        void* caller;
+        common::uint32_t sequence; // number of the allocation
+#endif
+    };
+    
+    // kept in the payload while a chunk is free
+    struct FreeChunkLinks
+    {
+        MemoryChunk *nextFree;
+        MemoryChunk *prevFree;
+    };
+    
+    // segregated fits: free chunks of size [2^n, 2^(n+1)) are on list n
+    const common::uint32_t NUM_SIZE_CLASSES = 32;
+    const common::size_t MIN_CHUNK_SIZE = 8; // payloads are multiples of this
+    
+    // when full, the heap grows by at least 2^this frames (1 MiB)
+    const common::uint8_t HEAP_GROW_ORDER = 8;
+    
+    
+    // payloads of 8, 16, ..., 128 bytes are served from a magazine of
+    // free chunks in the running task's cache before the global lists
+    const common::uint32_t NUM_CACHED_CLASSES = 5;
+    const common::size_t MAX_CACHED_SIZE = 128;
+    const common::uint32_t MAGAZINE_SIZE = 8; // refills and drains move half of it
+    
+    // one per task, the chunks in it stay allocated as far as the
+    // global lists are concerned
+    struct ThreadCache
+    {
+        void* magazines[NUM_CACHED_CLASSES][MAGAZINE_SIZE];
+        common::uint8_t rounds[NUM_CACHED_CLASSES]; // chunks in each magazine
+        
+        ThreadCache();
+    };
+    
+    
+    // read with the getHeapStats syscall
+    struct HeapStatistics
+    {
+        common::uint32_t bytesInUse; // payloads, without chunk headers
+        common::uint32_t peakBytesInUse;
+        common::uint32_t allocations;
+        common::uint32_t frees;
+        common::uint32_t failures;
+        common::uint32_t regions;
+        common::uint32_t freeChunks[NUM_SIZE_CLASSES]; // by size class
+    };
+    
+#ifdef HEAPSTATISTICS
+    const common::uint32_t MAX_HEAP_CALL_SITES = 64;
+    const common::uint32_t MAX_HEAP_REGIONS = 64;
+    
+    struct HeapCallSite
+    {
+        void* caller;
+        common::uint32_t allocations;
+        common::uint32_t liveAllocations;
+        common::uint32_t liveBytes;
     };
+#endif
     
     
     class MemoryManager
@@ -22,6 +90,34 @@ namespace myos
         
     protected:
         MemoryChunk* first;
+        MemoryChunk* freeLists[NUM_SIZE_CLASSES];
+        common::uint32_t freeListBitmap; // bit n set <=> freeLists[n] != 0
+        
+        static common::uint32_t SizeClass(common::size_t size);
+        static FreeChunkLinks* Links(MemoryChunk* chunk);
+        void InsertFree(MemoryChunk* chunk);
+        void RemoveFree(MemoryChunk* chunk);
+        bool Grow(common::size_t size);
+        
+        // the global lists, only called with the lock held
+        void* Allocate(common::size_t size, void* caller);
+        void Release(void* ptr);
+        Spinlock lock;
+        
+        // the caches themselves are only used with interrupts off,
+        // no other processor runs the same task at the same time
+        ThreadCache bootCaches[MAX_CPUS]; // kernelMain's and the idle loops'
+        ThreadCache* LocalCache();
+        
+        static common::uint32_t CachedClass(common::size_t size); // NUM_CACHED_CLASSES if none
+        
+#ifdef HEAPSTATISTICS
+        HeapStatistics stats;
+        HeapCallSite callSites[MAX_HEAP_CALL_SITES];
+        MemoryChunk* regions[MAX_HEAP_REGIONS];
+        
+        HeapCallSite* CallSite(void* caller);
+#endif
     public:
         
         static MemoryManager *activeMemoryManager;
@@ -30,7 +126,23 @@ namespace myos
         ~MemoryManager();
         
         void* malloc(common::size_t size);
+        void* malloc(common::size_t size, void* caller); // caller for the statistics
         void free(void* ptr);
+        
+        // 0 ---> the idle cache, called by the scheduler on every switch
+        void SetCache(ThreadCache* cache);
+        // gives all chunks in the cache back to the global lists
+        void Drain(ThreadCache* cache);
+        
+        // false if built without HEAPSTATISTICS
+        bool GetStatistics(HeapStatistics* stats);
+        // print is called with pieces of text, e.g. to the screen or serial port
+        void Report(void (*print)(char*));
+        // chunks allocated after the given allocation count and still in use
+        void DumpLeaks(void (*print)(char*), common::uint32_t since = 0);
+        
+        // the regions are never merged with each other
+        void AddRegion(common::size_t start, common::size_t size);
     };
 }
 
@@ -45,5 +157,9 @@ void* operator new[](unsigned size, void* ptr);
 void operator delete(void* ptr);
 void operator delete[](void* ptr);
 
+// sized delete, emitted by the compiler for objects of known size
+void operator delete(void* ptr, unsigned size);
+void operator delete[](void* ptr, unsigned size);
+
 
 #endif
\ No newline at end of file
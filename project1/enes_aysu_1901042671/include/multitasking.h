@@ -1,9 +1,14 @@
- 
+
 #ifndef __MYOS__MULTITASKING_H
 #define __MYOS__MULTITASKING_H
 
 #include <common/types.h>
 #include <gdt.h>
+#include <paging.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <timer.h>
+#include <files.h>
 
 namespace myos
 {
@@ -34,50 +39,212 @@ namespace myos
     } __attribute__((packed));
     
     
+    // per task accounting, read with the getTaskStats syscall
+    struct TaskStatistics
+    {
+        common::uint32_t ticksRun;        // timer ticks spent running
+        common::uint32_t ticksWaiting;    // timer ticks spent ready or blocked
+        common::uint32_t contextSwitches; // times the task was switched in
+        common::uint32_t syscalls;
+    };
+    
+    
+    enum TaskState
+    {
+        FINISHED = 0,
+        WAITING = 1,
+        READY = 2,
+        RUNNING = 3,
+        ZOMBIE = 4
+    };
+    
+    // multi-level feedback queue: level 0 is the highest priority,
+    // a task that burns its whole quantum sinks one level
+    const common::uint16_t MAX_TASKS = 256;
+    const common::uint8_t NUM_PRIORITY_LEVELS = 8;
+    const common::uint32_t PRIORITY_BOOST_INTERVAL = 64; // ticks
+    
+    enum SchedulingClass
+    {
+        INTERACTIVE = 0, // the feedback queue
+        BATCH = 1        // only runs while no interactive task is ready
+    };
+    
+    // batch tasks run shortest expected remaining CPU time first
+    const common::uint8_t BATCH_DEFAULT_SLICE = 4; // ticks
+    
+    // for forkBatch, the child (and its own children) run in the batch class
+    struct BatchParameters
+    {
+        common::uint32_t expectedTicks; // CPU time the task is expected to need
+        common::uint8_t slice;          // ticks per turn, 0 ---> BATCH_DEFAULT_SLICE
+        common::uint8_t quota;          // ticks per PRIORITY_BOOST_INTERVAL, 0 ---> no limit
+    };
+    
+    // stack size classes, mapped right below TASK_STACK_TOP with an
+    // unmapped guard page under them; requests are rounded up
+    const common::uint32_t TASK_STACK_SMALL = 4*1024;
+    const common::uint32_t TASK_STACK_MEDIUM = 16*1024;
+    const common::uint32_t TASK_STACK_LARGE = 64*1024;
+    
+    
+    class Task;
+    
+    // tasks blocked on some event, linked through Task::nextWaiting
+    class WaitQueue
+    {
+        friend class TaskManager;
+        private:
+            Task* head;
+            Task* tail;
+
+        public:
+            WaitQueue();
+            ~WaitQueue();
+            bool IsEmpty();
+    };
+    
+    
     class Task
     {
         friend class TaskManager;
         private:
             static common::uint32_t pIdCounter;
-            common::uint8_t stack[4096]; // 4 KiB
             common::uint32_t pid = 0;
             common::uint32_t pPid = 0; // parent pid
             common::uint32_t cPid = 0; //child pid
-            common::uint8_t taskState = 0; // 0 ---> waiting state , 1 ---> ready state, 2 ---> running state
-            common::uint32_t waitPid;
-            CPUState* cpustate;
+            TaskState taskState = FINISHED;
+            common::int32_t waitPid; // -1 ---> any child
+            common::int32_t exitStatus = 0;
+            CPUState* cpustate; // in the task's own address space
+            CPUState initialState; // only for tasks handed to AddTask
+            AddressSpace* addressSpace = 0;
+            common::uint32_t stackSize = 0; // one of the size classes
+            ThreadCache heapCache; // small chunks freed while it ran
+            
+            // wait queue links, only valid while the task is WAITING
+            WaitQueue* waitingOn = 0;
+            Task* nextWaiting = 0;
+            WaitQueue childExit; // the task itself, blocked in waitpid
+            Timer sleepTimer; // wakes it from Sleep
+            
+            // run queue links, only valid while the task is READY
+            Task* nextReady = 0;
+            Task* prevReady = 0;
+            common::uint8_t priority = 0;
+            common::uint8_t ticksLeft = 0; // remaining quantum
+            common::uint8_t cpu = 0; // whose run queue it is on, fixed at creation
+            common::uint32_t boostEpoch = 0;
+            
+            SchedulingClass schedulingClass = INTERACTIVE;
+            common::uint32_t expectedTicks = 0; // batch only, like the rest below
+            common::uint8_t batchSlice = 0;
+            common::uint8_t quota = 0;
+            common::uint8_t quotaUsed = 0; // since the last boost
+            
+            common::int16_t nextInHash = -1; // next slot in the same pid bucket
+            
+            TaskStatistics stats = {0, 0, 0, 0};
+            common::uint32_t lastTick = 0; // tick at which it last left the CPU
+            
+            File* files[MAX_FILES] = {}; // by descriptor, 0 ---> not open
+            common::uint32_t mapEnd = TASK_WINDOW_BASE; // mmap hands the window out from the bottom
 
         public:
-            Task(GlobalDescriptorTable *gdt, void entrypoint());
+            Task(GlobalDescriptorTable *gdt, void entrypoint(), common::uint32_t stackSize = TASK_STACK_SMALL);
             ~Task();
             Task();
             common::uint32_t getId();
     };
 
+    // the part of the scheduler that belongs to one processor
+    struct RunQueue
+    {
+        Task* readyHead[NUM_PRIORITY_LEVELS];
+        Task* readyTail[NUM_PRIORITY_LEVELS];
+        common::uint32_t readyBitmap; // bit n set <=> readyHead[n] != 0
+        Task* batchHead; // linked through nextReady, by expected remaining time
+        Task* throttledHead; // batch tasks out of quota until the next boost
+        int currentTask; // -1 ---> idle
+        CPUState* idleState; // the processor's idle loop, resumed when nothing is ready
+        AddressSpace* deadAddressSpace; // of the exited task we may still be running on
+        int deadTask; // its slot, not handed out again before we switched away
+        common::uint32_t load; // live tasks placed here
+    };
+    
     class TaskManager
     {
         private:
-            Task tasks[256];
-            int numTasks;
-            int currentTask;
+            Task tasks[MAX_TASKS];
+            int numTasks; // slots in use
+            
+            common::uint8_t freeSlots[MAX_TASKS];
+            int numFreeSlots;
+            common::int16_t pidHash[MAX_TASKS]; // pid % MAX_TASKS ---> first slot
+            
+            // a task only ever runs on the processor it was placed on,
+            // so none can pick it while another is still on its stack
+            RunQueue runQueues[MAX_CPUS];
+            common::uint32_t boostEpoch;
+            common::uint32_t ticks; // SCHEDULER_TICKs, caught up with the clock
+            Spinlock lock; // everything above, taken by the public methods
+            WaitQueue sleepers;
+            
+            static common::uint8_t Quantum(common::uint8_t priority);
+            static common::uint8_t TimeSlice(Task* task);
+            static common::uint32_t Remaining(Task* task);
+            static common::uint32_t StackSizeClass(common::uint32_t size);
+            RunQueue* LocalQueue();
+            Task* CurrentTask(); // 0 ---> this processor is idle
+            void Place(Task* task);
+            void Enqueue(Task* task);
+            void EnqueueBatch(Task* task);
+            void Unlink(Task* task, common::uint8_t priority);
+            Task* PickNext(RunQueue* queue);
+            void Boost();
+            CPUState* SwitchTo(Task* next);
+            Task* AllocateTask(common::uint32_t pPid);
+            void FreeTask(int index);
+            void DropAddressSpace(Task* task);
+            void ReleaseFiles(Task* task);
 
         public:
+            static TaskManager* activeTaskManager;
+            
             //void PrintProcessTable();
-            common::uint32_t ForkTask(CPUState *cpustate);
+            // batch == 0 ---> the child runs in its parent's class
+            common::uint32_t ForkTask(CPUState *cpustate, const BatchParameters* batch = 0);
             common::uint32_t ExecTask(void entrypoint());
             common::uint32_t AddTask(void entrypoint());
             common::uint32_t GetPID();
             common::uint32_t GetCPID();
             void taskTable();
+            bool GetTaskStatistics(common::uint32_t pid, TaskStatistics* stats);
+            void AccountSyscall();
+            // descriptors of the calling task, AddFile takes a reference;
+            // on -EMFILE a file nothing else refers to is closed
+            common::int32_t AddFile(File* file); // the lowest free one, or -EMFILE
+            File* GetFile(common::int32_t fd);
+            common::int32_t CloseFile(common::int32_t fd);
+            // zeroed pages in the calling task's window, 0 if they don't fit
+            common::uint32_t MapMemory(common::uint32_t size);
             int getIndex(common::uint32_t pid);
-            bool ExitTask();
-            bool WaitTask(common::uint32_t esp);
+            bool ExitTask(common::int32_t status);
+            bool WaitTask(CPUState* cpustate);
+            void Block(WaitQueue* queue);
+            // blocks the calling task, the caller has to Reschedule afterwards
+            bool Sleep(common::uint32_t microseconds);
+            static void SleepExpired(void* task); // Task::sleepTimer's callback
+            void WakeUp(Task* task);
+            void WakeUpAll(WaitQueue* queue);
             bool ExitCurrentTask();
             
             TaskManager();
             ~TaskManager();
             bool AddTask(Task *task);
             CPUState* Schedule(CPUState* cpustate);
+            CPUState* Reschedule(CPUState* cpustate);
+            bool IsIdle(); // this processor
     };
 }
-#endif
\ No newline at end of file
+#endif
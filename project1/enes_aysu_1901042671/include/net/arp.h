@@ -5,6 +5,10 @@
 
 #include <common/types.h>
 #include <net/etherframe.h>
+#include <net/packetbuffer.h>
+#include <slab.h>
+#include <spinlock.h>
+#include <timer.h>
 
 
 namespace myos
@@ -30,12 +34,53 @@ namespace myos
         
         
         
+        const common::uint32_t ARP_TABLE_SIZE = 64;    // buckets, by IP
+        const common::uint32_t ARP_MAX_ENTRIES = 128;
+        const common::uint32_t ARP_MAX_PENDING = 8;    // packets waiting per entry
+        const common::uint32_t ARP_ENTRY_TTL = 300000000; // us, then it is asked again
+        const common::uint32_t ARP_RETRY_INTERVAL = 1000000; // us, also how often the table is swept
+        const common::uint32_t ARP_MAX_REQUESTS = 3;   // before the host counts as unreachable
+        
+        struct AddressResolutionProtocolEntry
+        {
+            common::uint32_t IP_BE;
+            common::uint64_t MAC;
+            bool resolved;
+            common::uint64_t expires;   // TimerManager::Now() the MAC is good until
+            common::uint32_t requests;  // sent while unresolved
+            
+            // sent once the reply is in, linked through PacketBuffer::next
+            PacketBuffer* pendingHead;
+            PacketBuffer* pendingTail;
+            common::uint32_t numPending;
+            common::uint16_t etherType_BE; // of the pending packets
+            
+            AddressResolutionProtocolEntry* next; // in the bucket
+        };
+        
+        
         class AddressResolutionProtocol : public EtherFrameHandler
         {
+            AddressResolutionProtocolEntry* table[ARP_TABLE_SIZE];
+            common::uint32_t numEntries;
+            SlabCache<AddressResolutionProtocolEntry> entryCache;
+            Spinlock lock; // the receive path, the timer and senders on every processor
+            
+            // resends the requests, gives up on hosts that never answered
+            // and drops what expired, runs while the table isn't empty
+            Timer timer;
+            static void Tick(void* arp);
+            void Sweep();
             
-            common::uint32_t IPcache[128];
-            common::uint64_t MACcache[128];
-            int numCacheEntries;
+            // with lock held
+            AddressResolutionProtocolEntry* Find(common::uint32_t IP_BE);
+            // Find, or a new entry (0 if the table is full); request ---> it
+            // isn't resolved (any more) and nobody has asked yet
+            AddressResolutionProtocolEntry* Lookup(common::uint32_t IP_BE, bool* request);
+            void Remove(AddressResolutionProtocolEntry* entry);
+            void StartTimer();
+            // a reply or a request for us: the sender's MAC, and what waited for it
+            void Update(common::uint32_t IP_BE, common::uint64_t MAC, bool create);
             
         public:
             AddressResolutionProtocol(EtherFrameProvider* backend);
@@ -44,8 +89,14 @@ namespace myos
             bool OnEtherFrameReceived(common::uint8_t* etherframePayload, common::uint32_t size);
 
             void RequestMACAddress(common::uint32_t IP_BE);
+            // broadcast if it isn't known (yet)
             common::uint64_t GetMACFromCache(common::uint32_t IP_BE);
+            // doesn't wait: the MAC if it is known, broadcast otherwise
+            // (after asking for it)
             common::uint64_t Resolve(common::uint32_t IP_BE);
+            // sends the packet to IP_BE, or queues it on its entry until the
+            // reply comes in. 0 or a negative Error, the packet is ARP's either way
+            common::int32_t SendTo(common::uint32_t IP_BE, common::uint16_t etherType_BE, PacketBuffer* packet);
             void BroadcastMACAddress(common::uint32_t IP_BE);
         };
         
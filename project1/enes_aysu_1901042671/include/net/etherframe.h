@@ -5,7 +5,9 @@
 
 #include <common/types.h>
 #include <drivers/amd_am79c973.h>
+#include <net/packetbuffer.h>
 #include <memorymanagement.h>
+#include <slab.h>
 
 
 namespace myos
@@ -37,7 +39,8 @@ namespace myos
             ~EtherFrameHandler();
             
             virtual bool OnEtherFrameReceived(common::uint8_t* etherframePayload, common::uint32_t size);
-            void Send(common::uint64_t dstMAC_BE, common::uint8_t* etherframePayload, common::uint32_t size);
+            common::int32_t Send(common::uint64_t dstMAC_BE, common::uint8_t* etherframePayload, common::uint32_t size);
+            common::int32_t Send(common::uint64_t dstMAC_BE, PacketBuffer* packet);
             common::uint32_t GetIPAddress();
         };
         
@@ -52,7 +55,11 @@ namespace myos
             ~EtherFrameProvider();
             
             bool OnRawDataReceived(common::uint8_t* buffer, common::uint32_t size);
-            void Send(common::uint64_t dstMAC_BE, common::uint16_t etherType_BE, common::uint8_t* buffer, common::uint32_t size);
+            // 0 or a negative Error, -EAGAIN while the driver's queue is full
+            common::int32_t Send(common::uint64_t dstMAC_BE, common::uint16_t etherType_BE, common::uint8_t* buffer, common::uint32_t size);
+            // the header goes into the headroom, the packet to the driver
+            // (freed here if the driver does not take it)
+            common::int32_t Send(common::uint64_t dstMAC_BE, common::uint16_t etherType_BE, PacketBuffer* packet);
             
             common::uint64_t GetMACAddress();
             common::uint32_t GetIPAddress();
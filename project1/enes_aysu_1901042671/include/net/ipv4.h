@@ -4,6 +4,7 @@
 #include <common/types.h>
 #include <net/etherframe.h>
 #include <net/arp.h>
+#include <net/packetbuffer.h>
 
 namespace myos
 {
@@ -45,7 +46,8 @@ namespace myos
             
             virtual bool OnInternetProtocolReceived(common::uint32_t srcIP_BE, common::uint32_t dstIP_BE,
                                             common::uint8_t* internetprotocolPayload, common::uint32_t size);
-            void Send(common::uint32_t dstIP_BE, common::uint8_t* internetprotocolPayload, common::uint32_t size);
+            common::int32_t Send(common::uint32_t dstIP_BE, common::uint8_t* internetprotocolPayload, common::uint32_t size);
+            common::int32_t Send(common::uint32_t dstIP_BE, PacketBuffer* packet);
         };
      
      
@@ -66,7 +68,10 @@ namespace myos
             
             bool OnEtherFrameReceived(common::uint8_t* etherframePayload, common::uint32_t size);
 
-            void Send(common::uint32_t dstIP_BE, common::uint8_t protocol, common::uint8_t* buffer, common::uint32_t size);
+            // 0 or a negative Error, see EtherFrameProvider::Send
+            common::int32_t Send(common::uint32_t dstIP_BE, common::uint8_t protocol, common::uint8_t* buffer, common::uint32_t size);
+            // the header goes into the headroom, the packet further down
+            common::int32_t Send(common::uint32_t dstIP_BE, common::uint8_t protocol, PacketBuffer* packet);
             
             static common::uint16_t Checksum(common::uint16_t* data, common::uint32_t lengthInBytes);
         };
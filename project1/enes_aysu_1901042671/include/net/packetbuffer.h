@@ -0,0 +1,55 @@
+ 
+#ifndef __MYOS__NET__PACKETBUFFER_H
+#define __MYOS__NET__PACKETBUFFER_H
+
+
+#include <common/types.h>
+#include <slab.h>
+
+
+namespace myos
+{
+    namespace net
+    {
+        
+        // room for the ethernet, IPv4 and TCP headers (with its option)
+        const common::uint32_t PACKET_HEADROOM = 64;
+        const common::uint32_t PACKET_MTU = 1500;
+        
+        
+        // a frame on its way down the stack: the payload is written once,
+        // every layer pushes its header into the room in front of it, and
+        // the driver sends straight from here and frees it afterwards
+        class PacketBuffer
+        {
+        protected:
+            common::uint8_t* data;
+            common::uint32_t size;
+            common::uint32_t headroom; // left in front of data
+            bool cached; // from packets, from the heap otherwise
+            
+            // this, the headroom and an MTU of payload in one object
+            static SlabAllocator packets;
+            
+            PacketBuffer(common::uint32_t size, bool cached);
+            
+        public:
+            PacketBuffer* next; // on a queue, e.g. the driver's
+            
+            // size bytes at Data() for the payload, 0 if out of memory
+            static PacketBuffer* Allocate(common::uint32_t size);
+            void Free();
+            
+            common::uint8_t* Data();
+            common::uint32_t Size();
+            // makes room for a header, 0 if the headroom is used up
+            common::uint8_t* Push(common::uint32_t size);
+            // takes it off again
+            common::uint8_t* Pull(common::uint32_t size);
+        };
+        
+    }
+}
+
+
+#endif
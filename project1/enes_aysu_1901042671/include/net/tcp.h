@@ -5,6 +5,7 @@
 #include <common/types.h>
 #include <net/ipv4.h>
 #include <memorymanagement.h>
+#include <slab.h>
 
 
 namespace myos
@@ -118,6 +119,7 @@ namespace myos
             TransmissionControlProtocolSocket* sockets[65535];
             common::uint16_t numSockets;
             common::uint16_t freePort;
+            SlabCache<TransmissionControlProtocolSocket> socketCache;
             
         public:
             TransmissionControlProtocolProvider(InternetProtocolProvider* backend);
@@ -6,6 +6,9 @@
 #include <common/types.h>
 #include <net/ipv4.h>
 #include <memorymanagement.h>
+#include <slab.h>
+#include <spinlock.h>
+#include <files.h>
 
 namespace myos
 {
@@ -52,7 +55,7 @@ namespace myos
             UserDatagramProtocolSocket(UserDatagramProtocolProvider* backend);
             ~UserDatagramProtocolSocket();
             virtual void HandleUserDatagramProtocolMessage(common::uint8_t* data, common::uint16_t size);
-            virtual void Send(common::uint8_t* data, common::uint16_t size);
+            virtual common::int32_t Send(common::uint8_t* data, common::uint16_t size);
             virtual void Disconnect();
         };
       
@@ -63,6 +66,11 @@ namespace myos
             UserDatagramProtocolSocket* sockets[65535];
             common::uint16_t numSockets;
             common::uint16_t freePort;
+            SlabCache<UserDatagramProtocolSocket> socketCache;
+            // the socket syscalls and the NIC's receive path use the table on
+            // any processor; held while delivering, so Disconnect returns only
+            // once nothing can reach the socket anymore
+            Spinlock lock;
             
         public:
             UserDatagramProtocolProvider(InternetProtocolProvider* backend);
@@ -74,10 +82,51 @@ namespace myos
             virtual UserDatagramProtocolSocket* Connect(common::uint32_t ip, common::uint16_t port);
             virtual UserDatagramProtocolSocket* Listen(common::uint16_t port);
             virtual void Disconnect(UserDatagramProtocolSocket* socket);
-            virtual void Send(UserDatagramProtocolSocket* socket, common::uint8_t* data, common::uint16_t size);
+            // 0 or a negative Error, -EAGAIN while the network card is backed up
+            virtual common::int32_t Send(UserDatagramProtocolSocket* socket, common::uint8_t* data, common::uint16_t size);
 
             virtual void Bind(UserDatagramProtocolSocket* socket, UserDatagramProtocolHandler* handler);
         };
+
+
+        const common::uint32_t UDP_FILE_QUEUE_LENGTH = 16; // datagrams
+        const common::uint16_t UDP_MAX_PAYLOAD = 1472; // one Ethernet frame
+
+        // a socket behind a descriptor (the socket syscall); what arrives waits
+        // here until read, a whole datagram per read. One that doesn't fit
+        // into the queue anymore is dropped, what doesn't fit into the
+        // reader's buffer is cut off
+        class UserDatagramProtocolFile : public File, public UserDatagramProtocolHandler
+        {
+        protected:
+            // left in the frame the card received it in, which the card
+            // lends until the read; a copy once it has no spare frame left
+            struct Datagram
+            {
+                common::uint8_t* data;
+                common::uint16_t size;
+                PacketBuffer* copy; // 0 ---> in a loaned frame
+            };
+
+            UserDatagramProtocolSocket* socket;
+            Datagram queue[UDP_FILE_QUEUE_LENGTH];
+            common::uint32_t head; // both count up forever
+            common::uint32_t tail;
+            Spinlock lock; // the NIC's receive path fills the queue
+
+            // gives the frame back, or frees the copy
+            static void Drop(Datagram* datagram);
+
+            virtual void Close();
+
+        public:
+            UserDatagramProtocolFile(UserDatagramProtocolSocket* socket);
+            ~UserDatagramProtocolFile();
+
+            virtual void HandleUserDatagramProtocolMessage(UserDatagramProtocolSocket* socket, common::uint8_t* data, common::uint16_t size);
+            virtual common::int32_t Read(common::uint8_t* buffer, common::uint32_t size);
+            virtual common::int32_t Write(const common::uint8_t* buffer, common::uint32_t size);
+        };
         
         
     }
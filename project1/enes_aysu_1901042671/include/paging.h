@@ -0,0 +1,98 @@
+#ifndef __MYOS__PAGING_H
+#define __MYOS__PAGING_H
+
+#include <common/types.h>
+#include <gdt.h>
+#include <memorymanagement.h>
+#include <slab.h>
+#include <frameallocator.h>
+#include <cpu.h>
+
+namespace myos
+{
+
+    const common::uint32_t PAGE_SIZE = 4096;
+
+    // every address space shares the kernel's identity mapping (4 MiB pages)
+    // except for this window of 4 KiB pages, which is private to each task
+    const common::uint32_t TASK_WINDOW_BASE = 0xBFC00000;
+    const common::uint32_t TASK_WINDOW_SIZE = 4*1024*1024;
+    const common::uint32_t TASK_STACK_TOP = TASK_WINDOW_BASE + TASK_WINDOW_SIZE;
+
+
+    class AddressSpace
+    {
+    protected:
+        common::uint32_t* directory; // identity mapped, so also the physical address
+        common::uint32_t* window;    // page table of the private window
+
+        common::uint32_t* Entry(common::uint32_t virtualAddress);
+        bool IsActive();
+        void Invalidate(common::uint32_t virtualAddress);
+        static bool Unshare(common::uint32_t* entry);
+
+        static SlabAllocator cache; // one per task, fork creates them often
+
+    public:
+        AddressSpace();
+        ~AddressSpace();
+
+        // may return 0, noexcept makes new check that before constructing
+        static void* operator new(unsigned size) noexcept;
+        static void operator delete(void* object);
+
+        bool Map(common::uint32_t virtualAddress, common::uint32_t size);
+        // size bytes right below TASK_STACK_TOP and a guard page under them
+        bool MapStack(common::uint32_t size);
+        AddressSpace* Clone();
+        bool Write(common::uint32_t virtualAddress, const void* data, common::uint32_t size);
+        common::uint32_t PhysicalDirectory();
+
+        static bool IsGuardPage(common::uint32_t* directory, common::uint32_t virtualAddress);
+        static bool HandleCopyOnWrite(common::uint32_t* directory, common::uint32_t virtualAddress);
+    };
+
+
+    class PagingManager
+    {
+    friend class AddressSpace;
+    protected:
+        common::uint32_t* kernelDirectory;
+        common::uint16_t* frameReferences; // per physical frame, for copy-on-write
+        common::uint32_t numFrames;
+
+        static common::uint8_t pageFaultStacks[MAX_CPUS][8192];
+
+        // entered through the task gate of exception 0x0E (interruptstubs.s)
+        static void PageFaultTask();
+        static void HandlePageFault(common::uint32_t error);
+        static void TerminateFaultingTask();
+
+    public:
+
+        static PagingManager* activePagingManager;
+
+        PagingManager(GlobalDescriptorTable* gdt, common::size_t memorySize);
+        ~PagingManager();
+
+        // page fault task and paging for the processor this runs on,
+        // the constructor does it for the boot processor
+        void EnableOnThisCPU(GlobalDescriptorTable* gdt);
+        // memory mapped registers, e.g. of the APICs (the whole 4 MiB page)
+        void MapUncached(common::uint32_t physicalAddress);
+
+        void* AllocateFrame();
+        void ShareFrame(void* frame);
+        void ReleaseFrame(void* frame);
+        common::uint16_t FrameReferences(void* frame);
+
+        // inside RAM or on mapped pages of the current task's window, what
+        // a syscall may be handed; the first page is left out to catch null pointers
+        bool IsAccessible(common::uint32_t address, common::uint32_t size);
+
+        // sets the directory int_bottom loads on this processor
+        void Switch(AddressSpace* addressSpace);
+    };
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __MYOS__SLAB_H
+#define __MYOS__SLAB_H
+
+#include <common/types.h>
+#include <memorymanagement.h>
+#include <spinlock.h>
+
+namespace myos
+{
+    
+    struct SlabStatistics
+    {
+        common::uint32_t objectSize;
+        common::uint32_t slabs;       // taken from the heap so far
+        common::uint32_t inUse;
+        common::uint32_t peakInUse;
+        common::uint32_t allocations;
+        common::uint32_t failures;    // heap was exhausted
+    };
+    
+    
+    // fixed size objects carved out of bigger heap blocks (slabs),
+    // Allocate and Free only pop and push a free list; callers on any
+    // processor or in interrupts may share a cache
+    class SlabAllocator
+    {
+    protected:
+        struct FreeObject
+        {
+            FreeObject* next;
+        };
+        
+        char* name;
+        common::uint32_t objectSize;
+        common::uint32_t objectsPerSlab;
+        FreeObject* freeObjects;
+        void* slabs; // linked through their first word
+        SlabStatistics stats;
+        SlabAllocator* nextCache;
+        Spinlock lock;
+        
+        bool Grow();
+        
+    public:
+        static SlabAllocator* firstCache; // all caches, for reporting
+        
+        SlabAllocator(char* name, common::uint32_t objectSize);
+        ~SlabAllocator();
+        
+        void* Allocate();
+        void Free(void* object);
+        
+        char* GetName();
+        common::uint32_t GetObjectSize();
+        SlabAllocator* GetNext();
+        void GetStatistics(SlabStatistics* stats);
+    };
+    
+    
+    // typed cache, objects are constructed in place on Allocate
+    // and destructed on Free
+    template<class T>
+    class SlabCache : public SlabAllocator
+    {
+    public:
+        SlabCache(char* name)
+            : SlabAllocator(name, sizeof(T))
+        {
+        }
+        
+        template<class... Args>
+        T* Allocate(Args... args)
+        {
+            void* object = SlabAllocator::Allocate();
+            if(object == 0)
+                return 0;
+            return new (object) T(args...);
+        }
+        
+        void Free(T* object)
+        {
+            object->~T();
+            SlabAllocator::Free(object);
+        }
+    };
+}
+
+#endif
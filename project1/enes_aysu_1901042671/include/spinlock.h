@@ -0,0 +1,40 @@
+#ifndef __MYOS__SPINLOCK_H
+#define __MYOS__SPINLOCK_H
+
+#include <common/types.h>
+
+namespace myos
+{
+
+    // interrupts stay off while it is held, and the processor holding it
+    // may take it again: a page fault can hit any code that holds a lock
+    class Spinlock
+    {
+    protected:
+        volatile common::uint32_t locked;
+        void* volatile owner; // the holder's CPU
+        common::uint32_t depth;
+        common::uint32_t flags; // eflags from before the outermost Lock
+
+    public:
+        Spinlock();
+        ~Spinlock();
+
+        void Lock();
+        void Unlock();
+    };
+
+
+    // holds the lock until the end of the scope
+    class SpinlockGuard
+    {
+    protected:
+        Spinlock* lock;
+
+    public:
+        SpinlockGuard(Spinlock* lock);
+        ~SpinlockGuard();
+    };
+}
+
+#endif
@@ -1,32 +1,155 @@
- 
 #ifndef __MYOS__SYSCALLS_H
 #define __MYOS__SYSCALLS_H
 
 #include <common/types.h>
+#include <common/errors.h>
 #include <hardwarecommunication/interrupts.h>
 #include <multitasking.h>
+#include <memorymanagement.h>
+#include <files.h>
+#include <cpu.h>
 
 namespace myos
 {
-    
+    namespace net
+    {
+        class UserDatagramProtocolProvider;
+    }
+
+    // goes up whenever syscalls are added or a convention changes
+    const common::uint32_t SYSCALL_ABI_VERSION = 2;
+    const common::uint32_t SYSCALL_MAX_STRING = 4096;
+
+    // int 0x80: the number in eax, arguments in ebx, edx and esi, the result
+    // in ecx; -1 to -MAX_ERROR are a negated common::Error (waitpid also
+    // leaves the exit status in edx). sysenter: the same, but the second and
+    // third argument move to esi and edi, ecx and edx hold where to return
+    enum SyscallNumber
+    {
+        SYSCALL_VERSION = 0,
+        SYSCALL_GETPID = 1,
+        SYSCALL_FORK = 2,
+        SYSCALL_EXIT = 3,
+        SYSCALL_PRINTF = 4,
+        SYSCALL_GETCPID = 5,
+        SYSCALL_WAITPID = 6,
+        SYSCALL_GETTASKSTATS = 7,
+        SYSCALL_GETHEAPSTATS = 8,
+        SYSCALL_FORKBATCH = 9,
+        SYSCALL_USLEEP = 10,
+        SYSCALL_READ = 11,
+        SYSCALL_WRITE = 12,
+        SYSCALL_OPEN = 13,
+        SYSCALL_CLOSE = 14,
+        SYSCALL_MMAP = 15,
+        SYSCALL_SOCKET = 16,
+        SYSCALL_GETSYSCALLSTATS = 17,
+        SYSCALL_GETINTERRUPTSTATS = 18,
+        NUM_SYSCALLS
+    };
+
+    // checked by the dispatcher before a handler sees the argument
+    enum SyscallArgument
+    {
+        ARG_NONE = 0,
+        ARG_VALUE,
+        ARG_STRING, // terminated within SYSCALL_MAX_STRING
+        ARG_BUFFER, // its size is the next argument
+        ARG_OBJECT  // Syscall::objectSize bytes
+    };
+
+    // kernel time of one syscall on all processors together, a call that
+    // blocks counts until it switched away
+    typedef CycleStatistics SyscallStatistics;
+
+    // int 0x80 takes every syscall; sysenter only those that never switch
+    // tasks, it has no interrupt frame to come back through
     class SyscallHandler : public hardwarecommunication::InterruptHandler
     {
-        
+    protected:
+        struct Syscall
+        {
+            // returns the stack to go on with, esp unless it rescheduled
+            common::uint32_t (SyscallHandler::*handler)(common::uint32_t esp);
+            bool fast; // also reachable through sysenter
+            SyscallArgument arguments[3];
+            common::uint16_t objectSize;
+        };
+        static const Syscall syscalls[NUM_SYSCALLS];
+        static bool fastEntry;
+        static net::UserDatagramProtocolProvider* udp;
+
+        // only written by their own processor, with interrupts off
+        static SyscallStatistics statistics[MAX_CPUS][NUM_SYSCALLS];
+
+        static common::uint32_t Argument(CPUState* cpu, common::uint32_t index);
+        static bool Validate(const Syscall* syscall, CPUState* cpu);
+        common::uint32_t Dispatch(common::uint32_t esp);
+
+        common::uint32_t Version(common::uint32_t esp);
+        common::uint32_t GetPid(common::uint32_t esp);
+        common::uint32_t Fork(common::uint32_t esp);
+        common::uint32_t Exit(common::uint32_t esp);
+        common::uint32_t Printf(common::uint32_t esp);
+        common::uint32_t GetCPid(common::uint32_t esp);
+        common::uint32_t WaitPid(common::uint32_t esp);
+        common::uint32_t GetTaskStats(common::uint32_t esp);
+        common::uint32_t GetHeapStats(common::uint32_t esp);
+        common::uint32_t ForkBatch(common::uint32_t esp);
+        common::uint32_t Sleep(common::uint32_t esp);
+        common::uint32_t Read(common::uint32_t esp);
+        common::uint32_t Write(common::uint32_t esp);
+        common::uint32_t Open(common::uint32_t esp);
+        common::uint32_t Close(common::uint32_t esp);
+        common::uint32_t MapMemory(common::uint32_t esp);
+        common::uint32_t Socket(common::uint32_t esp);
+        common::uint32_t GetSyscallStats(common::uint32_t esp);
+        common::uint32_t GetInterruptStats(common::uint32_t esp);
+
     public:
+        static SyscallHandler* activeSyscallHandler;
+
         SyscallHandler(hardwarecommunication::InterruptManager* interruptManager, myos::common::uint8_t InterruptNumber);
         ~SyscallHandler();
-        
+
         virtual myos::common::uint32_t HandleInterrupt(myos::common::uint32_t esp);
 
+        // points the SYSENTER MSRs of the calling processor at syscallstubs.s,
+        // nothing without the SEP feature
+        void EnableFastEntryOnThisCPU(GlobalDescriptorTable* gdt);
+        static bool FastEntry();
+        // called by syscallstubs.s with interrupts off, on the caller's stack
+        static void HandleFastEntry(CPUState* cpu);
+
+        // socket() returns -ENOSYS until there is a network stack
+        static void UseNetwork(net::UserDatagramProtocolProvider* udp);
     };
 
+    int getAbiVersion();
     int getPid();
     int getCPid();
-    int waitpid(common::uint8_t wPid);
+    // the child's pid, or -ECHILD
+    int waitpid(common::int32_t wPid, common::int32_t* status = 0);
     void fork();
-    void exit();
+    void forkBatch(const BatchParameters* parameters);
+    void exit(common::int32_t status = 0);
+    int getTaskStats(common::uint32_t pid, TaskStatistics* stats);
+    int getHeapStats(HeapStatistics* stats);
+    void usleep(common::uint32_t microseconds);
+
+    // descriptors 0, 1 and 2 start out on /dev/console
+    int read(int fd, void* buffer, common::uint32_t size);
+    int write(int fd, const void* buffer, common::uint32_t size);
+    int open(const char* path);
+    int close(int fd);
+    // zeroed memory in the task's own window, 0 if it is full
+    void* mmap(common::uint32_t size);
+    // UDP, ip in network byte order: 0 ---> listen on port
+    int socket(common::uint32_t ip, common::uint16_t port);
+    int getSyscallStats(common::uint32_t number, SyscallStatistics* stats);
+    int getInterruptStats(common::uint8_t interrupt, hardwarecommunication::InterruptStatistics* stats);
 
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,99 @@
+#ifndef __MYOS__TIMER_H
+#define __MYOS__TIMER_H
+
+#include <common/types.h>
+#include <spinlock.h>
+#include <cpu.h>
+
+namespace myos
+{
+
+    // all in microseconds
+    const common::uint32_t SCHEDULER_TICK = 10000;
+    const common::uint32_t MAX_TIMER_INTERVAL = 1000000; // longest one shot, also of an idle processor
+    const common::uint32_t MIN_TIMER_INTERVAL = 20;
+
+    // a level 0 slot is 1024 us, a slot of every level above spans the
+    // whole level below: 65 ms, 4.2 s, 4.5 min and 4.8 h in all
+    const common::uint32_t TIMER_WHEEL_LEVELS = 4;
+    const common::uint32_t TIMER_WHEEL_SLOTS = 64;
+    const common::uint8_t TIMER_LEVEL_SHIFT = 6;
+    const common::uint8_t TIMER_SLOT_SHIFT = 10;
+
+
+    // a callback at some point in time, owned by whoever added it
+    class Timer
+    {
+        friend class TimerManager;
+        protected:
+            common::uint64_t deadline;
+            Timer** slot; // the list it is on
+            Timer* next;
+            Timer* prev;
+            bool pending;
+
+            void (*callback)(void* data);
+            void* data;
+
+        public:
+            Timer(void (*callback)(void* data) = 0, void* data = 0);
+            ~Timer();
+            bool Pending();
+    };
+
+
+    // one shot interrupts on every processor (local APIC, or the PIT
+    // without one): a scheduler tick while a task runs, nothing while the
+    // processor is idle, and on the boot processor also the next timer
+    class TimerManager
+    {
+        protected:
+            static common::uint64_t bootCycles;
+            static common::uint32_t microsecondsPerCycle; // 32.32 fixed point, the integer part is 0
+
+            bool apic;
+            common::uint8_t vector;
+            common::uint32_t apicCounts; // in 10 ms
+
+            Timer* wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+            common::uint64_t wheelTime; // the level 0 slot (in its 1024 us) being worked on
+            common::uint64_t nextTick[MAX_CPUS];
+            common::uint64_t armed[MAX_CPUS];
+            common::uint64_t nextGlobalTick;
+            common::uint32_t ticks;
+            Spinlock lock;
+
+            void Arm(common::uint32_t microseconds);
+            void Insert(Timer* timer);
+            void Unlink(Timer* timer);
+            void Cascade(common::uint32_t level, common::uint32_t index);
+            common::uint64_t NextExpiry(common::uint64_t now);
+            void RunExpired(common::uint64_t now);
+
+        public:
+            static TimerManager* activeTimerManager;
+
+            // calibrates the time stamp counter against the PIT
+            TimerManager();
+            ~TimerManager();
+
+            // microseconds since boot, from the time stamp counter
+            // (assumed to run in step on every processor)
+            static common::uint64_t Now();
+            // SCHEDULER_TICKs since boot
+            common::uint32_t Ticks();
+
+            // the callback runs in interrupt context on the boot processor
+            void Add(Timer* timer, common::uint32_t microseconds);
+            bool Cancel(Timer* timer);
+
+            void UseLocalAPIC(common::uint8_t vector);
+            void StartOnThisCPU();
+            // at the timer vector: runs what expired, true if this processor is due a tick
+            bool HandleInterrupt();
+            // programs the next one shot of this processor
+            void Rearm(bool idle);
+    };
+}
+
+#endif
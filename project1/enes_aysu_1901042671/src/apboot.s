@@ -0,0 +1,58 @@
+# the other processors start here in real mode after the startup IPI,
+# CPUManager copies this to AP_BOOT_ADDRESS and fills in the stack and entry
+
+.set AP_BOOT_ADDRESS, 0x8000
+
+.section .text
+.code16
+
+.global apboot_start
+apboot_start:
+    cli
+    cld
+    xor %ax, %ax
+    mov %ax, %ds
+
+    # same code and data selectors as the kernel's GDT
+    lgdtl AP_BOOT_ADDRESS + (apboot_gdt_pointer - apboot_start)
+    mov %cr0, %eax
+    or $1, %eax
+    mov %eax, %cr0
+    ljmpl $0x10, $(AP_BOOT_ADDRESS + (apboot_protected - apboot_start))
+
+.code32
+apboot_protected:
+    mov $0x18, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %ss
+    mov %ax, %fs
+    mov %ax, %gs
+
+    mov (AP_BOOT_ADDRESS + (apboot_stack - apboot_start)), %esp
+    call *(AP_BOOT_ADDRESS + (apboot_entry - apboot_start))
+
+1:
+    cli
+    hlt
+    jmp 1b
+
+.align 8
+apboot_gdt:
+    .quad 0
+    .quad 0
+    .quad 0x00CF9A000000FFFF # code, flat 4 GiB
+    .quad 0x00CF92000000FFFF # data, flat 4 GiB
+apboot_gdt_pointer:
+    .word 4*8 - 1
+    .long AP_BOOT_ADDRESS + (apboot_gdt - apboot_start)
+
+.global apboot_stack
+apboot_stack:
+    .long 0
+.global apboot_entry
+apboot_entry:
+    .long 0
+
+.global apboot_end
+apboot_end:
@@ -0,0 +1,200 @@
+
+#include <cpu.h>
+#include <paging.h>
+#include <timer.h>
+#include <frameallocator.h>
+#include <syscalls.h>
+#include <hardwarecommunication/apic.h>
+#include <hardwarecommunication/interrupts.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::hardwarecommunication;
+
+void printf(char* str);
+void printfHex(uint8_t);
+
+// apboot.s
+extern "C" uint8_t apboot_start;
+extern "C" uint8_t apboot_end;
+extern "C" uint32_t apboot_stack;
+extern "C" uint32_t apboot_entry;
+
+static const uint32_t AP_BOOT_ADDRESS = 0x8000;
+static const uint8_t AP_STACK_ORDER = 2; // 16 KiB
+
+
+CPU CPUManager::cpus[MAX_CPUS];
+volatile uint32_t CPUManager::numOnline = 1;
+volatile uint32_t CPUManager::booting = 0;
+uint8_t CPUManager::timerVector = 0;
+
+static APICConfiguration config;
+
+
+void myos::CountCycles(CycleStatistics* stats, uint32_t cycles)
+{
+    stats->count++;
+    stats->totalCycles += cycles;
+    if(cycles > stats->maxCycles)
+        stats->maxCycles = cycles;
+}
+
+void myos::SumCycles(CycleStatistics* total, CycleStatistics* perCPU, uint32_t stride)
+{
+    // the other processors may be counting meanwhile, good enough for statistics
+    *total = {0, 0, 0};
+    for(uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+        CycleStatistics* stats = &perCPU[i * stride];
+        total->count += stats->count;
+        total->totalCycles += stats->totalCycles;
+        if(stats->maxCycles > total->maxCycles)
+            total->maxCycles = stats->maxCycles;
+    }
+}
+
+
+CPU* CPUManager::Get(uint32_t index)
+{
+    return &cpus[index];
+}
+
+uint32_t CPUManager::NumOnline()
+{
+    return numOnline;
+}
+
+void CPUManager::Wake(uint32_t index)
+{
+    if(timerVector != 0)
+        LocalAPIC::SendInterrupt(cpus[index].apicId, timerVector);
+}
+
+CPUManager::CPUManager()
+{
+    numProcessors = 1;
+    apic = APICConfiguration::Read(&config);
+    if(!apic)
+    {
+        printf("NO MADT, RUNNING ON ONE PROCESSOR\n");
+        return;
+    }
+
+    numProcessors = config.numProcessors;
+    for(uint32_t i = 0; i < numProcessors; i++)
+        apicIds[i] = config.apicIds[i];
+
+    PagingManager::activePagingManager->MapUncached(config.localAPICAddress);
+    PagingManager::activePagingManager->MapUncached(config.ioAPICAddress);
+    LocalAPIC::SetAddress(config.localAPICAddress);
+    cpus[0].apicId = LocalAPIC::Id();
+}
+
+CPUManager::~CPUManager()
+{
+}
+
+void CPUManager::Start(InterruptManager* interrupts)
+{
+    if(!apic)
+    {
+        // the PIT in one shot mode
+        TimerManager::activeTimerManager->StartOnThisCPU();
+        return;
+    }
+    // kernelMain must not be scheduled away while it sends the IPIs
+    asm volatile("cli");
+
+    // the local APIC timers take over from the PIT (IRQ 0),
+    // everything else goes to the boot processor on its usual vector
+    IOAPIC ioAPIC(config.ioAPICAddress, config.ioAPICBase);
+    uint8_t offset = interrupts->HardwareInterruptOffset();
+    for(uint8_t irq = 0; irq < 16; irq++)
+    {
+        uint32_t gsi = config.irqToGSI[irq];
+        if(gsi < config.ioAPICBase || gsi >= config.ioAPICBase + ioAPIC.NumInputs())
+            continue;
+        if(irq == 0 || irq == 2)
+            ioAPIC.Mask(gsi);
+        else
+            ioAPIC.Route(gsi, offset + irq, cpus[0].apicId, config.irqFlags[irq]);
+    }
+    interrupts->UseAPIC();
+
+    LocalAPIC::Enable();
+    TimerManager::activeTimerManager->UseLocalAPIC(offset);
+
+    uint8_t* trampoline = (uint8_t*)AP_BOOT_ADDRESS;
+    for(uint8_t* p = &apboot_start; p < &apboot_end; p++)
+        *trampoline++ = *p;
+
+    for(uint32_t i = 0; i < numProcessors && numOnline < MAX_CPUS; i++)
+        if(apicIds[i] != cpus[0].apicId && !StartApplicationProcessor(apicIds[i]))
+        {
+            printf("PROCESSOR 0x");
+            printfHex(apicIds[i]);
+            printf(" DID NOT START\n");
+        }
+
+    timerVector = offset;
+    TimerManager::activeTimerManager->StartOnThisCPU();
+    asm volatile("sti");
+}
+
+bool CPUManager::StartApplicationProcessor(uint8_t apicId)
+{
+    uint32_t index = numOnline;
+    uint8_t* stack = (uint8_t*)FrameAllocator::activeFrameAllocator->Allocate(AP_STACK_ORDER);
+    if(stack == 0)
+        return false;
+
+    cpus[index].index = index;
+    cpus[index].apicId = apicId;
+    booting = index;
+
+    // the copy's slots, not the ones linked into the kernel
+    uint32_t* stackSlot = (uint32_t*)(AP_BOOT_ADDRESS + ((uint8_t*)&apboot_stack - &apboot_start));
+    uint32_t* entrySlot = (uint32_t*)(AP_BOOT_ADDRESS + ((uint8_t*)&apboot_entry - &apboot_start));
+    *stackSlot = (uint32_t)stack + (FRAME_SIZE << AP_STACK_ORDER);
+    *entrySlot = (uint32_t)&ApplicationProcessorMain;
+
+    // INIT, then the startup IPI twice as the MP specification says
+    LocalAPIC::SendInit(apicId);
+    PITDelay(10000);
+    for(int attempt = 0; attempt < 2 && numOnline == index; attempt++)
+    {
+        LocalAPIC::SendStartup(apicId, AP_BOOT_ADDRESS);
+        PITDelay(200);
+    }
+    for(int wait = 0; wait < 10 && numOnline == index; wait++)
+        PITDelay(10000);
+
+    if(numOnline == index)
+    {
+        // park it again, its slot and stack go to the next one
+        LocalAPIC::SendInit(apicId);
+        FrameAllocator::activeFrameAllocator->Free(stack, AP_STACK_ORDER);
+        return false;
+    }
+    return true;
+}
+
+void CPUManager::ApplicationProcessorMain()
+{
+    CPU* cpu = &cpus[booting];
+
+    GlobalDescriptorTable* gdt = new(cpu->gdt) GlobalDescriptorTable(cpu);
+    InterruptManager::LoadInterruptDescriptorTable();
+    PagingManager::activePagingManager->EnableOnThisCPU(gdt);
+    if(SyscallHandler::activeSyscallHandler != 0)
+        SyscallHandler::activeSyscallHandler->EnableFastEntryOnThisCPU(gdt);
+
+    LocalAPIC::Enable();
+    TimerManager::activeTimerManager->StartOnThisCPU();
+
+    // from here on the scheduler may hand it tasks
+    numOnline = numOnline + 1;
+    while(1)
+        asm volatile("sti; hlt");
+}
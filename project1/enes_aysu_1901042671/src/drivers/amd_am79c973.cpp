@@ -1,10 +1,15 @@
 
 #include <drivers/amd_am79c973.h>
+#include <frameallocator.h>
+#include <common/errors.h>
+#include <log.h>
 using namespace myos;
 using namespace myos::common;
 using namespace myos::drivers;
 using namespace myos::hardwarecommunication;
 
+void printfHex32(void (*print)(char*), uint32_t);
+
  
 
 
@@ -33,11 +38,11 @@ void RawDataHandler::Send(uint8_t* buffer, uint32_t size)
 
 
 
-void printf(char*);
-void printfHex(uint8_t);
+amd_am79c973* amd_am79c973::activeNetworkCard = 0;
 
 
-amd_am79c973::amd_am79c973(PeripheralComponentInterconnectDeviceDescriptor *dev, InterruptManager* interrupts)
+amd_am79c973::amd_am79c973(PeripheralComponentInterconnectDeviceDescriptor *dev, InterruptManager* interrupts,
+                           uint8_t sendRingOrder, uint8_t recvRingOrder)
 :   Driver(),
     InterruptHandler(interrupts, dev->interrupt + interrupts->HardwareInterruptOffset()),
     MACAddress0Port(dev->portBase),
@@ -46,11 +51,31 @@ amd_am79c973::amd_am79c973(PeripheralComponentInterconnectDeviceDescriptor *dev,
     registerDataPort(dev->portBase + 0x10),
     registerAddressPort(dev->portBase + 0x12),
     resetPort(dev->portBase + 0x14),
-    busControlRegisterDataPort(dev->portBase + 0x16)
+    busControlRegisterDataPort(dev->portBase + 0x16),
+    reapWork(&amd_am79c973::Reap, this),
+    pollWork(&amd_am79c973::Poll, this)
 {
     this->handler = 0;
     currentSendBuffer = 0;
     currentRecvBuffer = 0;
+    polling = false;
+    receiveInterrupts = 0;
+    polls = 0;
+    interruptFrames = 0;
+    pollingFrames = 0;
+    activeNetworkCard = this;
+    dirtySendBuffer = 0;
+    sendInFlight = 0;
+    sendQueueHead = 0;
+    sendQueueTail = 0;
+    sendQueueLength = 0;
+    framesSent = 0;
+    sendErrors = 0;
+    framesQueued = 0;
+    sendsRefused = 0;
+    peakSendQueue = 0;
+    spareRecvBuffers = 0;
+    numSpareRecvBuffers = 0;
     
     uint64_t MAC0 = MACAddress0Port.Read() % 256;
     uint64_t MAC1 = MACAddress0Port.Read() / 256;
@@ -74,36 +99,74 @@ amd_am79c973::amd_am79c973(PeripheralComponentInterconnectDeviceDescriptor *dev,
     registerAddressPort.Write(0);
     registerDataPort.Write(0x04);
     
+    if(sendRingOrder > NIC_MAX_RING_ORDER)
+        sendRingOrder = NIC_MAX_RING_ORDER;
+    if(recvRingOrder > NIC_MAX_RING_ORDER)
+        recvRingOrder = NIC_MAX_RING_ORDER;
+    this->sendRingOrder = sendRingOrder;
+    this->recvRingOrder = recvRingOrder;
+    numSendBuffers = 1 << sendRingOrder;
+    numRecvBuffers = 1 << recvRingOrder;
+    
     // initBlock
     initBlock.mode = 0x0000; // promiscuous mode = false
     initBlock.reserved1 = 0;
-    initBlock.numSendBuffers = 3;
+    initBlock.numSendBuffers = sendRingOrder;
     initBlock.reserved2 = 0;
-    initBlock.numRecvBuffers = 3;
+    initBlock.numRecvBuffers = recvRingOrder;
     initBlock.physicalAddress = MAC;
     initBlock.reserved3 = 0;
     initBlock.logicalAddress = 0;
     
-    sendBufferDescr = (BufferDescriptor*)((((uint32_t)&sendBufferDescrMemory[0]) + 15) & ~((uint32_t)0xF));
+    // page aligned frames, so no rounding up to 16 bytes is needed
+    FrameAllocator* frames = FrameAllocator::activeFrameAllocator;
+    uint8_t* rings = (uint8_t*)frames->Allocate(FrameAllocator::Order((numSendBuffers + numRecvBuffers) * sizeof(BufferDescriptor)));
+    sendBuffers = (uint8_t*)frames->Allocate(FrameAllocator::Order(numSendBuffers * NIC_BUFFER_SIZE));
+    recvBuffers = (uint8_t*)frames->Allocate(FrameAllocator::Order(2 * numRecvBuffers * NIC_BUFFER_SIZE));
+    
+    if(rings == 0 || sendBuffers == 0 || recvBuffers == 0)
+    {
+        // left unconfigured: Activate doesn't start it and Send refuses
+        if(rings != 0)
+            frames->Free(rings, FrameAllocator::Order((numSendBuffers + numRecvBuffers) * sizeof(BufferDescriptor)));
+        if(sendBuffers != 0)
+            frames->Free(sendBuffers, FrameAllocator::Order(numSendBuffers * NIC_BUFFER_SIZE));
+        if(recvBuffers != 0)
+            frames->Free(recvBuffers, FrameAllocator::Order(2 * numRecvBuffers * NIC_BUFFER_SIZE));
+        sendBufferDescr = 0;
+        recvBufferDescr = 0;
+        sendBuffers = 0;
+        recvBuffers = 0;
+        Log::Write(LOG_NETWORK, LOG_ERROR, "AMD am79c973 NO MEMORY FOR THE RINGS\n");
+        return;
+    }
+    
+    sendBufferDescr = (BufferDescriptor*)rings;
     initBlock.sendBufferDescrAddress = (uint32_t)sendBufferDescr;
-    recvBufferDescr = (BufferDescriptor*)((((uint32_t)&recvBufferDescrMemory[0]) + 15) & ~((uint32_t)0xF));
+    recvBufferDescr = (BufferDescriptor*)(rings + numSendBuffers * sizeof(BufferDescriptor));
     initBlock.recvBufferDescrAddress = (uint32_t)recvBufferDescr;
     
-    for(uint8_t i = 0; i < 8; i++)
+    for(uint32_t i = 0; i < numSendBuffers; i++)
     {
-        sendBufferDescr[i].address = (((uint32_t)&sendBuffers[i]) + 15 ) & ~(uint32_t)0xF;
+        sendBufferDescr[i].address = (uint32_t)&sendBuffers[i * NIC_BUFFER_SIZE];
         sendBufferDescr[i].flags = 0x7FF
                                  | 0xF000;
         sendBufferDescr[i].flags2 = 0;
         sendBufferDescr[i].avail = 0;
-        
-        recvBufferDescr[i].address = (((uint32_t)&recvBuffers[i]) + 15 ) & ~(uint32_t)0xF;
+    }
+    
+    for(uint32_t i = 0; i < numRecvBuffers; i++)
+    {
+        recvBufferDescr[i].address = (uint32_t)&recvBuffers[i * NIC_BUFFER_SIZE];
         recvBufferDescr[i].flags = 0xF7FF
                                  | 0x80000000;
         recvBufferDescr[i].flags2 = 0;
-        sendBufferDescr[i].avail = 0;
+        recvBufferDescr[i].avail = 0;
     }
     
+    for(uint32_t i = numRecvBuffers; i < 2 * numRecvBuffers; i++)
+        ReturnReceiveBuffer(&recvBuffers[i * NIC_BUFFER_SIZE]);
+    
     registerAddressPort.Write(1);
     registerDataPort.Write(  (uint32_t)(&initBlock) & 0xFFFF );
     registerAddressPort.Write(2);
@@ -113,10 +176,20 @@ amd_am79c973::amd_am79c973(PeripheralComponentInterconnectDeviceDescriptor *dev,
 
 amd_am79c973::~amd_am79c973()
 {
+    if(activeNetworkCard == this)
+        activeNetworkCard = 0;
+    if(sendBufferDescr == 0)
+        return;
+    FrameAllocator* frames = FrameAllocator::activeFrameAllocator;
+    frames->Free(sendBufferDescr, FrameAllocator::Order((numSendBuffers + numRecvBuffers) * sizeof(BufferDescriptor)));
+    frames->Free(sendBuffers, FrameAllocator::Order(numSendBuffers * NIC_BUFFER_SIZE));
+    frames->Free(recvBuffers, FrameAllocator::Order(2 * numRecvBuffers * NIC_BUFFER_SIZE));
 }
             
 void amd_am79c973::Activate()
 {
+    if(sendBufferDescr == 0)
+        return;
     registerAddressPort.Write(0);
     registerDataPort.Write(0x41);
 
@@ -138,62 +211,293 @@ int amd_am79c973::Reset()
 
 
 
+uint16_t amd_am79c973::ReadRegister(uint16_t csr)
+{
+    SpinlockGuard guard(&registerLock);
+    registerAddressPort.Write(csr);
+    return registerDataPort.Read();
+}
+
+void amd_am79c973::WriteRegister(uint16_t csr, uint16_t value)
+{
+    SpinlockGuard guard(&registerLock);
+    registerAddressPort.Write(csr);
+    registerDataPort.Write(value);
+}
+
 uint32_t amd_am79c973::HandleInterrupt(common::uint32_t esp)
 {
-    registerAddressPort.Write(0);
-    uint32_t temp = registerDataPort.Read();
+    uint32_t temp = ReadRegister(0);
     
-    if((temp & 0x8000) == 0x8000) printf("AMD am79c973 ERROR\n");
-    if((temp & 0x2000) == 0x2000) printf("AMD am79c973 COLLISION ERROR\n");
-    if((temp & 0x1000) == 0x1000) printf("AMD am79c973 MISSED FRAME\n");
-    if((temp & 0x0800) == 0x0800) printf("AMD am79c973 MEMORY ERROR\n");
-    if((temp & 0x0400) == 0x0400) Receive();
-    if((temp & 0x0200) == 0x0200) printf(" SENT");
+    if((temp & 0x8000) == 0x8000) Log::Write(LOG_NETWORK, LOG_ERROR, "AMD am79c973 ERROR\n");
+    if((temp & 0x2000) == 0x2000) Log::Write(LOG_NETWORK, LOG_WARNING, "AMD am79c973 COLLISION ERROR\n");
+    if((temp & 0x1000) == 0x1000) Log::Write(LOG_NETWORK, LOG_WARNING, "AMD am79c973 MISSED FRAME\n");
+    if((temp & 0x0800) == 0x0800) Log::Write(LOG_NETWORK, LOG_ERROR, "AMD am79c973 MEMORY ERROR\n");
+    if((temp & 0x0400) == 0x0400)
+    {
+        // RINTM in CSR3, RINT still gets latched in CSR0 meanwhile
+        receiveInterrupts++;
+        WriteRegister(3, ReadRegister(3) | 0x0400);
+        pollWork.Schedule();
+    }
+    if((temp & 0x0200) == 0x0200) reapWork.Schedule();
                                
     // acknoledge
-    registerAddressPort.Write(0);
-    registerDataPort.Write(temp);
+    WriteRegister(0, temp);
     
-    if((temp & 0x0100) == 0x0100) printf("AMD am79c973 INIT DONE\n");
+    if((temp & 0x0100) == 0x0100) Log::Write(LOG_NETWORK, LOG_INFO, "AMD am79c973 INIT DONE\n");
     
     return esp;
 }
 
-       
-void amd_am79c973::Send(uint8_t* buffer, int size)
+void amd_am79c973::Poll(void* nic)
+{
+    ((amd_am79c973*)nic)->PollReceive();
+}
+
+void amd_am79c973::PollReceive()
+{
+    polls++;
+    uint32_t frames = Receive(NIC_POLL_BUDGET);
+    if(polling)
+        pollingFrames += frames;
+    else
+        interruptFrames += frames;
+
+    if(frames == NIC_POLL_BUDGET)
+    {
+        // frames come in faster than one interrupt each is worth,
+        // stay masked and poll again after the other deferred work
+        polling = true;
+        pollWork.Schedule();
+        return;
+    }
+
+    // the ring ran dry: back to interrupts, one that was latched
+    // since the last look fires as soon as RINTM is cleared
+    polling = false;
+    WriteRegister(3, ReadRegister(3) & ~0x0400);
+}
+
+void amd_am79c973::Reclaim(BufferDescriptor* descriptor, uint32_t index)
+{
+    if(descriptor->avail == 1)
+        ReturnReceiveBuffer((uint8_t*)descriptor->address);
+    else if(descriptor->avail != 0)
+        ((net::PacketBuffer*)descriptor->avail)->Free();
+    descriptor->address = (uint32_t)&sendBuffers[index * NIC_BUFFER_SIZE];
+    descriptor->avail = 0;
+}
+
+void amd_am79c973::Reap(void* nic)
+{
+    ((amd_am79c973*)nic)->ReapSent();
+}
+
+void amd_am79c973::ReapSent()
+{
+    SpinlockGuard guard(&sendLock);
+    while(sendInFlight > 0 && (sendBufferDescr[dirtySendBuffer].flags & 0x80000000) == 0)
+    {
+        BufferDescriptor* descriptor = &sendBufferDescr[dirtySendBuffer];
+        if(descriptor->flags & 0x40000000)
+            sendErrors++;
+        else
+            framesSent++;
+        Reclaim(descriptor, dirtySendBuffer);
+        dirtySendBuffer = (dirtySendBuffer + 1) % numSendBuffers;
+        sendInFlight--;
+    }
+    
+    // what waited behind the ring, in order
+    while(sendQueueHead != 0 && sendInFlight < numSendBuffers)
+    {
+        net::PacketBuffer* packet = sendQueueHead;
+        sendQueueHead = packet->next;
+        if(sendQueueHead == 0)
+            sendQueueTail = 0;
+        sendQueueLength--;
+        packet->next = 0;
+        TransmitPacket(packet);
+    }
+}
+
+bool amd_am79c973::SendSlotFree()
 {
-    int sendDescriptor = currentSendBuffer;
-    currentSendBuffer = (currentSendBuffer + 1) % 8;
+    // a full ring may have been sent already, the interrupt is just late
+    if(sendInFlight == numSendBuffers)
+        ReapSent();
+    return sendQueueHead == 0 && sendInFlight < numSendBuffers;
+}
+
+void amd_am79c973::Transmit(uint32_t size)
+{
+    BufferDescriptor* descriptor = &sendBufferDescr[currentSendBuffer];
+    currentSendBuffer = (currentSendBuffer + 1) % numSendBuffers;
+    sendInFlight++;
     
-    if(size > 1518)
-        size = 1518;
+    // the start of the IPv4 payload
+    if(LOG_ENABLED(LOG_NETWORK, LOG_DEBUG) && size > 14+20)
+    {
+        Log::Write(LOG_NETWORK, LOG_DEBUG, "\nSEND: ");
+        Log::WriteHex(LOG_NETWORK, LOG_DEBUG, (uint8_t*)descriptor->address + 14+20, (size>64?64:size) - (14+20));
+    }
     
-    for(uint8_t *src = buffer + size -1,
-                *dst = (uint8_t*)(sendBufferDescr[sendDescriptor].address + size -1);
-                src >= buffer; src--, dst--)
-        *dst = *src;
-        
-    printf("\nSEND: ");
-    for(int i = 14+20; i < (size>64?64:size); i++)
+    descriptor->flags2 = 0;
+    descriptor->flags = 0x8300F000
+                      | ((uint16_t)((-size) & 0xFFF));
+    WriteRegister(0, 0x48);
+}
+
+void amd_am79c973::TransmitPacket(net::PacketBuffer* packet)
+{
+    // freed once the card is done with it
+    BufferDescriptor* descriptor = &sendBufferDescr[currentSendBuffer];
+    descriptor->address = (uint32_t)packet->Data();
+    descriptor->avail = (uint32_t)packet;
+    Transmit(packet->Size() > 1518 ? 1518 : packet->Size());
+}
+
+// the pieces one after the other, at most a whole frame
+static uint32_t Gather(uint8_t* dst, NetworkSegment* segments, uint32_t numSegments)
+{
+    uint32_t size = 0;
+    for(uint32_t i = 0; i < numSegments && size < 1518; i++)
     {
-        printfHex(buffer[i]);
-        printf(" ");
+        uint32_t count = segments[i].size;
+        if(count > 1518 - size)
+            count = 1518 - size;
+        for(uint32_t j = 0; j < count; j++)
+            dst[size + j] = segments[i].data[j];
+        size += count;
+    }
+    return size;
+}
+
+int32_t amd_am79c973::Send(uint8_t* buffer, int size)
+{
+    NetworkSegment segment;
+    segment.data = buffer;
+    segment.size = size;
+    return Send(&segment, 1);
+}
+
+int32_t amd_am79c973::Send(NetworkSegment* segments, uint32_t numSegments)
+{
+    if(sendBufferDescr == 0)
+        return -ENOMEM;
+    SpinlockGuard guard(&sendLock);
+    if(SendSlotFree())
+    {
+        // the callers free their buffers once this returns,
+        // so the pieces can't be handed to the card as they are
+        Transmit(Gather((uint8_t*)sendBufferDescr[currentSendBuffer].address, segments, numSegments));
+        return 0;
     }
     
-    sendBufferDescr[sendDescriptor].avail = 0;
-    sendBufferDescr[sendDescriptor].flags2 = 0;
-    sendBufferDescr[sendDescriptor].flags = 0x8300F000
-                                          | ((uint16_t)((-size) & 0xFFF));
-    registerAddressPort.Write(0);
-    registerDataPort.Write(0x48);
+    // behind the others, in a packet of its own
+    uint32_t size = 0;
+    for(uint32_t i = 0; i < numSegments; i++)
+        size += segments[i].size;
+    net::PacketBuffer* packet = net::PacketBuffer::Allocate(size > 1518 ? 1518 : size);
+    if(packet == 0)
+        return -ENOMEM;
+    Gather(packet->Data(), segments, numSegments);
+    int32_t result = Send(packet);
+    if(result < 0)
+        packet->Free();
+    return result;
 }
 
-void amd_am79c973::Receive()
+int32_t amd_am79c973::Send(net::PacketBuffer* packet)
 {
-    printf("\nRECV: ");
+    if(sendBufferDescr == 0)
+        return -ENOMEM;
+    SpinlockGuard guard(&sendLock);
+    if(SendSlotFree())
+    {
+        TransmitPacket(packet);
+        return 0;
+    }
     
-    for(; (recvBufferDescr[currentRecvBuffer].flags & 0x80000000) == 0;
-        currentRecvBuffer = (currentRecvBuffer + 1) % 8)
+    if(sendQueueLength >= NIC_SEND_QUEUE_LENGTH)
+    {
+        sendsRefused++;
+        return -EAGAIN;
+    }
+    packet->next = 0;
+    if(sendQueueTail != 0)
+        sendQueueTail->next = packet;
+    else
+        sendQueueHead = packet;
+    sendQueueTail = packet;
+    sendQueueLength++;
+    framesQueued++;
+    if(sendQueueLength > peakSendQueue)
+        peakSendQueue = sendQueueLength;
+    return 0;
+}
+
+void amd_am79c973::SendReceiveBuffer(uint8_t* frame, uint32_t size)
+{
+    SpinlockGuard guard(&sendLock);
+    if(SendSlotFree())
+    {
+        // given back once the card is done with it
+        BufferDescriptor* descriptor = &sendBufferDescr[currentSendBuffer];
+        descriptor->address = (uint32_t)frame;
+        descriptor->avail = 1;
+        Transmit(size > 1518 ? 1518 : size);
+        return;
+    }
+    
+    // the ring is full, the receive buffers are better not held by the queue
+    Send(frame, size);
+    ReturnReceiveBuffer(frame);
+}
+
+void amd_am79c973::GetSendStatistics(NetworkSendStatistics* stats)
+{
+    SpinlockGuard guard(&sendLock);
+    stats->sent = framesSent;
+    stats->errors = sendErrors;
+    stats->queued = framesQueued;
+    stats->refused = sendsRefused;
+    stats->peakQueue = peakSendQueue;
+    stats->pending = sendInFlight + sendQueueLength;
+}
+
+bool amd_am79c973::KeepReceiveBuffer(uint8_t* frame)
+{
+    uint32_t start = (uint32_t)frame & ~(NIC_BUFFER_SIZE - 1);
+    BufferDescriptor* descriptor = &recvBufferDescr[currentRecvBuffer];
+    if(descriptor->address != start)
+        return false; // not the frame being handed up
+    
+    SpinlockGuard guard(&spareLock);
+    if(spareRecvBuffers == 0)
+        return false;
+    uint8_t* spare = spareRecvBuffers;
+    spareRecvBuffers = *(uint8_t**)spare;
+    numSpareRecvBuffers--;
+    descriptor->address = (uint32_t)spare;
+    return true;
+}
+
+void amd_am79c973::ReturnReceiveBuffer(uint8_t* frame)
+{
+    uint8_t* start = (uint8_t*)((uint32_t)frame & ~(NIC_BUFFER_SIZE - 1));
+    SpinlockGuard guard(&spareLock);
+    *(uint8_t**)start = spareRecvBuffers;
+    spareRecvBuffers = start;
+    numSpareRecvBuffers++;
+}
+
+uint32_t amd_am79c973::Receive(uint32_t budget)
+{
+    uint32_t frames = 0;
+    for(; frames < budget && (recvBufferDescr[currentRecvBuffer].flags & 0x80000000) == 0;
+        currentRecvBuffer = (currentRecvBuffer + 1) % numRecvBuffers, frames++)
     {
         if(!(recvBufferDescr[currentRecvBuffer].flags & 0x40000000)
          && (recvBufferDescr[currentRecvBuffer].flags & 0x03000000) == 0x03000000) 
@@ -205,20 +509,56 @@ void amd_am79c973::Receive()
             
             uint8_t* buffer = (uint8_t*)(recvBufferDescr[currentRecvBuffer].address);
 
-            for(int i = 14+20; i < (size>64?64:size); i++)
+            if(LOG_ENABLED(LOG_NETWORK, LOG_DEBUG) && size > 14+20)
             {
-                printfHex(buffer[i]);
-                printf(" ");
+                Log::Write(LOG_NETWORK, LOG_DEBUG, "\nRECV: ");
+                Log::WriteHex(LOG_NETWORK, LOG_DEBUG, buffer + 14+20, (size>64?64:size) - (14+20));
             }
 
+            // the answer was written over the frame, it goes out from there
             if(handler != 0)
                 if(handler->OnRawDataReceived(buffer, size))
-                    Send(buffer, size);
+                {
+                    if(KeepReceiveBuffer(buffer))
+                        SendReceiveBuffer(buffer, size);
+                    else
+                        Send(buffer, size);
+                }
         }
         
         recvBufferDescr[currentRecvBuffer].flags2 = 0;
         recvBufferDescr[currentRecvBuffer].flags = 0x8000F7FF;
     }
+    return frames;
+}
+
+void amd_am79c973::Report(void (*print)(char*))
+{
+    print("receive interrupts: ");
+    printfHex32(print, receiveInterrupts);
+    print(" polls: ");
+    printfHex32(print, polls);
+    print("\nframes after an interrupt: ");
+    printfHex32(print, interruptFrames);
+    print(" while polling: ");
+    printfHex32(print, pollingFrames);
+    print("\nframes per interrupt: ");
+    printfHex32(print, (receiveInterrupts != 0) ? (interruptFrames + pollingFrames) / receiveInterrupts : 0);
+    print(" spare receive buffers: ");
+    printfHex32(print, numSpareRecvBuffers);
+    NetworkSendStatistics stats;
+    GetSendStatistics(&stats);
+    print("\nframes sent: ");
+    printfHex32(print, stats.sent);
+    print(" errors: ");
+    printfHex32(print, stats.errors);
+    print(" queued: ");
+    printfHex32(print, stats.queued);
+    print(" refused: ");
+    printfHex32(print, stats.refused);
+    print(" peak queue: ");
+    printfHex32(print, stats.peakQueue);
+    print("\n");
 }
 
 void amd_am79c973::SetHandler(RawDataHandler* handler)
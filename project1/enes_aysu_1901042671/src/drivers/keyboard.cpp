@@ -71,6 +71,7 @@ uint32_t KeyboardDriver::HandleInterrupt(uint32_t esp)
             case 0x0A: handler->OnKeyDown('9'); break;
             case 0x0B: handler->OnKeyDown('0'); break;
 
+            case 0x0F: handler->OnKeyDown('\t'); break;
             case 0x10: handler->OnKeyDown('q'); break;
             case 0x11: handler->OnKeyDown('w'); break;
             case 0x12: handler->OnKeyDown('e'); break;
@@ -105,6 +106,11 @@ uint32_t KeyboardDriver::HandleInterrupt(uint32_t esp)
 
             case 0x1C: handler->OnKeyDown('\n'); break;
             case 0x39: handler->OnKeyDown(' '); break;
+            case 0x3B: handler->OnKeyDown('\x01'); break; // F1
+            case 0x3C: handler->OnKeyDown('\x02'); break; // F2
+            case 0x3D: handler->OnKeyDown('\x03'); break; // F3
+            case 0x3E: handler->OnKeyDown('\x04'); break; // F4
+            case 0x3F: handler->OnKeyDown('\x05'); break; // F5
 
             default:
             {
@@ -0,0 +1,47 @@
+#include <drivers/serial.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::drivers;
+
+
+SerialPort::SerialPort(uint16_t portBase)
+:   dataPort(portBase),
+    interruptEnablePort(portBase + 0x1),
+    fifoControlPort(portBase + 0x2),
+    lineControlPort(portBase + 0x3),
+    modemControlPort(portBase + 0x4),
+    lineStatusPort(portBase + 0x5)
+{
+    interruptEnablePort.Write(0x00);
+    
+    // divisor 1 ---> 115200 baud
+    lineControlPort.Write(0x80);
+    dataPort.Write(0x01);
+    interruptEnablePort.Write(0x00);
+    
+    lineControlPort.Write(0x03);  // 8 bits, no parity, one stop bit
+    fifoControlPort.Write(0xC7);  // enable and clear the FIFOs
+    modemControlPort.Write(0x03); // DTR, RTS
+}
+
+SerialPort::~SerialPort()
+{
+}
+
+void SerialPort::Write(char c)
+{
+    // wait for the transmit holding register to be empty
+    while((lineStatusPort.Read() & 0x20) == 0);
+    dataPort.Write(c);
+}
+
+void SerialPort::Write(char* str)
+{
+    for(int i = 0; str[i] != '\0'; i++)
+    {
+        if(str[i] == '\n')
+            Write('\r');
+        Write(str[i]);
+    }
+}
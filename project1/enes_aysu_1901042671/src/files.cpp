@@ -0,0 +1,123 @@
+
+#include <files.h>
+
+using namespace myos;
+using namespace myos::common;
+
+void printf(char* str);
+
+
+File::File()
+{
+    references = 0;
+}
+
+File::~File()
+{
+}
+
+void File::Acquire()
+{
+    references++;
+}
+
+void File::Release()
+{
+    if(references > 0 && --references == 0)
+        Close();
+}
+
+void File::Close()
+{
+}
+
+int32_t File::Read(uint8_t* buffer, uint32_t size)
+{
+    return -EINVAL;
+}
+
+int32_t File::Write(const uint8_t* buffer, uint32_t size)
+{
+    return -EINVAL;
+}
+
+
+
+ConsoleFile::ConsoleFile()
+{
+}
+
+ConsoleFile::~ConsoleFile()
+{
+}
+
+int32_t ConsoleFile::Read(uint8_t* buffer, uint32_t size)
+{
+    return 0;
+}
+
+int32_t ConsoleFile::Write(const uint8_t* buffer, uint32_t size)
+{
+    // printf wants a terminated string, so in pieces
+    char chunk[65];
+    for(uint32_t done = 0; done < size; )
+    {
+        uint32_t length = 0;
+        while(length < sizeof(chunk) - 1 && done < size)
+            chunk[length++] = buffer[done++];
+        chunk[length] = '\0';
+        printf(chunk);
+    }
+    return size;
+}
+
+
+
+NullFile::NullFile()
+{
+}
+
+NullFile::~NullFile()
+{
+}
+
+int32_t NullFile::Read(uint8_t* buffer, uint32_t size)
+{
+    return 0;
+}
+
+int32_t NullFile::Write(const uint8_t* buffer, uint32_t size)
+{
+    return size;
+}
+
+
+
+const char* DeviceFiles::names[MAX_DEVICE_FILES];
+File* DeviceFiles::files[MAX_DEVICE_FILES];
+uint32_t DeviceFiles::numFiles = 0;
+
+bool DeviceFiles::Register(const char* name, File* file)
+{
+    if(numFiles == MAX_DEVICE_FILES)
+        return false;
+    // held forever, no descriptor can close it for good
+    file->Acquire();
+    names[numFiles] = name;
+    files[numFiles] = file;
+    numFiles++;
+    return true;
+}
+
+File* DeviceFiles::Open(const char* name)
+{
+    for(uint32_t i = 0; i < numFiles; i++)
+    {
+        uint32_t j = 0;
+        while(names[i][j] != '\0' && names[i][j] == name[j])
+            j++;
+        if(names[i][j] == name[j])
+            return files[i];
+    }
+    return 0;
+}
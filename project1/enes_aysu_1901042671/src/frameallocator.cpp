@@ -0,0 +1,228 @@
+#include <frameallocator.h>
+
+using namespace myos;
+using namespace myos::common;
+
+
+void printf(char*);
+void printfHex32(uint32_t);
+
+// end of the kernel image including .bss (linker.ld)
+extern "C" uint8_t kernel_end;
+
+static const uint8_t FRAME_FREE = 0x80;
+static const uint64_t ADDRESSABLE = 0x100000000ULL; // no PAE
+
+
+FrameAllocator* FrameAllocator::activeFrameAllocator = 0;
+Spinlock FrameAllocator::lock;
+
+FrameAllocator::FrameAllocator(const void* multiboot_structure)
+{
+    activeFrameAllocator = this;
+    MultibootInformation* info = (MultibootInformation*)multiboot_structure;
+
+    for(uint8_t i = 0; i <= MAX_FRAME_ORDER; i++)
+        freeLists[i] = 0;
+    frameStates = 0;
+    numFrames = 0;
+    totalFrames = 0;
+    freeFrames = 0;
+
+    // without a memory map (flag 6) all we know is mem_upper
+    MultibootMemoryMapEntry fallback;
+    fallback.size = sizeof(MultibootMemoryMapEntry) - 4;
+    fallback.address = 0x100000;
+    fallback.length = (uint64_t)info->memUpper * 1024;
+    fallback.type = 1;
+
+    uint32_t mmapStart = (uint32_t)&fallback;
+    uint32_t mmapEnd = mmapStart + sizeof(fallback);
+    if(info->flags & (1 << 6))
+    {
+        mmapStart = info->mmapAddr;
+        mmapEnd = info->mmapAddr + info->mmapLength;
+    }
+
+    // the per frame table covers everything up to the highest usable byte
+    uint64_t memoryEnd = 0;
+    for(uint32_t e = mmapStart; e < mmapEnd; e += ((MultibootMemoryMapEntry*)e)->size + 4)
+    {
+        MultibootMemoryMapEntry* entry = (MultibootMemoryMapEntry*)e;
+        uint64_t end = entry->address + entry->length;
+        if(entry->type != 1 || entry->address >= ADDRESSABLE)
+            continue;
+        if(end > ADDRESSABLE)
+            end = ADDRESSABLE;
+        if(end > memoryEnd)
+            memoryEnd = end;
+    }
+    numFrames = (uint32_t)(memoryEnd >> 12);
+
+    // and is put in the first usable memory after the kernel
+    uint32_t kernelEnd = ((uint32_t)&kernel_end + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+    for(uint32_t e = mmapStart; e < mmapEnd && frameStates == 0; e += ((MultibootMemoryMapEntry*)e)->size + 4)
+    {
+        MultibootMemoryMapEntry* entry = (MultibootMemoryMapEntry*)e;
+        if(entry->type != 1 || entry->address >= ADDRESSABLE)
+            continue;
+        uint64_t start = (entry->address > kernelEnd) ? entry->address : kernelEnd;
+        start = (start + FRAME_SIZE - 1) & ~(uint64_t)(FRAME_SIZE - 1);
+        if(start + numFrames <= entry->address + entry->length && start + numFrames <= ADDRESSABLE)
+            frameStates = (uint8_t*)(uint32_t)start;
+    }
+    if(frameStates == 0)
+    {
+        printf("NO MEMORY FOR THE FRAME TABLE\n");
+        return;
+    }
+    for(uint32_t i = 0; i < numFrames; i++)
+        frameStates[i] = 0;
+
+    // everything below the end of the frame table is taken (BIOS, kernel,
+    // frame table), and the memory map is still being read while the
+    // free lists get written into the frames
+    uint64_t reservedEnd = (uint32_t)frameStates + numFrames;
+    for(uint32_t e = mmapStart; e < mmapEnd; e += ((MultibootMemoryMapEntry*)e)->size + 4)
+    {
+        MultibootMemoryMapEntry* entry = (MultibootMemoryMapEntry*)e;
+        if(entry->type != 1)
+            continue;
+
+        uint64_t start = entry->address;
+        uint64_t end = entry->address + entry->length;
+        if(start < reservedEnd)
+            start = reservedEnd;
+
+        if(mmapStart < end && mmapEnd > start)
+        {
+            AddRange(start, mmapStart);
+            AddRange(mmapEnd, end);
+        }
+        else
+            AddRange(start, end);
+    }
+}
+
+FrameAllocator::~FrameAllocator()
+{
+    if(activeFrameAllocator == this)
+        activeFrameAllocator = 0;
+}
+
+void FrameAllocator::AddRange(uint64_t start, uint64_t end)
+{
+    if(end > ADDRESSABLE)
+        end = ADDRESSABLE;
+    start = (start + FRAME_SIZE - 1) >> 12;
+    end = end >> 12;
+
+    // in the biggest blocks that are aligned to their size
+    uint32_t frame = (uint32_t)start;
+    while(frame < end)
+    {
+        uint8_t order = 0;
+        while(order < MAX_FRAME_ORDER
+           && (frame & ((2u << order) - 1)) == 0
+           && frame + (2u << order) <= end)
+            order++;
+
+        Push(frame, order);
+        totalFrames += 1u << order;
+        frame += 1u << order;
+    }
+}
+
+void FrameAllocator::Push(uint32_t frame, uint8_t order)
+{
+    FreeBlock* block = (FreeBlock*)(frame * FRAME_SIZE);
+    block->prev = 0;
+    block->next = freeLists[order];
+    if(freeLists[order] != 0)
+        freeLists[order]->prev = block;
+    freeLists[order] = block;
+
+    frameStates[frame] = FRAME_FREE | order;
+    freeFrames += 1u << order;
+}
+
+void FrameAllocator::Remove(uint32_t frame, uint8_t order)
+{
+    FreeBlock* block = (FreeBlock*)(frame * FRAME_SIZE);
+    if(block->prev != 0)
+        block->prev->next = block->next;
+    else
+        freeLists[order] = block->next;
+    if(block->next != 0)
+        block->next->prev = block->prev;
+
+    frameStates[frame] = 0;
+    freeFrames -= 1u << order;
+}
+
+void* FrameAllocator::Allocate(uint8_t order)
+{
+    if(order > MAX_FRAME_ORDER)
+        return 0;
+    SpinlockGuard guard(&lock);
+
+    uint8_t available = order;
+    while(available <= MAX_FRAME_ORDER && freeLists[available] == 0)
+        available++;
+    if(available > MAX_FRAME_ORDER)
+        return 0;
+
+    uint32_t frame = (uint32_t)freeLists[available] / FRAME_SIZE;
+    Remove(frame, available);
+
+    // give the upper halves back until the block has the right size
+    while(available > order)
+    {
+        available--;
+        Push(frame + (1u << available), available);
+    }
+    return (void*)(frame * FRAME_SIZE);
+}
+
+void FrameAllocator::Free(void* block, uint8_t order)
+{
+    if(block == 0)
+        return;
+    SpinlockGuard guard(&lock);
+    uint32_t frame = (uint32_t)block / FRAME_SIZE;
+
+    // merge with the buddy as long as it is free and just as big
+    while(order < MAX_FRAME_ORDER)
+    {
+        uint32_t buddy = frame ^ (1u << order);
+        if(buddy >= numFrames || frameStates[buddy] != (FRAME_FREE | order))
+            break;
+        Remove(buddy, order);
+        frame &= ~(1u << order);
+        order++;
+    }
+    Push(frame, order);
+}
+
+uint8_t FrameAllocator::Order(size_t size)
+{
+    uint8_t order = 0;
+    while(order <= MAX_FRAME_ORDER && (FRAME_SIZE << order) < size)
+        order++;
+    return order;
+}
+
+uint32_t FrameAllocator::MemoryEnd()
+{
+    return numFrames * FRAME_SIZE;
+}
+
+uint32_t FrameAllocator::TotalFrames()
+{
+    return totalFrames;
+}
+
+uint32_t FrameAllocator::FreeFrames()
+{
+    return freeFrames;
+}
@@ -1,19 +1,44 @@
 
 #include <gdt.h>
+#include <cpu.h>
 using namespace myos;
 using namespace myos::common;
 
 
-GlobalDescriptorTable::GlobalDescriptorTable()
+static CPU* ThisCPU(CPU* cpu)
+{
+    return (cpu != 0) ? cpu : CPUManager::Get(0);
+}
+
+GlobalDescriptorTable::GlobalDescriptorTable(CPU* cpu)
     : nullSegmentSelector(0, 0, 0),
         unusedSegmentSelector(0, 0, 0),
-        codeSegmentSelector(0, 64*1024*1024, 0x9A),
-        dataSegmentSelector(0, 64*1024*1024, 0x92)
+        // flat 4 GiB, the per task window lives above 3 GiB
+        codeSegmentSelector(0, 0xFFFFFFFF, 0x9A),
+        dataSegmentSelector(0, 0xFFFFFFFF, 0x92),
+        taskStateSegmentSelector((uint32_t)&ThisCPU(cpu)->taskStateSegment, sizeof(TaskStateSegment) - 1, 0x89),
+        pageFaultTaskStateSegmentSelector((uint32_t)&ThisCPU(cpu)->pageFaultTaskStateSegment, sizeof(TaskStateSegment) - 1, 0x89),
+        cpuSegmentSelector((uint32_t)ThisCPU(cpu), sizeof(CPU) - 1, 0x92)
 {
+    cpu = ThisCPU(cpu);
+    cpu->self = cpu;
+
     uint32_t i[2];
     i[1] = (uint32_t)this;
     i[0] = sizeof(GlobalDescriptorTable) << 16;
     asm volatile("lgdt (%0)": :"p" (((uint8_t *) i)+2));
+
+    // nothing reloads %gs afterwards, so CPUManager::Current() is just %gs:0
+    uint16_t cpuSelector = CPUSegmentSelector();
+    asm volatile("mov %0, %%gs": :"r" (cpuSelector));
+
+    // no I/O permission bitmap
+    cpu->taskStateSegment.iomapBase = sizeof(TaskStateSegment);
+    cpu->pageFaultTaskStateSegment.iomapBase = sizeof(TaskStateSegment);
+
+    // the CPU saves the running context here when it switches to a fault task
+    uint16_t selector = TaskStateSegmentSelector();
+    asm volatile("ltr %0": :"r" (selector));
 }
 
 GlobalDescriptorTable::~GlobalDescriptorTable()
@@ -30,6 +55,21 @@ uint16_t GlobalDescriptorTable::CodeSegmentSelector()
     return (uint8_t*)&codeSegmentSelector - (uint8_t*)this;
 }
 
+uint16_t GlobalDescriptorTable::TaskStateSegmentSelector()
+{
+    return (uint8_t*)&taskStateSegmentSelector - (uint8_t*)this;
+}
+
+uint16_t GlobalDescriptorTable::PageFaultTaskStateSegmentSelector()
+{
+    return (uint8_t*)&pageFaultTaskStateSegmentSelector - (uint8_t*)this;
+}
+
+uint16_t GlobalDescriptorTable::CPUSegmentSelector()
+{
+    return (uint8_t*)&cpuSegmentSelector - (uint8_t*)this;
+}
+
 GlobalDescriptorTable::SegmentDescriptor::SegmentDescriptor(uint32_t base, uint32_t limit, uint8_t type)
 {
     uint8_t* target = (uint8_t*)this;
@@ -71,6 +111,10 @@ GlobalDescriptorTable::SegmentDescriptor::SegmentDescriptor(uint32_t base, uint3
     target[4] = (base >> 16) & 0xFF;
     target[7] = (base >> 24) & 0xFF;
 
+    // system descriptors (TSS) don't have the 32-bit flag
+    if((type & 0x10) == 0)
+        target[6] &= 0x8F;
+
     // Type
     target[5] = type;
 }
@@ -0,0 +1,325 @@
+#include <hardwarecommunication/apic.h>
+#include <hardwarecommunication/port.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::hardwarecommunication;
+
+
+struct ACPIRootPointer
+{
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;
+    char oem[6];
+    uint8_t revision;
+    uint32_t rsdtAddress;
+} __attribute__((packed));
+
+struct ACPITableHeader
+{
+    char signature[4];
+    uint32_t length; // including this header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oemTable[8];
+    uint32_t oemRevision;
+    uint32_t creator;
+    uint32_t creatorRevision;
+} __attribute__((packed));
+
+// MADT entry types
+static const uint8_t MADT_LOCAL_APIC = 0;
+static const uint8_t MADT_IO_APIC = 1;
+static const uint8_t MADT_INTERRUPT_OVERRIDE = 2;
+
+
+static bool ChecksumValid(uint8_t* table, uint32_t length)
+{
+    uint8_t sum = 0;
+    for(uint32_t i = 0; i < length; i++)
+        sum += table[i];
+    return sum == 0;
+}
+
+static bool SignatureIs(char* signature, char* expected, uint32_t length)
+{
+    for(uint32_t i = 0; i < length; i++)
+        if(signature[i] != expected[i])
+            return false;
+    return true;
+}
+
+static ACPIRootPointer* FindRootPointer()
+{
+    // first KiB of the EBDA, then the BIOS area, on 16 byte boundaries
+    uint32_t ebda = (uint32_t)(*(uint16_t*)0x40E) << 4;
+    uint32_t starts[2] = {ebda, 0xE0000};
+    uint32_t ends[2] = {ebda + 1024, 0x100000};
+
+    for(int r = 0; r < 2; r++)
+    {
+        if(starts[r] == 0)
+            continue;
+        for(uint32_t address = starts[r]; address < ends[r]; address += 16)
+        {
+            ACPIRootPointer* rsdp = (ACPIRootPointer*)address;
+            if(SignatureIs(rsdp->signature, "RSD PTR ", 8) && ChecksumValid((uint8_t*)rsdp, sizeof(ACPIRootPointer)))
+                return rsdp;
+        }
+    }
+    return 0;
+}
+
+bool APICConfiguration::Read(APICConfiguration* config)
+{
+    config->localAPICAddress = 0xFEE00000;
+    config->ioAPICAddress = 0;
+    config->ioAPICBase = 0;
+    config->numProcessors = 0;
+    // ISA interrupts are identity mapped, edge triggered, active high
+    // unless an override says otherwise
+    for(uint32_t irq = 0; irq < 16; irq++)
+    {
+        config->irqToGSI[irq] = irq;
+        config->irqFlags[irq] = 0;
+    }
+
+    // the tables are below 4 GiB and identity mapped
+    ACPIRootPointer* rsdp = FindRootPointer();
+    if(rsdp == 0)
+        return false;
+    ACPITableHeader* rsdt = (ACPITableHeader*)rsdp->rsdtAddress;
+    if(!SignatureIs(rsdt->signature, "RSDT", 4) || !ChecksumValid((uint8_t*)rsdt, rsdt->length))
+        return false;
+
+    ACPITableHeader* madt = 0;
+    uint32_t* tables = (uint32_t*)((uint32_t)rsdt + sizeof(ACPITableHeader));
+    uint32_t numTables = (rsdt->length - sizeof(ACPITableHeader)) / 4;
+    for(uint32_t i = 0; i < numTables && madt == 0; i++)
+    {
+        ACPITableHeader* table = (ACPITableHeader*)tables[i];
+        if(SignatureIs(table->signature, "APIC", 4) && ChecksumValid((uint8_t*)table, table->length))
+            madt = table;
+    }
+    if(madt == 0)
+        return false;
+
+    // local APIC address and flags, then variable length entries
+    uint8_t* body = (uint8_t*)madt + sizeof(ACPITableHeader);
+    config->localAPICAddress = *(uint32_t*)body;
+
+    uint8_t* end = (uint8_t*)madt + madt->length;
+    for(uint8_t* entry = body + 8; entry + 2 <= end && entry[1] >= 2; entry += entry[1])
+    {
+        switch(entry[0])
+        {
+            case MADT_LOCAL_APIC:
+                // bit 0 of the flags ---> enabled
+                if((entry[4] & 1) && config->numProcessors < MAX_CPUS)
+                    config->apicIds[config->numProcessors++] = entry[3];
+                break;
+
+            case MADT_IO_APIC:
+                // only the first one, it has the ISA interrupts
+                if(config->ioAPICAddress == 0)
+                {
+                    config->ioAPICAddress = *(uint32_t*)(entry + 4);
+                    config->ioAPICBase = *(uint32_t*)(entry + 8);
+                }
+                break;
+
+            case MADT_INTERRUPT_OVERRIDE:
+                // bus 0 (ISA), e.g. the PIT on input 2
+                if(entry[2] == 0 && entry[3] < 16)
+                {
+                    config->irqToGSI[entry[3]] = *(uint32_t*)(entry + 4);
+                    config->irqFlags[entry[3]] = *(uint16_t*)(entry + 8);
+                }
+                break;
+        }
+    }
+
+    return config->numProcessors > 0 && config->ioAPICAddress != 0;
+}
+
+
+
+// local APIC register offsets
+static const uint32_t LAPIC_ID = 0x020;
+static const uint32_t LAPIC_TASK_PRIORITY = 0x080;
+static const uint32_t LAPIC_EOI = 0x0B0;
+static const uint32_t LAPIC_SPURIOUS = 0x0F0;
+static const uint32_t LAPIC_COMMAND_LOW = 0x300;
+static const uint32_t LAPIC_COMMAND_HIGH = 0x310;
+static const uint32_t LAPIC_TIMER = 0x320;
+static const uint32_t LAPIC_TIMER_INITIAL = 0x380;
+static const uint32_t LAPIC_TIMER_CURRENT = 0x390;
+static const uint32_t LAPIC_TIMER_DIVIDE = 0x3E0;
+
+static const uint32_t LAPIC_DELIVERY_PENDING = 1 << 12;
+static const uint32_t LAPIC_MASKED = 1 << 16;
+
+volatile uint32_t* LocalAPIC::registers = (volatile uint32_t*)0xFEE00000;
+
+void LocalAPIC::SetAddress(uint32_t address)
+{
+    registers = (volatile uint32_t*)address;
+}
+
+uint32_t LocalAPIC::Read(uint32_t offset)
+{
+    return registers[offset / 4];
+}
+
+void LocalAPIC::Write(uint32_t offset, uint32_t value)
+{
+    registers[offset / 4] = value;
+}
+
+void LocalAPIC::Enable()
+{
+    Write(LAPIC_TASK_PRIORITY, 0);
+    Write(LAPIC_SPURIOUS, 0x100 | 0xFF);
+}
+
+uint8_t LocalAPIC::Id()
+{
+    return Read(LAPIC_ID) >> 24;
+}
+
+void LocalAPIC::EndOfInterrupt()
+{
+    Write(LAPIC_EOI, 0);
+}
+
+void LocalAPIC::SendCommand(uint8_t apicId, uint32_t command)
+{
+    Write(LAPIC_COMMAND_HIGH, (uint32_t)apicId << 24);
+    Write(LAPIC_COMMAND_LOW, command);
+    while(Read(LAPIC_COMMAND_LOW) & LAPIC_DELIVERY_PENDING)
+        asm volatile("pause");
+}
+
+void LocalAPIC::SendInit(uint8_t apicId)
+{
+    // delivery mode INIT, level assert
+    SendCommand(apicId, 0x4500);
+}
+
+void LocalAPIC::SendStartup(uint8_t apicId, uint32_t address)
+{
+    // the processor starts in real mode at address (page aligned, below 1 MiB)
+    SendCommand(apicId, 0x4600 | (address >> 12));
+}
+
+void LocalAPIC::SendInterrupt(uint8_t apicId, uint8_t vector)
+{
+    // delivery mode fixed, level assert
+    SendCommand(apicId, 0x4000 | vector);
+}
+
+uint32_t LocalAPIC::CalibrateTimer()
+{
+    // count down from the top for 10 ms
+    Write(LAPIC_TIMER_DIVIDE, 0x3); // by 16
+    Write(LAPIC_TIMER, LAPIC_MASKED);
+    Write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    PITDelay(10000);
+    uint32_t elapsed = 0xFFFFFFFF - Read(LAPIC_TIMER_CURRENT);
+    Write(LAPIC_TIMER_INITIAL, 0);
+    return elapsed;
+}
+
+void LocalAPIC::StartOneShot(uint8_t vector, uint32_t count)
+{
+    // writing the initial count (re)starts it, 0 stops it
+    Write(LAPIC_TIMER_DIVIDE, 0x3);
+    Write(LAPIC_TIMER, vector);
+    Write(LAPIC_TIMER_INITIAL, count);
+}
+
+
+
+static const uint32_t IOAPIC_MASKED = 1 << 16;
+
+IOAPIC::IOAPIC(uint32_t address, uint32_t gsiBase)
+{
+    registers = (volatile uint32_t*)address;
+    this->gsiBase = gsiBase;
+}
+
+IOAPIC::~IOAPIC()
+{
+}
+
+uint32_t IOAPIC::Read(uint8_t index)
+{
+    // select the register, then access it through the window at 0x10
+    registers[0] = index;
+    return registers[4];
+}
+
+void IOAPIC::Write(uint8_t index, uint32_t value)
+{
+    registers[0] = index;
+    registers[4] = value;
+}
+
+uint32_t IOAPIC::NumInputs()
+{
+    return ((Read(0x01) >> 16) & 0xFF) + 1;
+}
+
+void IOAPIC::Route(uint32_t gsi, uint8_t vector, uint8_t apicId, uint16_t flags)
+{
+    if(gsi < gsiBase || gsi - gsiBase >= NumInputs())
+        return;
+    uint8_t entry = 0x10 + 2 * (gsi - gsiBase);
+
+    // fixed delivery to one processor, polarity and trigger mode as
+    // the MADT says (0 ---> ISA defaults: active high, edge)
+    uint32_t low = vector;
+    if((flags & 0x3) == 0x3)
+        low |= 1 << 13; // active low
+    if(((flags >> 2) & 0x3) == 0x3)
+        low |= 1 << 15; // level triggered
+
+    Write(entry + 1, (uint32_t)apicId << 24);
+    Write(entry, low);
+}
+
+void IOAPIC::Mask(uint32_t gsi)
+{
+    if(gsi < gsiBase || gsi - gsiBase >= NumInputs())
+        return;
+    uint8_t entry = 0x10 + 2 * (gsi - gsiBase);
+    Write(entry, Read(entry) | IOAPIC_MASKED);
+}
+
+
+
+void myos::hardwarecommunication::PITDelay(uint32_t microseconds)
+{
+    Port8Bit gate(0x61);
+    Port8Bit command(0x43);
+    Port8Bit channel2(0x42);
+
+    // 1.193182 MHz
+    uint32_t count = microseconds * 1193 / 1000;
+    if(count > 0xFFFF)
+        count = 0xFFFF;
+
+    // speaker off, gate low while programming mode 0 (one shot)
+    uint8_t control = gate.Read() & 0xFC;
+    gate.Write(control);
+    command.Write(0xB0);
+    channel2.Write(count & 0xFF);
+    channel2.Write(count >> 8);
+
+    // raising the gate starts the count, OUT2 (bit 5) goes high at 0
+    gate.Write(control | 0x01);
+    while((gate.Read() & 0x20) == 0)
+        ;
+    gate.Write(control);
+}
@@ -0,0 +1,79 @@
+
+#include <hardwarecommunication/deferredwork.h>
+#include <hardwarecommunication/tsc.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::hardwarecommunication;
+
+
+DeferredWork::DeferredWork(void (*function)(void* data), void* data)
+{
+    this->function = function;
+    this->data = data;
+    next = 0;
+    queued = false;
+}
+
+DeferredWork::~DeferredWork()
+{
+}
+
+void DeferredWork::Schedule()
+{
+    if(!queued)
+        DeferredWorkQueue::Add(this);
+}
+
+
+
+DeferredWork* DeferredWorkQueue::head[MAX_CPUS];
+DeferredWork* DeferredWorkQueue::tail[MAX_CPUS];
+bool DeferredWorkQueue::running[MAX_CPUS];
+
+void DeferredWorkQueue::Add(DeferredWork* work)
+{
+    uint32_t cpu = CPUManager::Current()->index;
+    work->queued = true;
+    work->next = 0;
+    if(tail[cpu] != 0)
+        tail[cpu]->next = work;
+    else
+        head[cpu] = work;
+    tail[cpu] = work;
+}
+
+bool DeferredWorkQueue::Running()
+{
+    return running[CPUManager::Current()->index];
+}
+
+bool DeferredWorkQueue::Pending()
+{
+    return head[CPUManager::Current()->index] != 0;
+}
+
+uint32_t DeferredWorkQueue::Run()
+{
+    uint32_t cpu = CPUManager::Current()->index;
+    if(running[cpu] || head[cpu] == 0)
+        return 0;
+
+    uint64_t start = ReadTimeStampCounter();
+    running[cpu] = true;
+    for(uint32_t done = 0; done < DEFERRED_WORK_BUDGET && head[cpu] != 0; done++)
+    {
+        DeferredWork* work = head[cpu];
+        head[cpu] = work->next;
+        if(head[cpu] == 0)
+            tail[cpu] = 0;
+        work->queued = false;
+
+        // the interrupts that come in meanwhile only add to the list
+        asm volatile("sti");
+        work->function(work->data);
+        asm volatile("cli");
+    }
+    running[cpu] = false;
+    return (uint32_t)(ReadTimeStampCounter() - start);
+}
@@ -1,5 +1,9 @@
 
 #include <hardwarecommunication/interrupts.h>
+#include <hardwarecommunication/apic.h>
+#include <hardwarecommunication/tsc.h>
+#include <hardwarecommunication/deferredwork.h>
+#include <timer.h>
 using namespace myos;
 using namespace myos::common;
 using namespace myos::hardwarecommunication;
@@ -7,6 +11,7 @@ using namespace myos::hardwarecommunication;
 
 void printf(char* str);
 void printfHex(uint8_t);
+void printfHex32(void (*print)(char*), uint32_t);
 
 common::uint32_t InterruptHandler::os_getPid() {
     return interruptManager->taskManager->GetPID();
@@ -16,17 +21,37 @@ common::uint32_t InterruptHandler::os_getCPid() {
     return interruptManager->taskManager->GetCPID();
 }
 
-common::int32_t InterruptHandler::os_fork(CPUState* cpu) {
-    return interruptManager->taskManager->ForkTask(cpu);
+common::int32_t InterruptHandler::os_fork(CPUState* cpu, const BatchParameters* batch) {
+    return interruptManager->taskManager->ForkTask(cpu, batch);
 }
 
-bool InterruptHandler::os_exit() {
-    return interruptManager->taskManager->ExitTask();
+bool InterruptHandler::os_exit(common::int32_t status) {
+    return interruptManager->taskManager->ExitTask(status);
 }
 
-bool InterruptHandler::os_waitPid(common::uint32_t wPid)
+bool InterruptHandler::os_waitPid(CPUState* cpu)
 {
-    return interruptManager->taskManager->WaitTask(wPid);
+    return interruptManager->taskManager->WaitTask(cpu);
+}
+
+bool InterruptHandler::os_sleep(common::uint32_t microseconds)
+{
+    return interruptManager->taskManager->Sleep(microseconds);
+}
+
+common::uint32_t InterruptHandler::os_reschedule(common::uint32_t esp)
+{
+    return (common::uint32_t)interruptManager->taskManager->Reschedule((CPUState*)esp);
+}
+
+common::int32_t InterruptHandler::os_getTaskStats(common::uint32_t pid, TaskStatistics* stats)
+{
+    return interruptManager->taskManager->GetTaskStatistics(pid, stats) ? 0 : -1;
+}
+
+void InterruptHandler::os_accountSyscall()
+{
+    interruptManager->taskManager->AccountSyscall();
 }
 
 InterruptHandler::InterruptHandler(InterruptManager* interruptManager, uint8_t InterruptNumber)
@@ -49,6 +74,7 @@ uint32_t InterruptHandler::HandleInterrupt(uint32_t esp)
 
 InterruptManager::GateDescriptor InterruptManager::interruptDescriptorTable[256];
 InterruptManager* InterruptManager::ActiveInterruptManager = 0;
+InterruptStatistics InterruptManager::statistics[MAX_CPUS][256];
 
 void InterruptManager::SetInterruptDescriptorTableEntry(uint8_t interrupt,
     uint16_t CodeSegment, void (*handler)(), uint8_t DescriptorPrivilegeLevel, uint8_t DescriptorType)
@@ -72,6 +98,7 @@ InterruptManager::InterruptManager(uint16_t hardwareInterruptOffset, GlobalDescr
 {
     this->taskManager = taskManager;
     this->hardwareInterruptOffset = hardwareInterruptOffset;
+    apic = false;
     uint32_t CodeSegment = globalDescriptorTable->CodeSegmentSelector();
 
     const uint8_t IDT_INTERRUPT_GATE = 0xE;
@@ -82,6 +109,8 @@ InterruptManager::InterruptManager(uint16_t hardwareInterruptOffset, GlobalDescr
     }
     SetInterruptDescriptorTableEntry(0, CodeSegment, &InterruptIgnore, 0, IDT_INTERRUPT_GATE);
     handlers[0] = 0;
+    for(uint32_t i = 0; i < MAX_CPUS; i++)
+        tickDeferred[i] = false;
 
     SetInterruptDescriptorTableEntry(0x00, CodeSegment, &HandleException0x00, 0, IDT_INTERRUPT_GATE);
     SetInterruptDescriptorTableEntry(0x01, CodeSegment, &HandleException0x01, 0, IDT_INTERRUPT_GATE);
@@ -97,7 +126,9 @@ InterruptManager::InterruptManager(uint16_t hardwareInterruptOffset, GlobalDescr
     SetInterruptDescriptorTableEntry(0x0B, CodeSegment, &HandleException0x0B, 0, IDT_INTERRUPT_GATE);
     SetInterruptDescriptorTableEntry(0x0C, CodeSegment, &HandleException0x0C, 0, IDT_INTERRUPT_GATE);
     SetInterruptDescriptorTableEntry(0x0D, CodeSegment, &HandleException0x0D, 0, IDT_INTERRUPT_GATE);
-    SetInterruptDescriptorTableEntry(0x0E, CodeSegment, &HandleException0x0E, 0, IDT_INTERRUPT_GATE);
+    // page faults get their own task (and stack), see paging.cpp
+    const uint8_t IDT_TASK_GATE = 0x5;
+    SetInterruptDescriptorTableEntry(0x0E, globalDescriptorTable->PageFaultTaskStateSegmentSelector(), 0, 0, IDT_TASK_GATE);
     SetInterruptDescriptorTableEntry(0x0F, CodeSegment, &HandleException0x0F, 0, IDT_INTERRUPT_GATE);
     SetInterruptDescriptorTableEntry(0x10, CodeSegment, &HandleException0x10, 0, IDT_INTERRUPT_GATE);
     SetInterruptDescriptorTableEntry(0x11, CodeSegment, &HandleException0x11, 0, IDT_INTERRUPT_GATE);
@@ -139,12 +170,24 @@ InterruptManager::InterruptManager(uint16_t hardwareInterruptOffset, GlobalDescr
     programmableInterruptControllerMasterDataPort.Write(0x00);
     programmableInterruptControllerSlaveDataPort.Write(0x00);
 
+    LoadInterruptDescriptorTable();
+}
+
+void InterruptManager::LoadInterruptDescriptorTable()
+{
     InterruptDescriptorTablePointer idt_pointer;
     idt_pointer.size  = 256*sizeof(GateDescriptor) - 1;
     idt_pointer.base  = (uint32_t)interruptDescriptorTable;
     asm volatile("lidt %0" : : "m" (idt_pointer));
 }
 
+void InterruptManager::UseAPIC()
+{
+    programmableInterruptControllerMasterDataPort.Write(0xFF);
+    programmableInterruptControllerSlaveDataPort.Write(0xFF);
+    apic = true;
+}
+
 InterruptManager::~InterruptManager()
 {
     Deactivate();
@@ -183,6 +226,8 @@ uint32_t InterruptManager::HandleInterrupt(uint8_t interrupt, uint32_t esp)
 
 uint32_t InterruptManager::DoHandleInterrupt(uint8_t interrupt, uint32_t esp)
 {
+    uint64_t start = ReadTimeStampCounter();
+
     // printf("INTERRUPT 0x");
     if(handlers[interrupt] != 0)
     {
@@ -194,22 +239,101 @@ uint32_t InterruptManager::DoHandleInterrupt(uint8_t interrupt, uint32_t esp)
         printfHex(interrupt);
     }
     
-    if(interrupt == hardwareInterruptOffset)
-    {
-        esp = (uint32_t)taskManager->Schedule((CPUState*)esp);
-    }
-
-    // hardware interrupts must be acknowledged
+    uint32_t deferredCycles = 0;
     if(hardwareInterruptOffset <= interrupt && interrupt < hardwareInterruptOffset+16)
     {
-        programmableInterruptControllerMasterCommandPort.Write(0x20);
-        if(hardwareInterruptOffset + 8 <= interrupt)
-            programmableInterruptControllerSlaveCommandPort.Write(0x20);
+        TimerManager* timers = TimerManager::activeTimerManager;
+        bool timer = (interrupt == hardwareInterruptOffset);
+        bool tick = timer && (timers == 0 || timers->HandleInterrupt());
+
+        // hardware interrupts must be acknowledged, before the
+        // deferred work lets the next ones in
+        if(apic)
+        {
+            LocalAPIC::EndOfInterrupt();
+        }
+        else
+        {
+            programmableInterruptControllerMasterCommandPort.Write(0x20);
+            if(hardwareInterruptOffset + 8 <= interrupt)
+                programmableInterruptControllerSlaveCommandPort.Write(0x20);
+        }
+
+        uint32_t cpu = CPUManager::Current()->index;
+        if(DeferredWorkQueue::Running())
+        {
+            // came in during deferred work further up this stack, the
+            // outermost interrupt takes the tick once the work is done
+            tickDeferred[cpu] = tickDeferred[cpu] || tick;
+            if(timers != 0 && timer)
+                timers->Rearm(false);
+        }
+        else
+        {
+            deferredCycles = DeferredWorkQueue::Run();
+            tick = tick || tickDeferred[cpu];
+            tickDeferred[cpu] = false;
+
+            // the one shot timer also fires for the timer wheel and wake-ups,
+            // and an idle processor runs whatever an interrupt made ready
+            bool schedule = tick || taskManager->IsIdle();
+            if(schedule)
+                esp = (uint32_t)taskManager->Schedule((CPUState*)esp);
+            if(timers != 0 && (timer || schedule))
+                timers->Rearm(taskManager->IsIdle() && !DeferredWorkQueue::Pending());
+        }
     }
 
+    // time with interrupts off, on the processor it came in on
+    uint32_t cycles = (uint32_t)(ReadTimeStampCounter() - start) - deferredCycles;
+    CountCycles(&statistics[CPUManager::Current()->index][interrupt], cycles);
+
     return esp;
 }
 
+void InterruptManager::GetStatistics(uint8_t interrupt, InterruptStatistics* stats)
+{
+    SumCycles(stats, &statistics[0][interrupt], 256);
+}
+
+// total / count without __udivdi3, saturates if it doesn't fit into 32 bits
+static uint32_t Average(uint64_t total, uint32_t count)
+{
+    uint32_t high = total >> 32;
+    if(high >= count)
+        return 0xFFFFFFFF;
+    uint32_t quotient, remainder;
+    asm("divl %4" : "=a" (quotient), "=d" (remainder) : "a" ((uint32_t)total), "d" (high), "rm" (count) : "cc");
+    return quotient;
+}
+
+void InterruptManager::Report(void (*print)(char*))
+{
+    uint32_t seconds = 0;
+    if(TimerManager::activeTimerManager != 0)
+        seconds = TimerManager::activeTimerManager->Ticks() / (1000000 / SCHEDULER_TICK);
+
+    print("VECTOR   COUNT    PER SEC  AVG      MAX CYCLES\n");
+    for(uint32_t interrupt = 0; interrupt < 256; interrupt++)
+    {
+        InterruptStatistics stats;
+        GetStatistics(interrupt, &stats);
+        if(stats.count == 0)
+            continue;
+
+        printfHex32(print, interrupt);
+        print(" ");
+        printfHex32(print, stats.count);
+        print(" ");
+        printfHex32(print, (seconds != 0) ? stats.count / seconds : stats.count);
+        print(" ");
+        printfHex32(print, Average(stats.totalCycles, stats.count));
+        print(" ");
+        printfHex32(print, stats.maxCycles);
+        print("\n");
+    }
+}
+
 
 
 
@@ -10,7 +10,7 @@
 .macro HandleException num
 .global _ZN4myos21hardwarecommunication16InterruptManager19HandleException\num\()Ev
 _ZN4myos21hardwarecommunication16InterruptManager19HandleException\num\()Ev:
-    movb $\num, (interruptnumber)
+    pushl $\num
     jmp int_bottom
 .endm
 
@@ -18,8 +18,8 @@ _ZN4myos21hardwarecommunication16InterruptManager19HandleException\num\()Ev:
 .macro HandleInterruptRequest num
 .global _ZN4myos21hardwarecommunication16InterruptManager26HandleInterruptRequest\num\()Ev
 _ZN4myos21hardwarecommunication16InterruptManager26HandleInterruptRequest\num\()Ev:
-    movb $\num + IRQ_BASE, (interruptnumber)
     pushl $0
+    pushl $\num + IRQ_BASE
     jmp int_bottom
 .endm
 
@@ -75,7 +75,9 @@ int_bottom:
     #pushl %fs
     #pushl %gs
     
-    pushl %ebp
+    # the interrupt number is on the stack where ebp belongs, a global
+    # would be overwritten by the other processors
+    xchg %ebp, (%esp)
     pushl %edi
     pushl %esi
 
@@ -92,9 +94,22 @@ int_bottom:
 
     # call C++ Handler
     pushl %esp
-    push (interruptnumber)
+    pushl %ebp
     call _ZN4myos21hardwarecommunication16InterruptManager15HandleInterruptEhj
     #add %esp, 6
+
+    # every task sees its stack at the same address,
+    # so load its page directory before switching to it
+    # (CPU::nextDirectory and the cr3 field of CPU::taskStateSegment)
+    mov %gs:4, %edx
+    test %edx, %edx
+    jz 1f
+    mov %cr3, %ecx
+    cmp %ecx, %edx
+    je 1f
+    mov %edx, %cr3
+    mov %edx, %gs:36
+1:
     mov %eax, %esp # switch the stack
 
     # restore registers
@@ -120,5 +135,10 @@ _ZN4myos21hardwarecommunication16InterruptManager15InterruptIgnoreEv:
     iret
 
 
-.data
-    interruptnumber: .byte 0
+# task gate target of exception 0x0E, the error code is on top of the stack
+.global _ZN4myos13PagingManager13PageFaultTaskEv
+_ZN4myos13PagingManager13PageFaultTaskEv:
+    call _ZN4myos13PagingManager15HandlePageFaultEj
+    add $4, %esp
+    iret # back to the faulting task
+    jmp _ZN4myos13PagingManager13PageFaultTaskEv
@@ -2,6 +2,7 @@
 #include <common/types.h>
 #include <gdt.h>
 #include <memorymanagement.h>
+#include <frameallocator.h>
 #include <hardwarecommunication/interrupts.h>
 #include <syscalls.h>
 #include <hardwarecommunication/pci.h>
@@ -10,9 +11,17 @@
 #include <drivers/mouse.h>
 #include <drivers/vga.h>
 #include <drivers/ata.h>
+#include <drivers/serial.h>
 #include <gui/desktop.h>
 #include <gui/window.h>
 #include <multitasking.h>
+#include <paging.h>
+#include <slab.h>
+#include <cpu.h>
+#include <timer.h>
+#include <spinlock.h>
+#include <hardwarecommunication/tsc.h>
+#include <log.h>
 
 #include <drivers/amd_am79c973.h>
 #include <net/etherframe.h>
@@ -23,6 +32,12 @@
 #include <net/tcp.h>
 
 // #define GRAPHICSMODE
+// #define SCHEDULERBENCHMARK
+// #define FORKBENCHMARK
+// #define MALLOCBENCHMARK
+// #define BATCHBENCHMARK
+// #define SYSCALLBENCHMARK
+// #define NETWORKBENCHMARK
 
 using namespace myos;
 using namespace myos::common;
@@ -32,12 +47,19 @@ using namespace myos::gui;
 using namespace myos::net;
 
 // For the printf function
+static Spinlock consoleLock;
+
 void printf(char* str)
 {
     static uint16_t* VideoMemory = (uint16_t*)0xb8000;
 
     static uint8_t x=0,y=0;
 
+    // nothing to print, no need to wait for the lock
+    if(str[0] == '\0')
+        return;
+    SpinlockGuard guard(&consoleLock);
+
     for(int i = 0; str[i] != '\0'; ++i)
     {
         switch(str[i])
@@ -71,7 +93,8 @@ void printf(char* str)
 
 void printfHex(uint8_t key)
 {
-    char *foo = "00";
+    // on the stack, every processor prints
+    char foo[3] = "00";
     char *hex = "0123456789ABCDEF";
     foo[0] = hex[(key >> 4) & 0xF];
     foo[1] = hex[key & 0xF];
@@ -89,12 +112,118 @@ void printfHex32(uint32_t key)
     printfHex((key >> 8) & 0xFF);
     printfHex(key & 0xFF);
 }
+// for the reports, which print wherever they are told to
+void printfHex32(void (*print)(char*), uint32_t key)
+{
+    char text[9];
+    char *hex = "0123456789ABCDEF";
+    for(int i = 0; i < 8; i++)
+        text[i] = hex[(key >> (28 - 4 * i)) & 0xF];
+    text[8] = 0;
+    print(text);
+}
+
+// COM1, for reports too long for the screen
+SerialPort serialPort;
+void printfSerial(char* str)
+{
+    serialPort.Write(str);
+}
+
+// heap counters, call sites and live chunks, then the slab caches
+void heapReport()
+{
+    printfSerial("\n### Heap ###\n");
+    MemoryManager::activeMemoryManager->Report(printfSerial);
+    MemoryManager::activeMemoryManager->DumpLeaks(printfSerial);
+
+    printfSerial("### Slab caches ###\n");
+    for (SlabAllocator *cache = SlabAllocator::firstCache; cache != 0; cache = cache->GetNext())
+    {
+        SlabStatistics stats;
+        cache->GetStatistics(&stats);
+        printfSerial(cache->GetName());
+        printfSerial(": size ");
+        uint32_t values[] = {stats.objectSize, stats.slabs, stats.inUse, stats.peakInUse, stats.allocations, stats.failures};
+        char *names[] = {"", " slabs ", " in use ", " peak ", " allocs ", " failed "};
+        for (int v = 0; v < 6; v++)
+        {
+            printfSerial(names[v]);
+            printfHex32(printfSerial, values[v]);
+        }
+        printfSerial("\n");
+    }
+}
 
 class PrintfKeyboardEventHandler : public KeyboardEventHandler
 {
+    TaskManager *taskManager;
+    bool serialLog;
+
 public:
+    PrintfKeyboardEventHandler(TaskManager *taskManager)
+    {
+        this->taskManager = taskManager;
+        serialLog = false;
+    }
+
     void OnKeyDown(char c)
     {
+        // tab dumps the process table with the accounting counters
+        if (c == '\t')
+        {
+            taskManager->taskTable();
+            return;
+        }
+        // F1 writes the heap report to the serial port
+        if (c == '\x01')
+        {
+            heapReport();
+            printf("heap report sent to serial\n");
+            return;
+        }
+        // F2 shows how often and how long each interrupt vector ran
+        if (c == '\x02')
+        {
+            printf("\n");
+            InterruptManager::Report(printf);
+            return;
+        }
+        // F3 shows the network card's receive and send counters
+        if (c == '\x03')
+        {
+            printf("\n");
+            if (amd_am79c973::activeNetworkCard != 0)
+                amd_am79c973::activeNetworkCard->Report(printf);
+            return;
+        }
+        // F4 turns the per packet network log on and off
+        if (c == '\x04')
+        {
+            if (Log::GetLevel(LOG_NETWORK) == LOG_DEBUG)
+            {
+                Log::SetLevel(LOG_NETWORK, LOG_INFO);
+                printf("\nnetwork log: info\n");
+            }
+            else
+            {
+                Log::SetLevel(LOG_NETWORK, LOG_DEBUG);
+                printf("\nnetwork log: debug\n");
+            }
+            return;
+        }
+        // F5 moves the log between the screen and the serial port
+        if (c == '\x05')
+        {
+            serialLog = !serialLog;
+            Log::SetSink(serialLog ? printfSerial : printf);
+            if (serialLog)
+                printf("\nlog on serial\n");
+            else
+                printf("\nlog on screen\n");
+            return;
+        }
+
         char *foo = " ";
         foo[0] = c;
         printf(foo);
@@ -208,9 +337,7 @@ void collatzFunction(){
     }
     printf("### Collatz Finished ###\n");
     // interval
-    for (int a = 0;a < 1000000000;a++) { 
-        printf("");
-    }
+    usleep(2000000);
 }
 
 void longRunningProgramFunction(int duration) {
@@ -221,10 +348,7 @@ void longRunningProgramFunction(int duration) {
     printf("\n");
     printf("### Long Running Program Finished ###\n");
     // interval
-    for (int a = 0;a < 1000000000;a++) { 
-        printf("");
-    }
-    
+    usleep(2000000);
 }
 
 void taskCollatzAndLongProgram() {
@@ -274,7 +398,8 @@ void taskCollatzAndLongProgram() {
         longRunningProgramFunction(1000);
         exit();
     } else {
-        waitpid(0);
+        // reap every child
+        while(waitpid(-1) > 0);
     }
     exit();
     while(1);
@@ -295,6 +420,382 @@ void tasktask() {
     while (1);
 }
 
+#ifdef BATCHBENCHMARK
+void spinFor(uint32_t ticks) {
+    // CPU time, not wall time: waits for its own run counter
+    TaskStatistics stats;
+    do
+        getTaskStats(0, &stats);
+    while (stats.ticksRun < ticks);
+}
+
+// timer ticks from fork to exit of a workload shaped like
+// taskCollatzAndLongProgram, three short jobs forked before three long ones
+void runMixedWorkload(bool batch) {
+    const uint32_t work[] = {2, 2, 2, 8, 16, 32};
+    const int jobs = 6;
+
+    for (int i = 0; i < jobs; i++) {
+        if (batch) {
+            BatchParameters parameters = {work[i], 0, 0};
+            forkBatch(&parameters);
+        } else {
+            fork();
+        }
+        if (getCPid() == 0) {
+            spinFor(work[i]);
+            TaskStatistics stats;
+            getTaskStats(0, &stats);
+            exit(stats.ticksRun + stats.ticksWaiting);
+        }
+    }
+
+    uint32_t total = 0;
+    uint32_t worst = 0;
+    int32_t completion;
+    while (waitpid(-1, &completion) > 0) {
+        total += completion;
+        if ((uint32_t)completion > worst)
+            worst = completion;
+    }
+
+    if (batch)
+        printf("batch");
+    else
+        printf("round-robin");
+    printf(" mean: ");
+    printfHex32(total / jobs);
+    printf(" max: ");
+    printfHex32(worst);
+    printf(" ticks\n");
+}
+
+void benchmarkBatch() {
+    printf("### Batch Scheduling Benchmark ###\n");
+    runMixedWorkload(false);
+    runMixedWorkload(true);
+    exit();
+    while(1);
+}
+#endif
+
+#ifdef SYSCALLBENCHMARK
+// average cycles of a getPid round trip, through the interrupt gate
+// and through sysenter
+void benchmarkSyscalls() {
+    const int iterations = 10000;
+    printf("### Syscall Benchmark ###\n");
+
+    uint64_t start = ReadTimeStampCounter();
+    for (int i = 0; i < iterations; i++) {
+        int pid;
+        asm volatile("int $0x80" : "=c"(pid) : "a"(SYSCALL_GETPID) : "memory");
+    }
+    uint64_t cycles = ReadTimeStampCounter() - start;
+    printf("int 0x80: ");
+    printfHex32((uint32_t)cycles / iterations);
+    printf(" cycles\n");
+
+    if (!SyscallHandler::FastEntry())
+        printf("sysenter: not supported\n");
+    else {
+        start = ReadTimeStampCounter();
+        for (int i = 0; i < iterations; i++)
+            getPid();
+        cycles = ReadTimeStampCounter() - start;
+        printf("sysenter: ");
+        printfHex32((uint32_t)cycles / iterations);
+        printf(" cycles\n");
+    }
+
+    // of that, the time inside the handler
+    SyscallStatistics stats;
+    getSyscallStats(SYSCALL_GETPID, &stats);
+    printf("getPid handler: ");
+    printfHex32((uint32_t)stats.totalCycles / stats.count);
+    printf(" cycles, max ");
+    printfHex32(stats.maxCycles);
+    printf("\n");
+    exit();
+    while(1);
+}
+#endif
+
+#ifdef NETWORKBENCHMARK
+// full sized broadcast frames straight into the driver, as fast as it
+// takes them: every one has to come back as sent
+void benchmarkNetwork() {
+    const uint32_t frames = 10000;
+    const uint32_t size = sizeof(EtherFrameHeader) + PACKET_MTU;
+    printf("### Network Send Benchmark ###\n");
+
+    amd_am79c973* nic = amd_am79c973::activeNetworkCard;
+    if (nic == 0) {
+        printf("no network card\n");
+        exit();
+        while(1);
+    }
+
+    uint32_t retries = 0;
+    uint64_t start = TimerManager::Now();
+    for (uint32_t i = 0; i < frames; i++) {
+        // from the packet cache, with the header in its headroom
+        // the way EtherFrameProvider::Send puts it there
+        PacketBuffer* packet = PacketBuffer::Allocate(PACKET_MTU);
+        if (packet == 0) {
+            i--;
+            continue;
+        }
+        EtherFrameHeader* frame = (EtherFrameHeader*)packet->Push(sizeof(EtherFrameHeader));
+        frame->dstMAC_BE = 0xFFFFFFFFFFFF;
+        frame->srcMAC_BE = nic->GetMACAddress();
+        frame->etherType_BE = 0xB588; // local experimental
+        // the queue is full: wait for the card instead of dropping it
+        int32_t result;
+        while ((result = nic->Send(packet)) == -EAGAIN)
+            retries++;
+        if (result < 0) {
+            packet->Free();
+            printf("send failed\n");
+            exit();
+            while(1);
+        }
+    }
+
+    NetworkSendStatistics stats;
+    do
+        nic->GetSendStatistics(&stats);
+    while (stats.pending != 0);
+    uint32_t microseconds = (uint32_t)(TimerManager::Now() - start);
+
+    printf("frames: ");
+    printfHex32(frames);
+    printf(" sent: ");
+    printfHex32(stats.sent);
+    printf(" errors: ");
+    printfHex32(stats.errors);
+    printf("\nqueued: ");
+    printfHex32(stats.queued);
+    printf(" peak queue: ");
+    printfHex32(stats.peakQueue);
+    printf(" retries: ");
+    printfHex32(retries);
+    printf("\nbytes per ms: ");
+    printfHex32(frames * size / (microseconds / 1000 + 1));
+    printf("\n");
+    exit();
+    while(1);
+}
+#endif
+
+#ifdef SCHEDULERBENCHMARK
+void benchmarkIdleTask() {
+    while(1);
+}
+
+// average cycles spent in one timer tick's Schedule() call, the tasks
+// are never really entered, only the run queue bookkeeping is measured
+void benchmarkScheduler(GlobalDescriptorTable *gdt) {
+    const int counts[] = {1, 16, 255};
+    const int iterations = 10000;
+    Task task(gdt, benchmarkIdleTask);
+
+    printf("### Scheduler Benchmark ###\n");
+    for (int c = 0; c < 3; c++) {
+        TaskManager *taskManager = new TaskManager();
+        for (int i = 0; i < counts[c]; i++)
+            taskManager->AddTask(&task);
+
+        CPUState idle;
+        CPUState *cpustate = taskManager->Schedule(&idle);
+        uint64_t start = ReadTimeStampCounter();
+        for (int i = 0; i < iterations; i++)
+            cpustate = taskManager->Schedule(cpustate);
+        uint32_t cycles = (uint32_t)(ReadTimeStampCounter() - start) / iterations;
+
+        printf("tasks: ");
+        printfHex32(counts[c]);
+        printf(" cycles/tick: ");
+        printfHex32(cycles);
+        printf("\n");
+
+        delete taskManager;
+    }
+
+    // the last SwitchTo pointed at one of the deleted address spaces
+    PagingManager::activePagingManager->Switch(0);
+}
+#endif
+
+#ifdef FORKBENCHMARK
+// cycles to fork an address space with n pages mapped: copy on write
+// (page tables only), then writing every page once in the child, against
+// copying all pages up front like fork did before
+void benchmarkFork() {
+    const uint32_t counts[] = {1, 16, 256, 1023};
+    const int iterations = 8;
+    uint8_t* source = (uint8_t*)0x100000; // some kernel page to copy from
+
+    printf("### Fork Benchmark ###\n");
+    for (int c = 0; c < 4; c++) {
+        uint32_t size = counts[c] * PAGE_SIZE;
+        AddressSpace *parent = new AddressSpace();
+        parent->Map(TASK_WINDOW_BASE, size);
+
+        uint32_t cloneCycles = 0;
+        uint32_t touchCycles = 0;
+        uint32_t copyCycles = 0;
+        for (int i = 0; i < iterations; i++) {
+            uint64_t start = ReadTimeStampCounter();
+            AddressSpace *child = parent->Clone();
+            cloneCycles += (uint32_t)(ReadTimeStampCounter() - start);
+
+            start = ReadTimeStampCounter();
+            for (uint32_t page = 0; page < size; page += PAGE_SIZE)
+                child->Write(TASK_WINDOW_BASE + page, &page, sizeof(page));
+            touchCycles += (uint32_t)(ReadTimeStampCounter() - start);
+            delete child;
+
+            start = ReadTimeStampCounter();
+            AddressSpace *copy = new AddressSpace();
+            copy->Map(TASK_WINDOW_BASE, size);
+            for (uint32_t page = 0; page < size; page += PAGE_SIZE)
+                copy->Write(TASK_WINDOW_BASE + page, source, PAGE_SIZE);
+            copyCycles += (uint32_t)(ReadTimeStampCounter() - start);
+            delete copy;
+        }
+
+        printf("pages: ");
+        printfHex32(counts[c]);
+        printf(" cow: ");
+        printfHex32(cloneCycles / iterations);
+        printf(" +touch: ");
+        printfHex32(touchCycles / iterations);
+        printf(" eager: ");
+        printfHex32(copyCycles / iterations);
+        printf("\n");
+
+        delete parent;
+    }
+}
+#endif
+
+#ifdef MALLOCBENCHMARK
+// the first fit allocator MemoryManager used before, kept for comparison
+class FirstFitHeap
+{
+    MemoryChunk* first;
+public:
+    FirstFitHeap(size_t start, size_t size) {
+        first = (MemoryChunk*)start;
+        first->allocated = false;
+        first->prev = 0;
+        first->next = 0;
+        first->size = size - sizeof(MemoryChunk);
+    }
+    void* malloc(size_t size) {
+        MemoryChunk *result = 0;
+        for (MemoryChunk* chunk = first; chunk != 0 && result == 0; chunk = chunk->next)
+            if (chunk->size > size && !chunk->allocated)
+                result = chunk;
+        if (result == 0)
+            return 0;
+        if (result->size >= size + sizeof(MemoryChunk) + 1) {
+            MemoryChunk* temp = (MemoryChunk*)((size_t)result + sizeof(MemoryChunk) + size);
+            temp->allocated = false;
+            temp->size = result->size - size - sizeof(MemoryChunk);
+            temp->prev = result;
+            temp->next = result->next;
+            if (temp->next != 0)
+                temp->next->prev = temp;
+            result->size = size;
+            result->next = temp;
+        }
+        result->allocated = true;
+        return (void*)((size_t)result + sizeof(MemoryChunk));
+    }
+    void free(void* ptr) {
+        MemoryChunk* chunk = (MemoryChunk*)((size_t)ptr - sizeof(MemoryChunk));
+        chunk->allocated = false;
+        if (chunk->prev != 0 && !chunk->prev->allocated) {
+            chunk->prev->next = chunk->next;
+            chunk->prev->size += chunk->size + sizeof(MemoryChunk);
+            if (chunk->next != 0)
+                chunk->next->prev = chunk->prev;
+            chunk = chunk->prev;
+        }
+        if (chunk->next != 0 && !chunk->next->allocated) {
+            chunk->size += chunk->next->size + sizeof(MemoryChunk);
+            chunk->next = chunk->next->next;
+            if (chunk->next != 0)
+                chunk->next->prev = chunk;
+        }
+    }
+};
+
+// packet like workload: frames, ip/tcp buffers and small headers with
+// a window of live buffers freed in random order. Prints cycles per
+// malloc+free pair and how far into the arena the heap had to reach.
+template<class Heap>
+void runMallocBenchmark(char* name, Heap* heap, size_t arena) {
+    const uint32_t sizes[] = {1518, 1518, 576, 64, 20, 40, 8, 1024};
+    const int live = 128;
+    const int iterations = 20000;
+    void* buffers[live];
+    uint32_t seed = 1;
+    size_t highWater = 0;
+
+    for (int i = 0; i < live; i++)
+        buffers[i] = 0;
+
+    uint64_t start = ReadTimeStampCounter();
+    for (int i = 0; i < iterations; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) % live;
+        uint32_t size = sizes[(seed >> 20) % 8];
+
+        if (buffers[slot] != 0)
+            heap->free(buffers[slot]);
+        buffers[slot] = heap->malloc(size);
+
+        size_t end = (size_t)buffers[slot] + size - arena;
+        if (buffers[slot] != 0 && end > highWater)
+            highWater = end;
+    }
+    uint32_t cycles = (uint32_t)(ReadTimeStampCounter() - start) / iterations;
+
+    for (int i = 0; i < live; i++)
+        if (buffers[i] != 0)
+            heap->free(buffers[i]);
+
+    printf(name);
+    printf(" cycles/op: ");
+    printfHex32(cycles);
+    printf(" span: ");
+    printfHex32(highWater);
+    printf("\n");
+}
+
+void benchmarkMalloc() {
+    const size_t size = 1024 * 1024;
+    MemoryManager* active = MemoryManager::activeMemoryManager;
+    size_t arena = (size_t)active->malloc(size);
+
+    printf("### Malloc Benchmark ###\n");
+
+    FirstFitHeap firstFit(arena, size);
+    runMallocBenchmark("first fit ", &firstFit, arena);
+
+    // the constructor makes itself the active heap
+    MemoryManager* segregated = new MemoryManager(arena, size);
+    MemoryManager::activeMemoryManager = active;
+    runMallocBenchmark("segregated", segregated, arena);
+    delete segregated;
+
+    active->free((void*)arena);
+}
+#endif
+
 typedef void (*constructor)();
 extern "C" constructor start_ctors;
 extern "C" constructor end_ctors;
@@ -310,9 +811,15 @@ extern "C" void kernelMain(const void *multiboot_structure, uint32_t /*multiboot
 
     GlobalDescriptorTable gdt;
 
-    uint32_t *memupper = (uint32_t *)(((size_t)multiboot_structure) + 8);
-    size_t heap = 10 * 1024 * 1024;
-    MemoryManager memoryManager(heap, (*memupper) * 1024 - heap - 10 * 1024);
+    // all usable RAM from the multiboot memory map, in buddy blocks
+    FrameAllocator frameAllocator(multiboot_structure);
+    printf("memory: 0x");
+    printfHex32(frameAllocator.TotalFrames() * FRAME_SIZE);
+    printf(" bytes usable\n");
+
+    // the heap starts with one block and takes more frames when it is full
+    size_t heap = (size_t)frameAllocator.Allocate(HEAP_GROW_ORDER);
+    MemoryManager memoryManager(heap, FRAME_SIZE << HEAP_GROW_ORDER);
 
     /*printf("heap: 0x");
     printfHex((heap >> 24) & 0xFF);
@@ -328,20 +835,56 @@ extern "C" void kernelMain(const void *multiboot_structure, uint32_t /*multiboot
     printfHex(((size_t)allocated) & 0xFF);
     printf("\n");*/
 
+    // identity mapped, the frames for the task windows come from frameAllocator
+    PagingManager paging(&gdt, frameAllocator.MemoryEnd());
+
+    // finds the other processors, they are started once the drivers are
+    CPUManager cpuManager;
+
+    // calibrated clock and timer wheel, one shot interrupts come later
+    TimerManager timerManager;
+
+#ifdef MALLOCBENCHMARK
+    benchmarkMalloc();
+#endif
+
+#ifdef FORKBENCHMARK
+    benchmarkFork();
+#endif
+
+#ifdef SCHEDULERBENCHMARK
+    benchmarkScheduler(&gdt);
+#endif
+
+    // what open() finds, tasks start with the console on 0, 1 and 2
+    ConsoleFile console;
+    NullFile null;
+    DeviceFiles::Register("/dev/console", &console);
+    DeviceFiles::Register("/dev/null", &null);
+
     TaskManager taskManager;
     //Task task1(&gdt, taskA);
     //Task task2(&gdt, taskB);
     //taskManager.AddTask(&task1);
     //taskManager.AddTask(&task2);
+#ifdef BATCHBENCHMARK
+    Task taskMain(&gdt, benchmarkBatch);
+#elif defined(SYSCALLBENCHMARK)
+    Task taskMain(&gdt, benchmarkSyscalls);
+#elif defined(NETWORKBENCHMARK)
+    Task taskMain(&gdt, benchmarkNetwork);
+#else
     Task taskMain(&gdt, taskCollatzAndLongProgram);
+#endif
     taskManager.AddTask(&taskMain);
 
     InterruptManager interrupts(0x20, &gdt, &taskManager);
     SyscallHandler syscalls(&interrupts, 0x80);
+    syscalls.EnableFastEntryOnThisCPU(&gdt);
 
     DriverManager drvManager;
 
-    PrintfKeyboardEventHandler kbhandler;
+    PrintfKeyboardEventHandler kbhandler(&taskManager);
     KeyboardDriver keyboard(&interrupts, &kbhandler);
 
     drvManager.AddDriver(&keyboard);
@@ -357,8 +900,11 @@ extern "C" void kernelMain(const void *multiboot_structure, uint32_t /*multiboot
     drvManager.ActivateAll();
 
     interrupts.Activate();
+    cpuManager.Start(&interrupts);
 
+    // the boot processor's idle loop, asleep until the next interrupt
     while (1)
     {
+        asm volatile("hlt");
     }
 }
@@ -0,0 +1,118 @@
+
+#include <log.h>
+
+using namespace myos;
+using namespace myos::common;
+
+void printf(char* str);
+
+
+char Log::buffer[LOG_BUFFER_SIZE];
+uint32_t Log::head = 0;
+uint32_t Log::tail = 0;
+uint32_t Log::dropped = 0;
+Spinlock Log::lock;
+Timer Log::flushTimer(&Log::FlushTimer, 0);
+void (*Log::sink)(char*) = printf;
+uint8_t Log::levels[NUM_LOG_SUBSYSTEMS] = { LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO };
+
+
+void Log::SetLevel(LogSubsystem subsystem, LogLevel level)
+{
+    levels[subsystem] = level;
+}
+
+LogLevel Log::GetLevel(LogSubsystem subsystem)
+{
+    return (LogLevel)levels[subsystem];
+}
+
+void Log::SetSink(void (*sink)(char*))
+{
+    Flush();
+    Log::sink = sink;
+}
+
+void Log::Append(char* text)
+{
+    SpinlockGuard guard(&lock);
+    for(; *text != '\0'; text++)
+    {
+        if(tail - head == LOG_BUFFER_SIZE)
+        {
+            dropped++;
+            continue;
+        }
+        buffer[tail++ % LOG_BUFFER_SIZE] = *text;
+    }
+}
+
+void Log::ScheduleFlush(LogLevel level)
+{
+    TimerManager* timers = TimerManager::activeTimerManager;
+    if(timers == 0 || level == LOG_ERROR)
+        Flush();
+    else if(!flushTimer.Pending())
+        timers->Add(&flushTimer, LOG_FLUSH_DELAY);
+}
+
+void Log::FlushTimer(void* data)
+{
+    Flush();
+}
+
+void Log::Write(LogSubsystem subsystem, LogLevel level, char* text)
+{
+    if(!LOG_ENABLED(subsystem, level))
+        return;
+    Append(text);
+    ScheduleFlush(level);
+}
+
+void Log::WriteHex(LogSubsystem subsystem, LogLevel level, uint8_t* data, uint32_t size)
+{
+    if(!LOG_ENABLED(subsystem, level))
+        return;
+
+    char* hex = "0123456789ABCDEF";
+    char text[3 * 16 + 1];
+    while(size > 0)
+    {
+        uint32_t count = (size < 16) ? size : 16;
+        for(uint32_t i = 0; i < count; i++)
+        {
+            text[3 * i] = hex[(data[i] >> 4) & 0xF];
+            text[3 * i + 1] = hex[data[i] & 0xF];
+            text[3 * i + 2] = ' ';
+        }
+        text[3 * count] = '\0';
+        Append(text);
+        data += count;
+        size -= count;
+    }
+    ScheduleFlush(level);
+}
+
+void Log::Flush()
+{
+    // a chunk at a time, the sink may be slow and must not hold up Append
+    char text[65];
+    while(true)
+    {
+        uint32_t count = 0;
+        uint32_t lost;
+        lock.Lock();
+        while(count < 64 && head != tail)
+            text[count++] = buffer[head++ % LOG_BUFFER_SIZE];
+        lost = dropped;
+        dropped = 0;
+        lock.Unlock();
+
+        if(lost != 0)
+            sink("\n[log buffer overflowed]\n");
+        if(count == 0)
+            break;
+        text[count] = '\0';
+        sink(text);
+    }
+}
@@ -5,25 +5,87 @@ using namespace myos;
 using namespace myos::common;
 
 
+void printfHex32(void (*print)(char*), uint32_t);
+
+
 MemoryManager* MemoryManager::activeMemoryManager = 0;
+
+
+// interrupt handlers (the NIC) allocate too, so the task caches are only
+// touched with interrupts off; restores the caller's flag afterwards
+static inline uint32_t DisableInterrupts()
+{
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void RestoreInterrupts(uint32_t flags)
+{
+    asm volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+
+ThreadCache::ThreadCache()
+{
+    for(uint32_t i = 0; i < NUM_CACHED_CLASSES; i++)
+        rounds[i] = 0;
+}
         
 MemoryManager::MemoryManager(size_t start, size_t size)
 {
     activeMemoryManager = this;
     
-    if(size < sizeof(MemoryChunk))
-    {
-        first = 0;
-    }
-    else
-    {
-        first = (MemoryChunk*)start;
-        
-        first -> allocated = false;
-        first -> prev = 0;
-        first -> next = 0;
-        first -> size = size - sizeof(MemoryChunk);
-    }
+    for(uint32_t i = 0; i < NUM_SIZE_CLASSES; i++)
+        freeLists[i] = 0;
+    freeListBitmap = 0;
+    
+    first = 0;
+#ifdef HEAPSTATISTICS
+    stats = {};
+    for(uint32_t i = 0; i < MAX_HEAP_CALL_SITES; i++)
+        callSites[i] = {0, 0, 0, 0};
+#endif
+    AddRegion(start, size);
+}
+
+void MemoryManager::AddRegion(size_t start, size_t size)
+{
+    if(size < sizeof(MemoryChunk) + MIN_CHUNK_SIZE)
+        return;
+    
+    // prev and next stay 0, so free() never coalesces across regions
+    MemoryChunk* chunk = (MemoryChunk*)start;
+    chunk -> allocated = false;
+    chunk -> prev = 0;
+    chunk -> next = 0;
+    chunk -> size = size - sizeof(MemoryChunk);
+    InsertFree(chunk);
+    
+    if(first == 0)
+        first = chunk;
+#ifdef HEAPSTATISTICS
+    if(stats.regions < MAX_HEAP_REGIONS)
+        regions[stats.regions] = chunk;
+    stats.regions++;
+#endif
+}
+
+bool MemoryManager::Grow(size_t size)
+{
+    FrameAllocator* frames = FrameAllocator::activeFrameAllocator;
+    if(frames == 0)
+        return false;
+    
+    uint8_t order = FrameAllocator::Order(size + sizeof(MemoryChunk));
+    if(order < HEAP_GROW_ORDER)
+        order = HEAP_GROW_ORDER;
+    
+    void* block = frames->Allocate(order);
+    if(block == 0)
+        return false;
+    AddRegion((size_t)block, FRAME_SIZE << order);
+    return true;
 }
 
 MemoryManager::~MemoryManager()
@@ -31,19 +93,201 @@ MemoryManager::~MemoryManager()
     if(activeMemoryManager == this)
         activeMemoryManager = 0;
 }
+
+uint32_t MemoryManager::SizeClass(size_t size)
+{
+    // floor(log2(size))
+    return 31 - __builtin_clz(size);
+}
+
+FreeChunkLinks* MemoryManager::Links(MemoryChunk* chunk)
+{
+    return (FreeChunkLinks*)((size_t)chunk + sizeof(MemoryChunk));
+}
+
+void MemoryManager::InsertFree(MemoryChunk* chunk)
+{
+    uint32_t sizeClass = SizeClass(chunk->size);
+    FreeChunkLinks* links = Links(chunk);
+    
+    links->prevFree = 0;
+    links->nextFree = freeLists[sizeClass];
+    if(freeLists[sizeClass] != 0)
+        Links(freeLists[sizeClass])->prevFree = chunk;
+    freeLists[sizeClass] = chunk;
+    freeListBitmap |= (1u << sizeClass);
+}
+
+void MemoryManager::RemoveFree(MemoryChunk* chunk)
+{
+    uint32_t sizeClass = SizeClass(chunk->size);
+    FreeChunkLinks* links = Links(chunk);
+    
+    if(links->prevFree != 0)
+        Links(links->prevFree)->nextFree = links->nextFree;
+    else
+        freeLists[sizeClass] = links->nextFree;
+    if(links->nextFree != 0)
+        Links(links->nextFree)->prevFree = links->prevFree;
+    
+    if(freeLists[sizeClass] == 0)
+        freeListBitmap &= ~(1u << sizeClass);
+}
         
 void* MemoryManager::malloc(size_t size)
 {
+    return malloc(size, __builtin_return_address(0));
+}
+
+uint32_t MemoryManager::CachedClass(size_t size)
+{
+    if(size <= MIN_CHUNK_SIZE)
+        return 0;
+    if(size > MAX_CACHED_SIZE)
+        return NUM_CACHED_CLASSES;
+    // ceil(log2(size)) - 3
+    return 32 - __builtin_clz(size - 1) - 3;
+}
+
+void MemoryManager::SetCache(ThreadCache* cache)
+{
+    CPU* cpu = CPUManager::Current();
+    cpu->heapCache = (cache != 0) ? cache : &bootCaches[cpu->index];
+}
+
+ThreadCache* MemoryManager::LocalCache()
+{
+    CPU* cpu = CPUManager::Current();
+    return (cpu->heapCache != 0) ? cpu->heapCache : &bootCaches[cpu->index];
+}
+
+void* MemoryManager::malloc(size_t size, void* caller)
+{
+#ifndef HEAPSTATISTICS
+    uint32_t sizeClass = CachedClass(size);
+    if(sizeClass < NUM_CACHED_CLASSES)
+    {
+        uint32_t flags = DisableInterrupts();
+        ThreadCache* cache = LocalCache();
+        
+        // empty magazine: one trip to the global lists for half a magazine
+        if(cache->rounds[sizeClass] == 0)
+        {
+            lock.Lock();
+            for(uint32_t i = 0; i < MAGAZINE_SIZE / 2; i++)
+            {
+                void* chunk = Allocate(MIN_CHUNK_SIZE << sizeClass, caller);
+                if(chunk == 0)
+                    break;
+                cache->magazines[sizeClass][cache->rounds[sizeClass]++] = chunk;
+            }
+            lock.Unlock();
+        }
+        
+        void* result = 0;
+        if(cache->rounds[sizeClass] != 0)
+            result = cache->magazines[sizeClass][--cache->rounds[sizeClass]];
+        RestoreInterrupts(flags);
+        return result;
+    }
+#endif
+    
+    lock.Lock();
+    void* result = Allocate(size, caller);
+    lock.Unlock();
+    return result;
+}
+
+void MemoryManager::free(void* ptr)
+{
+    if(ptr == 0)
+        return;
+    
+#ifndef HEAPSTATISTICS
+    // only chunks of exactly a cached size, bigger ones may
+    // have been left unsplit by Allocate
+    size_t size = ((MemoryChunk*)((size_t)ptr - sizeof(MemoryChunk)))->size;
+    uint32_t sizeClass = CachedClass(size);
+    if(sizeClass < NUM_CACHED_CLASSES && size == (MIN_CHUNK_SIZE << sizeClass))
+    {
+        uint32_t flags = DisableInterrupts();
+        ThreadCache* cache = LocalCache();
+        
+        // full magazine: the older half goes back to the global lists
+        if(cache->rounds[sizeClass] == MAGAZINE_SIZE)
+        {
+            lock.Lock();
+            for(uint32_t i = 0; i < MAGAZINE_SIZE / 2; i++)
+                Release(cache->magazines[sizeClass][i]);
+            lock.Unlock();
+            for(uint32_t i = MAGAZINE_SIZE / 2; i < MAGAZINE_SIZE; i++)
+                cache->magazines[sizeClass][i - MAGAZINE_SIZE / 2] = cache->magazines[sizeClass][i];
+            cache->rounds[sizeClass] = MAGAZINE_SIZE / 2;
+        }
+        
+        cache->magazines[sizeClass][cache->rounds[sizeClass]++] = ptr;
+        RestoreInterrupts(flags);
+        return;
+    }
+#endif
+    
+    lock.Lock();
+    Release(ptr);
+    lock.Unlock();
+}
+
+void MemoryManager::Drain(ThreadCache* cache)
+{
+    lock.Lock();
+    for(uint32_t sizeClass = 0; sizeClass < NUM_CACHED_CLASSES; sizeClass++)
+    {
+        while(cache->rounds[sizeClass] != 0)
+            Release(cache->magazines[sizeClass][--cache->rounds[sizeClass]]);
+    }
+    lock.Unlock();
+}
+
+void* MemoryManager::Allocate(size_t size, void* caller)
+{
+    if(size > 0x80000000)
+        return 0;
+    
+    // room for the free list links once it is freed again
+    size = (size + MIN_CHUNK_SIZE - 1) & ~(MIN_CHUNK_SIZE - 1);
+    if(size == 0)
+        size = MIN_CHUNK_SIZE;
+    
     MemoryChunk *result = 0;
     
-    for(MemoryChunk* chunk = first; chunk != 0 && result == 0; chunk = chunk->next)
-        if(chunk->size > size && !chunk->allocated)
-            result = chunk;
+    // every chunk on a list of this class or above is big enough,
+    // take one from the smallest such list
+    uint32_t sizeClass = SizeClass(size);
+    uint32_t fitting = ((size & (size - 1)) == 0) ? sizeClass : sizeClass + 1;
+    uint32_t candidates = (fitting < NUM_SIZE_CLASSES) ? freeListBitmap & ~((1u << fitting) - 1) : 0;
+    
+    if(candidates != 0)
+        result = freeLists[__builtin_ctz(candidates)];
+    else
+        // nothing bigger is left (large blocks end up here):
+        // look for one that fits on the request's own list
+        for(MemoryChunk* chunk = freeLists[sizeClass]; chunk != 0 && result == 0; chunk = Links(chunk)->nextFree)
+            if(chunk->size >= size)
+                result = chunk;
         
+    // out of heap: get more frames and try once more
     if(result == 0)
+    {
+        if(Grow(size))
+            return Allocate(size, caller);
+#ifdef HEAPSTATISTICS
+        stats.failures++;
+#endif
         return 0;
+    }
     
-    if(result->size >= size + sizeof(MemoryChunk) + 1)
+    RemoveFree(result);
+    
+    if(result->size >= size + sizeof(MemoryChunk) + MIN_CHUNK_SIZE)
     {
         MemoryChunk* temp = (MemoryChunk*)((size_t)result + sizeof(MemoryChunk) + size);
         
@@ -56,20 +300,51 @@ void* MemoryManager::malloc(size_t size)
         
         result->size = size;
         result->next = temp;
+        InsertFree(temp);
     }
     
     result->allocated = true;
+    
+#ifdef HEAPSTATISTICS
+    result->caller = caller;
+    result->sequence = ++stats.allocations;
+    stats.bytesInUse += result->size;
+    if(stats.bytesInUse > stats.peakBytesInUse)
+        stats.peakBytesInUse = stats.bytesInUse;
+    
+    HeapCallSite* site = CallSite(caller);
+    if(site != 0)
+    {
+        site->allocations++;
+        site->liveAllocations++;
+        site->liveBytes += result->size;
+    }
+#endif
+    
     return (void*)(((size_t)result) + sizeof(MemoryChunk));
 }
 
-void MemoryManager::free(void* ptr)
+void MemoryManager::Release(void* ptr)
 {
     MemoryChunk* chunk = (MemoryChunk*)((size_t)ptr - sizeof(MemoryChunk));
     
     chunk -> allocated = false;
     
+#ifdef HEAPSTATISTICS
+    stats.frees++;
+    stats.bytesInUse -= chunk->size;
+    
+    HeapCallSite* site = CallSite(chunk->caller);
+    if(site != 0)
+    {
+        site->liveAllocations--;
+        site->liveBytes -= chunk->size;
+    }
+#endif
+    
     if(chunk->prev != 0 && !chunk->prev->allocated)
     {
+        RemoveFree(chunk->prev);
         chunk->prev->next = chunk->next;
         chunk->prev->size += chunk->size + sizeof(MemoryChunk);
         if(chunk->next != 0)
@@ -80,12 +355,130 @@ void MemoryManager::free(void* ptr)
     
     if(chunk->next != 0 && !chunk->next->allocated)
     {
+        RemoveFree(chunk->next);
         chunk->size += chunk->next->size + sizeof(MemoryChunk);
         chunk->next = chunk->next->next;
         if(chunk->next != 0)
             chunk->next->prev = chunk;
     }
     
+    InsertFree(chunk);
+}
+
+
+#ifdef HEAPSTATISTICS
+HeapCallSite* MemoryManager::CallSite(void* caller)
+{
+    // the table is small, and only there when instrumenting
+    for(uint32_t i = 0; i < MAX_HEAP_CALL_SITES; i++)
+    {
+        if(callSites[i].caller == caller)
+            return &callSites[i];
+        if(callSites[i].caller == 0)
+        {
+            callSites[i].caller = caller;
+            return &callSites[i];
+        }
+    }
+    return 0;
+}
+#endif
+
+bool MemoryManager::GetStatistics(HeapStatistics* stats)
+{
+#ifdef HEAPSTATISTICS
+    lock.Lock();
+    *stats = this->stats;
+    
+    // the histogram is taken from the free lists right now
+    for(uint32_t i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        stats->freeChunks[i] = 0;
+        for(MemoryChunk* chunk = freeLists[i]; chunk != 0; chunk = Links(chunk)->nextFree)
+            stats->freeChunks[i]++;
+    }
+    lock.Unlock();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void MemoryManager::Report(void (*print)(char*))
+{
+    HeapStatistics stats;
+    if(!GetStatistics(&stats))
+    {
+        print("heap statistics not built in (HEAPSTATISTICS)\n");
+        return;
+    }
+    
+    print("heap in use: ");
+    printfHex32(print, stats.bytesInUse);
+    print(" peak: ");
+    printfHex32(print, stats.peakBytesInUse);
+    print(" regions: ");
+    printfHex32(print, stats.regions);
+    print("\nmallocs: ");
+    printfHex32(print, stats.allocations);
+    print(" frees: ");
+    printfHex32(print, stats.frees);
+    print(" failed: ");
+    printfHex32(print, stats.failures);
+    print("\n");
+    
+    print("free chunks by size (2^n bytes):\n");
+    for(uint32_t i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        if(stats.freeChunks[i] == 0)
+            continue;
+        print("  n=");
+        printfHex32(print, i);
+        print(" ");
+        printfHex32(print, stats.freeChunks[i]);
+        print("\n");
+    }
+    
+#ifdef HEAPSTATISTICS
+    print("call site  mallocs  live     bytes\n");
+    for(uint32_t i = 0; i < MAX_HEAP_CALL_SITES && callSites[i].caller != 0; i++)
+    {
+        printfHex32(print, (uint32_t)callSites[i].caller);
+        print(" ");
+        printfHex32(print, callSites[i].allocations);
+        print(" ");
+        printfHex32(print, callSites[i].liveAllocations);
+        print(" ");
+        printfHex32(print, callSites[i].liveBytes);
+        print("\n");
+    }
+#endif
+}
+
+void MemoryManager::DumpLeaks(void (*print)(char*), uint32_t since)
+{
+#ifdef HEAPSTATISTICS
+    print("still allocated: address  size     caller   number\n");
+    SpinlockGuard guard(&lock);
+    uint32_t numRegions = (stats.regions < MAX_HEAP_REGIONS) ? stats.regions : MAX_HEAP_REGIONS;
+    for(uint32_t r = 0; r < numRegions; r++)
+        for(MemoryChunk* chunk = regions[r]; chunk != 0; chunk = chunk->next)
+        {
+            if(!chunk->allocated || chunk->sequence <= since)
+                continue;
+            print("                 ");
+            printfHex32(print, (uint32_t)chunk + sizeof(MemoryChunk));
+            print(" ");
+            printfHex32(print, chunk->size);
+            print(" ");
+            printfHex32(print, (uint32_t)chunk->caller);
+            print(" ");
+            printfHex32(print, chunk->sequence);
+            print("\n");
+        }
+#else
+    print("heap statistics not built in (HEAPSTATISTICS)\n");
+#endif
 }
 
 
@@ -95,14 +488,14 @@ void* operator new(unsigned size)
 {
     if(myos::MemoryManager::activeMemoryManager == 0)
         return 0;
-    return myos::MemoryManager::activeMemoryManager->malloc(size);
+    return myos::MemoryManager::activeMemoryManager->malloc(size, __builtin_return_address(0));
 }
 
 void* operator new[](unsigned size)
 {
     if(myos::MemoryManager::activeMemoryManager == 0)
         return 0;
-    return myos::MemoryManager::activeMemoryManager->malloc(size);
+    return myos::MemoryManager::activeMemoryManager->malloc(size, __builtin_return_address(0));
 }
 
 void* operator new(unsigned size, void* ptr)
@@ -122,6 +515,18 @@ void operator delete(void* ptr)
 }
 
 void operator delete[](void* ptr)
+{
+    if(myos::MemoryManager::activeMemoryManager != 0)
+        myos::MemoryManager::activeMemoryManager->free(ptr);
+}
+
+void operator delete(void* ptr, unsigned size)
+{
+    if(myos::MemoryManager::activeMemoryManager != 0)
+        myos::MemoryManager::activeMemoryManager->free(ptr);
+}
+
+void operator delete[](void* ptr, unsigned size)
 {
     if(myos::MemoryManager::activeMemoryManager != 0)
         myos::MemoryManager::activeMemoryManager->free(ptr);
@@ -7,17 +7,37 @@ using namespace myos::common;
 myos::common::uint32_t myos::Task::pIdCounter = 0;
 
 void printfHex(uint8_t key);
+void printfHex16(uint16_t key);
+void printfHex32(uint32_t key);
 void printf(char*);
 
 // STATE NUMBERS
-// finished 0
+// finished 0 (free slot)
 // waiting  1
 // ready    2
 // running  3
+// zombie   4 (exited, not reaped yet)
 
-Task::Task(GlobalDescriptorTable *gdt, void entrypoint())
+WaitQueue::WaitQueue()
 {
-    cpustate = (CPUState*)(stack + 4096 - sizeof(CPUState));
+    head = 0;
+    tail = 0;
+}
+
+WaitQueue::~WaitQueue()
+{
+}
+
+bool WaitQueue::IsEmpty()
+{
+    return head == 0;
+}
+
+Task::Task(GlobalDescriptorTable *gdt, void entrypoint(), common::uint32_t stackSize)
+    : sleepTimer(&TaskManager::SleepExpired, this)
+{
+    this->stackSize = stackSize;
+    cpustate = &initialState;
     
     cpustate -> eax = 0;
     cpustate -> ebx = 0;
@@ -50,6 +70,7 @@ Task::~Task()
 }
 
 Task::Task()
+    : sleepTimer(&TaskManager::SleepExpired, this)
 {
 }
 
@@ -59,183 +80,856 @@ common::uint32_t Task::getId()
 }
 
 
+TaskManager* TaskManager::activeTaskManager = 0;
+
 TaskManager::TaskManager()
 {
+    activeTaskManager = this;
     numTasks = 0;
-    currentTask = -1; 
+    // hand out the low slots first
+    numFreeSlots = 0;
+    for(int i = MAX_TASKS - 1; i >= 0; i--)
+        freeSlots[numFreeSlots++] = i;
+    for(int i = 0; i < MAX_TASKS; i++)
+        pidHash[i] = -1;
+    for(common::uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        RunQueue* queue = &runQueues[cpu];
+        for(int i = 0; i < NUM_PRIORITY_LEVELS; i++)
+        {
+            queue->readyHead[i] = 0;
+            queue->readyTail[i] = 0;
+        }
+        queue->readyBitmap = 0;
+        queue->batchHead = 0;
+        queue->throttledHead = 0;
+        queue->currentTask = -1;
+        queue->idleState = 0;
+        queue->deadAddressSpace = 0;
+        queue->deadTask = -1;
+        queue->load = 0;
+    }
+    boostEpoch = 0;
+    ticks = 0;
 }
 
 TaskManager::~TaskManager()
 {
+    if(activeTaskManager == this)
+        activeTaskManager = 0;
+    for(int i = 0; i < MAX_TASKS; i++)
+        if(tasks[i].addressSpace != 0)
+            delete tasks[i].addressSpace;
+    for(common::uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        if(runQueues[cpu].deadAddressSpace != 0)
+            delete runQueues[cpu].deadAddressSpace;
 }
 
-common::uint32_t TaskManager::ForkTask(CPUState *cpustate)
+RunQueue* TaskManager::LocalQueue()
 {
-    if(numTasks >= 256) {
-        return -1;
-    }    
+    return &runQueues[CPUManager::Current()->index];
+}
+
+Task* TaskManager::CurrentTask()
+{
+    RunQueue* queue = LocalQueue();
+    return (queue->currentTask >= 0) ? &tasks[queue->currentTask] : 0;
+}
+
+void TaskManager::Place(Task* task)
+{
+    // on the processor with the fewest live tasks, for good
+    common::uint32_t best = 0;
+    for(common::uint32_t cpu = 1; cpu < CPUManager::NumOnline(); cpu++)
+        if(runQueues[cpu].load < runQueues[best].load)
+            best = cpu;
+    task->cpu = best;
+    runQueues[best].load++;
+}
+
+common::uint8_t TaskManager::Quantum(common::uint8_t priority)
+{
+    // lower levels run less often but for longer
+    return priority + 1;
+}
+
+common::uint8_t TaskManager::TimeSlice(Task* task)
+{
+    if(task->schedulingClass == BATCH)
+        return (task->batchSlice != 0) ? task->batchSlice : BATCH_DEFAULT_SLICE;
+    return Quantum(task->priority);
+}
 
-    tasks[numTasks].taskState = 2;
-    tasks[numTasks].pPid = tasks[currentTask].pid;
-    tasks[numTasks].pid = ++Task::pIdCounter;
-    tasks[currentTask].cPid = tasks[numTasks].pid;
+common::uint32_t TaskManager::Remaining(Task* task)
+{
+    // one that overran its estimate is expected to be done any moment
+    if(task->stats.ticksRun >= task->expectedTicks)
+        return 0;
+    return task->expectedTicks - task->stats.ticksRun;
+}
+
+common::uint32_t TaskManager::StackSizeClass(common::uint32_t size)
+{
+    // 0 ---> too big for any class
+    if(size <= TASK_STACK_SMALL)
+        return TASK_STACK_SMALL;
+    if(size <= TASK_STACK_MEDIUM)
+        return TASK_STACK_MEDIUM;
+    if(size <= TASK_STACK_LARGE)
+        return TASK_STACK_LARGE;
+    return 0;
+}
 
-    // copying current stack to new stack
-    for (int i = 0; i < sizeof(tasks[currentTask].stack); i++)
+void TaskManager::Enqueue(Task* task)
+{
+    // a boost happened while the task was off the run queue
+    if(task->boostEpoch != boostEpoch)
     {
-        tasks[numTasks].stack[i] = tasks[currentTask].stack[i];
+        task->boostEpoch = boostEpoch;
+        task->priority = 0;
+        task->ticksLeft = 0;
+        task->quotaUsed = 0;
     }
 
-    // finding current task's length
-    common::uint32_t currentTaskOffset = (((common::uint32_t)cpustate) - ((common::uint32_t)tasks[currentTask].stack));
-    // make two stacks pointer's location same
-    tasks[numTasks].cpustate = (CPUState*)(tasks[numTasks].stack + currentTaskOffset);
+    if(task->schedulingClass == BATCH)
+    {
+        EnqueueBatch(task);
+        return;
+    }
 
-    // child returns 0
-    tasks[numTasks].cpustate -> eax = 0;
+    RunQueue* queue = &runQueues[task->cpu];
+    if(queue->currentTask < 0 && queue != LocalQueue())
+        CPUManager::Wake(task->cpu);
+    task->taskState = READY;
+    task->nextReady = 0;
+    task->prevReady = queue->readyTail[task->priority];
+    if(queue->readyTail[task->priority] != 0)
+        queue->readyTail[task->priority]->nextReady = task;
+    else
+        queue->readyHead[task->priority] = task;
+    queue->readyTail[task->priority] = task;
+    queue->readyBitmap |= (1 << task->priority);
+}
 
-    // new task created
-    numTasks++;
+void TaskManager::EnqueueBatch(Task* task)
+{
+    RunQueue* queue = &runQueues[task->cpu];
+    if(queue->currentTask < 0 && queue != LocalQueue())
+        CPUManager::Wake(task->cpu);
+    task->taskState = READY;
+    task->prevReady = 0;
+
+    if(task->quota != 0 && task->quotaUsed >= task->quota)
+    {
+        task->nextReady = queue->throttledHead;
+        queue->throttledHead = task;
+        return;
+    }
+
+    // behind the ones with the same remaining time, so they take turns
+    common::uint32_t remaining = Remaining(task);
+    Task** link = &queue->batchHead;
+    while(*link != 0 && Remaining(*link) <= remaining)
+        link = &(*link)->nextReady;
+    task->nextReady = *link;
+    *link = task;
+}
+
+void TaskManager::Unlink(Task* task, common::uint8_t priority)
+{
+    RunQueue* queue = &runQueues[task->cpu];
+    if(task->prevReady != 0)
+        task->prevReady->nextReady = task->nextReady;
+    else
+        queue->readyHead[priority] = task->nextReady;
+    if(task->nextReady != 0)
+        task->nextReady->prevReady = task->prevReady;
+    else
+        queue->readyTail[priority] = task->prevReady;
+    task->nextReady = 0;
+    task->prevReady = 0;
+
+    if(queue->readyHead[priority] == 0)
+        queue->readyBitmap &= ~(1 << priority);
+}
+
+Task* TaskManager::PickNext(RunQueue* queue)
+{
+    Task* task;
+    if(queue->readyBitmap != 0)
+    {
+        // find first set: the highest non-empty priority level
+        common::uint8_t level = __builtin_ctz(queue->readyBitmap);
+        task = queue->readyHead[level];
+        Unlink(task, level);
+    }
+    else if(queue->batchHead != 0)
+    {
+        // no interactive task wants the CPU, run the shortest job
+        task = queue->batchHead;
+        queue->batchHead = task->nextReady;
+        task->nextReady = 0;
+    }
+    else
+        return 0;
+
+    if(task->boostEpoch != boostEpoch)
+    {
+        task->boostEpoch = boostEpoch;
+        task->priority = 0;
+        task->ticksLeft = 0;
+        task->quotaUsed = 0;
+    }
+    return task;
+}
+
+void TaskManager::Boost()
+{
+    // move every ready task to the top level by splicing the lists,
+    // the tasks' own priority fields are fixed up lazily via boostEpoch
+    boostEpoch++;
+    for(common::uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        RunQueue* queue = &runQueues[cpu];
+        for(int level = 1; level < NUM_PRIORITY_LEVELS; level++)
+        {
+            if(queue->readyHead[level] == 0)
+                continue;
+
+            if(queue->readyTail[0] != 0)
+            {
+                queue->readyTail[0]->nextReady = queue->readyHead[level];
+                queue->readyHead[level]->prevReady = queue->readyTail[0];
+            }
+            else
+                queue->readyHead[0] = queue->readyHead[level];
+            queue->readyTail[0] = queue->readyTail[level];
+
+            queue->readyHead[level] = 0;
+            queue->readyTail[level] = 0;
+        }
+        queue->readyBitmap = (queue->readyHead[0] != 0) ? 1 : 0;
+
+        // batch tasks get their quota back
+        while(queue->throttledHead != 0)
+        {
+            Task* task = queue->throttledHead;
+            queue->throttledHead = task->nextReady;
+            Enqueue(task);
+        }
+
+        if(queue->currentTask >= 0)
+        {
+            tasks[queue->currentTask].boostEpoch = boostEpoch;
+            tasks[queue->currentTask].priority = 0;
+            tasks[queue->currentTask].quotaUsed = 0;
+        }
+    }
+}
+
+CPUState* TaskManager::SwitchTo(Task* next)
+{
+    RunQueue* queue = LocalQueue();
+    Task* previous = CurrentTask();
+    if(previous != next)
+    {
+        if(previous != 0)
+            previous->lastTick = ticks;
+        if(next != 0)
+        {
+            next->stats.ticksWaiting += ticks - next->lastTick;
+            next->stats.contextSwitches++;
+        }
+    }
+
+    // int_bottom loads the page directory before switching stacks
+    PagingManager::activePagingManager->Switch(next != 0 ? next->addressSpace : 0);
+    MemoryManager::activeMemoryManager->SetCache(next != 0 ? &next->heapCache : 0);
+
+    if(next == 0)
+    {
+        // nothing is ready, go back to the idle loop
+        queue->currentTask = -1;
+        return queue->idleState;
+    }
+
+    next->taskState = RUNNING;
+    if(next->ticksLeft == 0)
+        next->ticksLeft = TimeSlice(next);
+    queue->currentTask = next - tasks;
+    return next->cpustate;
+}
+
+common::uint32_t TaskManager::ForkTask(CPUState *cpustate, const BatchParameters* batch)
+{
+    SpinlockGuard guard(&lock);
+    Task* parent = CurrentTask();
+    Task* child = AllocateTask(parent->pid);
+    if(child == 0) {
+        return -1;
+    }    
+
+    // copy on write: only the page tables are copied here, the stack
+    // pages get duplicated by the page fault handler once written to
+    child->addressSpace = parent->addressSpace->Clone();
+    if(child->addressSpace == 0) {
+        FreeTask(child - tasks);
+        return -1;
+    }
+
+    parent->cPid = child->pid;
+    child->stackSize = parent->stackSize;
+    child->mapEnd = parent->mapEnd;
+    for(common::uint32_t fd = 0; fd < MAX_FILES; fd++)
+        if(parent->files[fd] != 0)
+        {
+            child->files[fd] = parent->files[fd];
+            child->files[fd]->Acquire();
+        }
+
+    // the stack is at the same address in both address spaces
+    child->cpustate = cpustate;
+
+    // child returns 0
+    common::uint32_t zero = 0;
+    child->addressSpace->Write((common::uint32_t)&cpustate->eax, &zero, sizeof(zero));
+
+    // child starts on its parent's level with a fresh quantum,
+    // maybe on another processor
+    child->priority = parent->priority;
+    child->schedulingClass = parent->schedulingClass;
+    child->expectedTicks = parent->expectedTicks;
+    child->batchSlice = parent->batchSlice;
+    child->quota = parent->quota;
+    if(batch != 0)
+    {
+        child->schedulingClass = BATCH;
+        child->expectedTicks = batch->expectedTicks;
+        child->batchSlice = batch->slice;
+        child->quota = batch->quota;
+    }
+    Place(child);
+    Enqueue(child);
 
     return 0;
 }
 
 common::uint32_t TaskManager::GetPID() {
     // returns parent pid
-    return tasks[currentTask].pid; 
+    SpinlockGuard guard(&lock);
+    return CurrentTask()->pid; 
 }
 
 common::uint32_t TaskManager::GetCPID() {
     // returns child pid
-    return tasks[currentTask].cPid; 
+    SpinlockGuard guard(&lock);
+    return CurrentTask()->cPid; 
 }
 
 int TaskManager::getIndex(common::uint32_t pid)
 {
-    // returns waiting process index
-    int index = -1;
-    for (int i = 0; i < numTasks; i++)
+    SpinlockGuard guard(&lock);
+    // returns the slot of pid, -1 if there is no such task
+    for (int i = pidHash[pid % MAX_TASKS]; i >= 0; i = tasks[i].nextInHash)
     {
         if(tasks[i].pid == pid)
-        {
-            index=i;
-            break;
+            return i;
+    }
+    return -1;
+}
 
-        }
+Task* TaskManager::AllocateTask(common::uint32_t pPid)
+{
+    if(numFreeSlots == 0)
+        return 0;
+
+    int index = freeSlots[--numFreeSlots];
+    Task* task = &tasks[index];
+
+    // the slot may have been used before, reset everything
+    task->pid = ++Task::pIdCounter;
+    task->pPid = pPid;
+    task->cPid = 0;
+    task->waitPid = 0;
+    task->exitStatus = 0;
+    task->waitingOn = 0;
+    task->nextWaiting = 0;
+    task->nextReady = 0;
+    task->prevReady = 0;
+    task->priority = 0;
+    task->ticksLeft = 0;
+    task->boostEpoch = boostEpoch;
+    task->schedulingClass = INTERACTIVE;
+    task->expectedTicks = 0;
+    task->batchSlice = 0;
+    task->quota = 0;
+    task->quotaUsed = 0;
+    task->stats = {0, 0, 0, 0};
+    task->lastTick = ticks;
+    for(common::uint32_t fd = 0; fd < MAX_FILES; fd++)
+        task->files[fd] = 0;
+    task->mapEnd = TASK_WINDOW_BASE;
+
+    common::uint32_t bucket = task->pid % MAX_TASKS;
+    task->nextInHash = pidHash[bucket];
+    pidHash[bucket] = index;
+
+    numTasks++;
+    return task;
+}
+
+void TaskManager::FreeTask(int index)
+{
+    Task* task = &tasks[index];
+
+    common::uint32_t bucket = task->pid % MAX_TASKS;
+    if(pidHash[bucket] == index)
+        pidHash[bucket] = task->nextInHash;
+    else
+        for (int i = pidHash[bucket]; i >= 0; i = tasks[i].nextInHash)
+            if(tasks[i].nextInHash == index)
+            {
+                tasks[i].nextInHash = task->nextInHash;
+                break;
+            }
+
+    DropAddressSpace(task);
+    MemoryManager::activeMemoryManager->Drain(&task->heapCache);
+    if(task->sleepTimer.Pending())
+        TimerManager::activeTimerManager->Cancel(&task->sleepTimer);
+    task->taskState = FINISHED;
+    task->pid = 0;
+    task->nextInHash = -1;
+    numTasks--;
+
+    // an exited task's processor may not have switched away yet
+    RunQueue* queue = &runQueues[task->cpu];
+    if(queue->currentTask == index)
+        queue->deadTask = index;
+    else
+        freeSlots[numFreeSlots++] = index;
+}
+
+void TaskManager::DropAddressSpace(Task* task)
+{
+    if(task->addressSpace == 0)
+        return;
+
+    RunQueue* queue = &runQueues[task->cpu];
+    if(queue->currentTask == task - tasks)
+    {
+        // still running on its stack, delete it once we switched away
+        if(queue->deadAddressSpace != 0)
+            delete queue->deadAddressSpace;
+        queue->deadAddressSpace = task->addressSpace;
     }
-    return index;
+    else
+        delete task->addressSpace;
+    task->addressSpace = 0;
 }
 
-bool TaskManager::ExitTask() {
-    // set current task state finished (sys exit)
-    tasks[currentTask].taskState=0;
+void TaskManager::Block(WaitQueue* queue)
+{
+    // the caller has to Reschedule afterwards
+    SpinlockGuard guard(&lock);
+    Task* task = CurrentTask();
+    task->taskState = WAITING;
+    task->waitingOn = queue;
+    task->nextWaiting = 0;
+    if(queue->tail != 0)
+        queue->tail->nextWaiting = task;
+    else
+        queue->head = task;
+    queue->tail = task;
+}
+
+bool TaskManager::Sleep(common::uint32_t microseconds)
+{
+    // off the run queue until the timer fires, which can happen on the
+    // boot processor before this one got to Reschedule
+    if(TimerManager::activeTimerManager == 0)
+        return false;
+    SpinlockGuard guard(&lock);
+    Task* task = CurrentTask();
+    Block(&sleepers);
+    TimerManager::activeTimerManager->Add(&task->sleepTimer, microseconds);
     return true;
 }
 
-bool TaskManager::WaitTask(common::uint32_t pid) {
-    // saving waiting process pid
-    tasks[currentTask].taskState = 1;
-    tasks[currentTask].waitPid = pid;
+void TaskManager::SleepExpired(void* task)
+{
+    if(activeTaskManager != 0)
+        activeTaskManager->WakeUp((Task*)task);
+}
+
+void TaskManager::WakeUp(Task* task)
+{
+    SpinlockGuard guard(&lock);
+    WaitQueue* queue = task->waitingOn;
+    if(queue == 0)
+        return;
+
+    Task* previous = 0;
+    for(Task* t = queue->head; t != 0; previous = t, t = t->nextWaiting)
+    {
+        if(t != task)
+            continue;
+        if(previous != 0)
+            previous->nextWaiting = task->nextWaiting;
+        else
+            queue->head = task->nextWaiting;
+        if(queue->tail == task)
+            queue->tail = previous;
+        break;
+    }
+
+    task->waitingOn = 0;
+    task->nextWaiting = 0;
+    Enqueue(task);
+}
+
+void TaskManager::WakeUpAll(WaitQueue* queue)
+{
+    SpinlockGuard guard(&lock);
+    while(queue->head != 0)
+        WakeUp(queue->head);
+}
+
+bool TaskManager::ExitTask(common::int32_t status) {
+    SpinlockGuard guard(&lock);
+    Task* task = CurrentTask();
+    task->exitStatus = status;
+    runQueues[task->cpu].load--;
+    ReleaseFiles(task);
+
+    // nobody is left to reap the children, the exited ones go right away
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        if(tasks[i].taskState == FINISHED || tasks[i].pPid != task->pid)
+            continue;
+        if(tasks[i].taskState == ZOMBIE)
+            FreeTask(i);
+        else
+            tasks[i].pPid = 0;
+    }
+
+    int parentIndex = (task->pPid != 0) ? getIndex(task->pPid) : -1;
+    if(parentIndex < 0)
+    {
+        // orphan, nobody will ever wait for it
+        FreeTask(task - tasks);
+        return true;
+    }
+    Task* parent = &tasks[parentIndex];
+
+    // hand the status straight to a parent blocked in waitpid
+    for(Task* waiter = parent->childExit.head; waiter != 0; waiter = waiter->nextWaiting)
+    {
+        if(waiter->waitPid != -1 && waiter->waitPid != (common::int32_t)task->pid)
+            continue;
+
+        // waitpid returns the pid in ecx and the status in edx,
+        // the waiter's stack is only mapped in its own address space
+        common::uint32_t pid = task->pid;
+        waiter->addressSpace->Write((common::uint32_t)&waiter->cpustate->ecx, &pid, sizeof(pid));
+        waiter->addressSpace->Write((common::uint32_t)&waiter->cpustate->edx, &status, sizeof(status));
+        WakeUp(waiter);
+        FreeTask(task - tasks);
+        return true;
+    }
+
+    // keep the slot until the parent collects the status,
+    // the memory is not needed for that
+    DropAddressSpace(task);
+    MemoryManager::activeMemoryManager->Drain(&task->heapCache);
+    task->taskState = ZOMBIE;
+    return true;
+}
+
+bool TaskManager::WaitTask(CPUState* cpustate) {
+    SpinlockGuard guard(&lock);
+    Task* task = CurrentTask();
+    common::int32_t pid = cpustate->ebx;
+
+    // a child that already exited is reaped right away
+    bool hasChild = false;
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        if(tasks[i].taskState == FINISHED || tasks[i].pPid != task->pid
+        || (pid != -1 && tasks[i].pid != (common::uint32_t)pid))
+            continue;
+        hasChild = true;
+        if(tasks[i].taskState == ZOMBIE)
+        {
+            cpustate->ecx = tasks[i].pid;
+            cpustate->edx = tasks[i].exitStatus;
+            FreeTask(i);
+            return false;
+        }
+    }
+
+    if(!hasChild)
+    {
+        cpustate->ecx = -1;
+        return false;
+    }
+
+    // off the run queue until a matching child's ExitTask wakes it up,
+    // which may happen on another processor before we Reschedule
+    task->cpustate = cpustate;
+    task->waitPid = pid;
+    Block(&task->childExit);
     return true;
 }
 
 bool TaskManager::AddTask(Task* task) {
-    if(numTasks >= 256) {
+    SpinlockGuard guard(&lock);
+    Task* newTask = AllocateTask(0);
+    if(newTask == 0) {
         return false;
     }   
 
-    tasks[numTasks].taskState = 2;
-    tasks[numTasks].pid = ++Task::pIdCounter;
-    tasks[numTasks].cpustate = (CPUState*)(tasks[numTasks].stack + 4096 - sizeof(CPUState));
-    
-    tasks[numTasks].cpustate -> eax = task->cpustate->eax;
-    tasks[numTasks].cpustate -> ebx = task->cpustate->ebx; 
-    tasks[numTasks].cpustate -> ecx = task->cpustate->ecx;
-    tasks[numTasks].cpustate -> edx = task->cpustate->edx;
+    // a fresh address space with just the stack mapped
+    newTask->stackSize = StackSizeClass(task->stackSize);
+    newTask->addressSpace = new AddressSpace();
+    if(newTask->stackSize == 0 || newTask->addressSpace == 0
+    || !newTask->addressSpace->MapStack(newTask->stackSize)) {
+        FreeTask(newTask - tasks);
+        return false;
+    }
 
-    tasks[numTasks].cpustate -> esi = task->cpustate->esi;
-    tasks[numTasks].cpustate -> edi = task->cpustate->edi;
-    tasks[numTasks].cpustate -> ebp = task->cpustate->ebp;
+    newTask->cpustate = (CPUState*)(TASK_STACK_TOP - sizeof(CPUState));
+    newTask->addressSpace->Write((common::uint32_t)newTask->cpustate, task->cpustate, sizeof(CPUState));
 
-    tasks[numTasks].cpustate -> eip = task->cpustate->eip;
-    tasks[numTasks].cpustate -> cs = task->cpustate->cs;
-    tasks[numTasks].cpustate -> eflags = task->cpustate->eflags;
-    tasks[numTasks].cpustate -> esp = task->cpustate->esp;
-    //tasks[numTasks].cpustate -> ss = task->cpustate->ss;
+    // standard input, output and error
+    File* console = DeviceFiles::Open("/dev/console");
+    for(common::uint32_t fd = 0; fd < 3 && console != 0; fd++)
+    {
+        newTask->files[fd] = console;
+        console->Acquire();
+    }
 
-    numTasks++;
+    Place(newTask);
+    Enqueue(newTask);
+    return true;
+}
+
+bool TaskManager::GetTaskStatistics(common::uint32_t pid, TaskStatistics* stats)
+{
+    // pid 0 is the calling task
+    SpinlockGuard guard(&lock);
+    int index = (pid == 0) ? LocalQueue()->currentTask : getIndex(pid);
+    if(index < 0)
+        return false;
+
+    *stats = tasks[index].stats;
+    // include the wait that is still going on
+    if(tasks[index].taskState != RUNNING && tasks[index].taskState != ZOMBIE)
+        stats->ticksWaiting += ticks - tasks[index].lastTick;
     return true;
 }
 
+void TaskManager::AccountSyscall()
+{
+    SpinlockGuard guard(&lock);
+    Task* current = CurrentTask();
+    if(current != 0)
+        current->stats.syscalls++;
+}
+
+void TaskManager::ReleaseFiles(Task* task)
+{
+    for(common::uint32_t fd = 0; fd < MAX_FILES; fd++)
+        if(task->files[fd] != 0)
+        {
+            task->files[fd]->Release();
+            task->files[fd] = 0;
+        }
+}
+
+common::int32_t TaskManager::AddFile(File* file)
+{
+    SpinlockGuard guard(&lock);
+    Task* task = CurrentTask();
+    for(common::uint32_t fd = 0; fd < MAX_FILES; fd++)
+        if(task->files[fd] == 0)
+        {
+            task->files[fd] = file;
+            file->Acquire();
+            return fd;
+        }
+
+    // drops it again, with the lock held like every reference change
+    file->Acquire();
+    file->Release();
+    return -EMFILE;
+}
+
+File* TaskManager::GetFile(common::int32_t fd)
+{
+    // only the task itself changes its descriptors
+    SpinlockGuard guard(&lock);
+    if(fd < 0 || fd >= (common::int32_t)MAX_FILES)
+        return 0;
+    return CurrentTask()->files[fd];
+}
+
+common::int32_t TaskManager::CloseFile(common::int32_t fd)
+{
+    SpinlockGuard guard(&lock);
+    Task* task = CurrentTask();
+    if(fd < 0 || fd >= (common::int32_t)MAX_FILES || task->files[fd] == 0)
+        return -EBADF;
+    task->files[fd]->Release();
+    task->files[fd] = 0;
+    return 0;
+}
+
+common::uint32_t TaskManager::MapMemory(common::uint32_t size)
+{
+    SpinlockGuard guard(&lock);
+    Task* task = CurrentTask();
+
+    // up to the guard page under the stack
+    common::uint32_t limit = TASK_STACK_TOP - task->stackSize - PAGE_SIZE;
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if(size == 0 || size > limit - task->mapEnd || task->addressSpace == 0)
+        return 0;
+    if(!task->addressSpace->Map(task->mapEnd, size))
+        return 0;
+
+    common::uint32_t address = task->mapEnd;
+    task->mapEnd += size;
+    return address;
+}
+
+// on demand only (keyboard), never from the timer interrupt
 void TaskManager::taskTable(){
-    printf("\n-----------------------------\n");
-    printf("PID  PPID STATE\n");
-    for (int i = 0; i < numTasks; i++)
-    {
-        printfHex(tasks[i].pid);
-        printf("   ");
-        printfHex(tasks[i].pPid);
-        printf("   ");
-        if(tasks[i].taskState== 2){
-            if(i==currentTask)
-                printf("RUNNING");
-            else
-                printf("READY");
-        }else if(tasks[i].taskState==1){
-            printf("WAITING");
-        }else if(tasks[i].taskState==0){
-            printf("FINISHED");
+    SpinlockGuard guard(&lock);
+    printf("\n-----------------------------------------------------\n");
+    printf("PID  PPID STATE    RUN      WAIT     SWITCH   SYSCALL\n");
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        if(tasks[i].taskState == FINISHED)
+            continue;
+
+        TaskStatistics stats;
+        GetTaskStatistics(tasks[i].pid, &stats);
+
+        // pids keep growing as slots are reused
+        printfHex16(tasks[i].pid);
+        printf(" ");
+        printfHex16(tasks[i].pPid);
+        printf(" ");
+        if(tasks[i].taskState == RUNNING){
+            printf("RUNNING  ");
+        }else if(tasks[i].taskState == READY){
+            printf("READY    ");
+        }else if(tasks[i].taskState == WAITING){
+            printf("WAITING  ");
+        }else if(tasks[i].taskState == ZOMBIE){
+            printf("ZOMBIE   ");
         }
+        printfHex32(stats.ticksRun);
+        printf(" ");
+        printfHex32(stats.ticksWaiting);
+        printf(" ");
+        printfHex32(stats.contextSwitches);
+        printf(" ");
+        printfHex32(stats.syscalls);
         printf("\n");
     }
-    printf("-----------------------------\n");
-    for (int i = 0; i < 10000000; i++){
-        printf("");
-    }
-    
+    printf("-----------------------------------------------------\n");
 }
 
 
-// finished 0
-// waiting  1
-// ready    2
-// running  3
 CPUState* TaskManager::Schedule(CPUState* cpustate)
 {
-    taskTable();
-    if (cpustate->eax == 6) {
-        WaitTask(cpustate->ebx);
-    }
+    SpinlockGuard guard(&lock);
     if(numTasks <= 0) {
         return cpustate;
     }
-    if(currentTask >= 0) {
-        tasks[currentTask].cpustate = cpustate;
-    }    
+    RunQueue* queue = LocalQueue();
 
-    int findTask=(currentTask+1)%numTasks;
-    while(tasks[findTask].taskState != 2) { // until the state is ready
-        if(tasks[findTask].taskState == 1) { // if found task is waiting state
-            int waitTaskIndex = 0;
-            waitTaskIndex=getIndex(tasks[findTask].waitPid);
-            if(waitTaskIndex > -1 && tasks[waitTaskIndex].taskState != 1) {
-                if(tasks[waitTaskIndex].taskState == 0) {
-                    printf("found new task\n");
-                    tasks[findTask].waitPid = 0;
-                    tasks[findTask].taskState = 2; // state is ready
-                    continue;
-                }
-                else if (tasks[waitTaskIndex].taskState == 2) { // keep searching
-                    printf("still searching\n");
-                    findTask = waitTaskIndex;
-                    continue;
-                }
-            }
+    // we are on some other task's (or the idle loop's) stack by now
+    if(queue->deadAddressSpace != 0)
+    {
+        delete queue->deadAddressSpace;
+        queue->deadAddressSpace = 0;
+    }
+    if(queue->deadTask >= 0)
+    {
+        freeSlots[numFreeSlots++] = queue->deadTask;
+        queue->deadTask = -1;
+    }
+
+    // idle processors take no ticks, so catch up with the clock
+    common::uint32_t now = ticks + 1;
+    if(TimerManager::activeTimerManager != 0)
+        now = TimerManager::activeTimerManager->Ticks();
+    while(ticks != now)
+        if(++ticks % PRIORITY_BOOST_INTERVAL == 0)
+            Boost();
+
+    if(queue->currentTask < 0) {
+        queue->idleState = cpustate;
+        return SwitchTo(PickNext(queue));
+    }
+
+    Task* current = &tasks[queue->currentTask];
+    current->cpustate = cpustate;
+    current->stats.ticksRun++;
+
+    if(current->taskState == RUNNING)
+    {
+        if(current->ticksLeft > 0)
+            current->ticksLeft--;
+
+        // keep running unless the quantum is used up or a task
+        // on a higher level became ready
+        bool preempted;
+        if(current->schedulingClass == BATCH)
+        {
+            // any interactive task, a shorter job or the used up quota
+            current->quotaUsed++;
+            preempted = queue->readyBitmap != 0
+                || (queue->batchHead != 0 && Remaining(queue->batchHead) < Remaining(current))
+                || (current->quota != 0 && current->quotaUsed >= current->quota);
         }
-        findTask=(findTask+1)%numTasks;
+        else
+            preempted = (queue->readyBitmap & ((1 << current->priority) - 1)) != 0;
+        if(current->ticksLeft > 0 && !preempted)
+            return cpustate;
+
+        // CPU bound: used the whole quantum, sink one level
+        if(current->schedulingClass == INTERACTIVE && current->ticksLeft == 0 && current->priority < NUM_PRIORITY_LEVELS - 1)
+            current->priority++;
+        Enqueue(current);
     }
-    currentTask = findTask;    
-    return tasks[currentTask].cpustate;
+
+    return SwitchTo(PickNext(queue));
+}
+
+bool TaskManager::IsIdle()
+{
+    SpinlockGuard guard(&lock);
+    return LocalQueue()->currentTask < 0;
 }
 
-    
\ No newline at end of file
+CPUState* TaskManager::Reschedule(CPUState* cpustate)
+{
+    // voluntary switch (exit, wait, yield), no tick is charged
+    SpinlockGuard guard(&lock);
+    RunQueue* queue = LocalQueue();
+    if(queue->currentTask < 0)
+        return cpustate;
+
+    Task* current = &tasks[queue->currentTask];
+    current->cpustate = cpustate;
+
+    // gave the CPU up before its quantum ran out, so it keeps its level
+    if(current->taskState == RUNNING)
+        Enqueue(current);
+
+    return SwitchTo(PickNext(queue));
+}
@@ -1,5 +1,6 @@
 
 #include <net/arp.h>
+#include <common/errors.h>
 using namespace myos;
 using namespace myos::common;
 using namespace myos::net;
@@ -7,13 +8,179 @@ using namespace myos::drivers;
 
 
 AddressResolutionProtocol::AddressResolutionProtocol(EtherFrameProvider* backend)
-:  EtherFrameHandler(backend, 0x806)
+:  EtherFrameHandler(backend, 0x806),
+   entryCache("arp entry"),
+   timer(&AddressResolutionProtocol::Tick, this)
 {
-    numCacheEntries = 0;
+    for(uint32_t i = 0; i < ARP_TABLE_SIZE; i++)
+        table[i] = 0;
+    numEntries = 0;
 }
 
 AddressResolutionProtocol::~AddressResolutionProtocol()
 {
+    SpinlockGuard guard(&lock);
+    for(uint32_t i = 0; i < ARP_TABLE_SIZE; i++)
+        while(table[i] != 0)
+            Remove(table[i]);
+}
+
+
+static uint32_t Hash(uint32_t IP_BE)
+{
+    IP_BE ^= IP_BE >> 16;
+    IP_BE ^= IP_BE >> 8;
+    return IP_BE % ARP_TABLE_SIZE;
+}
+
+AddressResolutionProtocolEntry* AddressResolutionProtocol::Find(uint32_t IP_BE)
+{
+    for(AddressResolutionProtocolEntry* entry = table[Hash(IP_BE)]; entry != 0; entry = entry->next)
+        if(entry->IP_BE == IP_BE)
+            return entry;
+    return 0;
+}
+
+AddressResolutionProtocolEntry* AddressResolutionProtocol::Lookup(uint32_t IP_BE, bool* request)
+{
+    *request = false;
+    AddressResolutionProtocolEntry* entry = Find(IP_BE);
+    if(entry != 0)
+    {
+        if(entry->resolved && entry->expires <= TimerManager::Now())
+        {
+            // old enough to have changed, ask again
+            entry->resolved = false;
+            entry->requests = 1;
+            *request = true;
+        }
+        return entry;
+    }
+    
+    if(numEntries >= ARP_MAX_ENTRIES)
+        return 0;
+    entry = entryCache.Allocate();
+    if(entry == 0)
+        return 0;
+    entry->IP_BE = IP_BE;
+    entry->MAC = 0xFFFFFFFFFFFF;
+    entry->resolved = false;
+    entry->expires = 0;
+    entry->requests = 1;
+    entry->pendingHead = 0;
+    entry->pendingTail = 0;
+    entry->numPending = 0;
+    entry->etherType_BE = 0;
+    entry->next = table[Hash(IP_BE)];
+    table[Hash(IP_BE)] = entry;
+    numEntries++;
+    StartTimer();
+    *request = true;
+    return entry;
+}
+
+void AddressResolutionProtocol::Remove(AddressResolutionProtocolEntry* entry)
+{
+    for(AddressResolutionProtocolEntry** link = &table[Hash(entry->IP_BE)]; *link != 0; link = &(*link)->next)
+        if(*link == entry)
+        {
+            *link = entry->next;
+            break;
+        }
+    
+    // nobody is going to answer for them anymore
+    while(entry->pendingHead != 0)
+    {
+        PacketBuffer* packet = entry->pendingHead;
+        entry->pendingHead = packet->next;
+        packet->Free();
+    }
+    entryCache.Free(entry);
+    numEntries--;
+}
+
+void AddressResolutionProtocol::StartTimer()
+{
+    if(!timer.Pending() && TimerManager::activeTimerManager != 0)
+        TimerManager::activeTimerManager->Add(&timer, ARP_RETRY_INTERVAL);
+}
+
+void AddressResolutionProtocol::Tick(void* arp)
+{
+    ((AddressResolutionProtocol*)arp)->Sweep();
+}
+
+void AddressResolutionProtocol::Sweep()
+{
+    uint32_t requests[ARP_MAX_ENTRIES];
+    uint32_t numRequests = 0;
+    uint64_t now = TimerManager::Now();
+    
+    lock.Lock();
+    for(uint32_t i = 0; i < ARP_TABLE_SIZE; i++)
+    {
+        AddressResolutionProtocolEntry* next;
+        for(AddressResolutionProtocolEntry* entry = table[i]; entry != 0; entry = next)
+        {
+            next = entry->next;
+            if(entry->resolved)
+            {
+                if(entry->expires <= now)
+                    Remove(entry);
+            }
+            else if(entry->requests >= ARP_MAX_REQUESTS)
+                Remove(entry); // unreachable, its packets are dropped
+            else
+            {
+                entry->requests++;
+                requests[numRequests++] = entry->IP_BE;
+            }
+        }
+    }
+    if(numEntries > 0)
+        StartTimer();
+    lock.Unlock();
+    
+    // without the lock, the driver may take its time
+    for(uint32_t i = 0; i < numRequests; i++)
+        RequestMACAddress(requests[i]);
+}
+
+void AddressResolutionProtocol::Update(uint32_t IP_BE, uint64_t MAC, bool create)
+{
+    lock.Lock();
+    AddressResolutionProtocolEntry* entry = Find(IP_BE);
+    if(entry == 0 && create)
+    {
+        bool request;
+        entry = Lookup(IP_BE, &request);
+    }
+    if(entry == 0)
+    {
+        lock.Unlock();
+        return;
+    }
+    
+    entry->MAC = MAC;
+    entry->resolved = true;
+    entry->expires = TimerManager::Now() + ARP_ENTRY_TTL;
+    entry->requests = 0;
+    
+    PacketBuffer* pending = entry->pendingHead;
+    uint16_t etherType_BE = entry->etherType_BE;
+    entry->pendingHead = 0;
+    entry->pendingTail = 0;
+    entry->numPending = 0;
+    lock.Unlock();
+    
+    // in the order they were sent
+    while(pending != 0)
+    {
+        PacketBuffer* packet = pending;
+        pending = packet->next;
+        packet->next = 0;
+        backend->Send(MAC, etherType_BE, packet);
+    }
 }
 
 
@@ -36,6 +203,8 @@ bool AddressResolutionProtocol::OnEtherFrameReceived(uint8_t* etherframePayload,
             {
                 
                 case 0x0100: // request
+                    // whoever asks will talk to us, so remember it
+                    Update(arp->srcIP, arp->srcMAC, true);
                     arp->command = 0x0200;
                     arp->dstIP = arp->srcIP;
                     arp->dstMAC = arp->srcMAC;
@@ -45,12 +214,8 @@ bool AddressResolutionProtocol::OnEtherFrameReceived(uint8_t* etherframePayload,
                     break;
                     
                 case 0x0200: // response
-                    if(numCacheEntries < 128)
-                    {
-                        IPcache[numCacheEntries] = arp->srcIP;
-                        MACcache[numCacheEntries] = arp->srcMAC;
-                        numCacheEntries++;
-                    }
+                    // only the ones that were asked for
+                    Update(arp->srcIP, arp->srcMAC, false);
                     break;
             }
         }
@@ -101,20 +266,61 @@ void AddressResolutionProtocol::RequestMACAddress(uint32_t IP_BE)
 
 uint64_t AddressResolutionProtocol::GetMACFromCache(uint32_t IP_BE)
 {
-    for(int i = 0; i < numCacheEntries; i++)
-        if(IPcache[i] == IP_BE)
-            return MACcache[i];
+    SpinlockGuard guard(&lock);
+    AddressResolutionProtocolEntry* entry = Find(IP_BE);
+    if(entry != 0 && entry->resolved)
+        return entry->MAC;
     return 0xFFFFFFFFFFFF; // broadcast address
 }
 
 uint64_t AddressResolutionProtocol::Resolve(uint32_t IP_BE)
 {
-    uint64_t result = GetMACFromCache(IP_BE);
-    if(result == 0xFFFFFFFFFFFF)
+    lock.Lock();
+    bool request;
+    AddressResolutionProtocolEntry* entry = Lookup(IP_BE, &request);
+    uint64_t result = (entry != 0 && entry->resolved) ? entry->MAC : 0xFFFFFFFFFFFF;
+    lock.Unlock();
+    
+    if(request)
         RequestMACAddress(IP_BE);
+    return result;
+}
 
-    while(result == 0xFFFFFFFFFFFF) // possible infinite loop
-        result = GetMACFromCache(IP_BE);
+int32_t AddressResolutionProtocol::SendTo(uint32_t IP_BE, uint16_t etherType_BE, PacketBuffer* packet)
+{
+    lock.Lock();
+    bool request;
+    AddressResolutionProtocolEntry* entry = Lookup(IP_BE, &request);
+    if(entry == 0)
+    {
+        lock.Unlock();
+        packet->Free();
+        return -ENOMEM;
+    }
+    if(entry->resolved)
+    {
+        uint64_t MAC = entry->MAC;
+        lock.Unlock();
+        return backend->Send(MAC, etherType_BE, packet);
+    }
     
-    return result;
+    if(entry->numPending >= ARP_MAX_PENDING)
+    {
+        lock.Unlock();
+        packet->Free();
+        return -EAGAIN;
+    }
+    packet->next = 0;
+    if(entry->pendingTail != 0)
+        entry->pendingTail->next = packet;
+    else
+        entry->pendingHead = packet;
+    entry->pendingTail = packet;
+    entry->numPending++;
+    entry->etherType_BE = etherType_BE;
+    lock.Unlock();
+    
+    if(request)
+        RequestMACAddress(IP_BE);
+    return 0;
 }
@@ -1,5 +1,6 @@
  
 #include <net/etherframe.h>
+#include <common/errors.h>
 using namespace myos;
 using namespace myos::common;
 using namespace myos::net;
@@ -26,9 +27,14 @@ bool EtherFrameHandler::OnEtherFrameReceived(common::uint8_t* etherframePayload,
     return false;
 }
 
-void EtherFrameHandler::Send(common::uint64_t dstMAC_BE, common::uint8_t* data, common::uint32_t size)
+int32_t EtherFrameHandler::Send(common::uint64_t dstMAC_BE, common::uint8_t* data, common::uint32_t size)
 {
-    backend->Send(dstMAC_BE, etherType_BE, data, size);
+    return backend->Send(dstMAC_BE, etherType_BE, data, size);
+}
+
+int32_t EtherFrameHandler::Send(common::uint64_t dstMAC_BE, PacketBuffer* packet)
+{
+    return backend->Send(dstMAC_BE, etherType_BE, packet);
 }
 
 uint32_t EtherFrameHandler::GetIPAddress()
@@ -39,6 +45,7 @@ uint32_t EtherFrameHandler::GetIPAddress()
 
 
             
+
 EtherFrameProvider::EtherFrameProvider(amd_am79c973* backend)
 : RawDataHandler(backend)
 {
@@ -75,23 +82,39 @@ bool EtherFrameProvider::OnRawDataReceived(common::uint8_t* buffer, common::uint
     return sendBack;
 }
 
-void EtherFrameProvider::Send(common::uint64_t dstMAC_BE, common::uint16_t etherType_BE, common::uint8_t* buffer, common::uint32_t size)
+int32_t EtherFrameProvider::Send(common::uint64_t dstMAC_BE, common::uint16_t etherType_BE, common::uint8_t* buffer, common::uint32_t size)
+{
+    EtherFrameHeader frame;
+    frame.dstMAC_BE = dstMAC_BE;
+    frame.srcMAC_BE = backend->GetMACAddress();
+    frame.etherType_BE = etherType_BE;
+    
+    // the driver puts the header and the payload together
+    NetworkSegment segments[2];
+    segments[0].data = (uint8_t*)&frame;
+    segments[0].size = sizeof(EtherFrameHeader);
+    segments[1].data = buffer;
+    segments[1].size = size;
+    return backend->Send(segments, 2);
+}
+
+int32_t EtherFrameProvider::Send(common::uint64_t dstMAC_BE, common::uint16_t etherType_BE, PacketBuffer* packet)
 {
-    uint8_t* buffer2 = (uint8_t*)MemoryManager::activeMemoryManager->malloc(sizeof(EtherFrameHeader) + size);
-    EtherFrameHeader* frame = (EtherFrameHeader*)buffer2;
+    EtherFrameHeader* frame = (EtherFrameHeader*)packet->Push(sizeof(EtherFrameHeader));
+    if(frame == 0)
+    {
+        packet->Free();
+        return -EINVAL;
+    }
     
     frame->dstMAC_BE = dstMAC_BE;
     frame->srcMAC_BE = backend->GetMACAddress();
     frame->etherType_BE = etherType_BE;
     
-    uint8_t* src = buffer;
-    uint8_t* dst = buffer2 + sizeof(EtherFrameHeader);
-    for(uint32_t i = 0; i < size; i++)
-        dst[i] = src[i];
-    
-    backend->Send(buffer2, size + sizeof(EtherFrameHeader));
-    
-    MemoryManager::activeMemoryManager->free(buffer2);
+    int32_t result = backend->Send(packet);
+    if(result < 0)
+        packet->Free();
+    return result;
 }
 
 uint32_t EtherFrameProvider::GetIPAddress()
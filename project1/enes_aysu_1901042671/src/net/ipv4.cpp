@@ -1,4 +1,5 @@
 #include <net/ipv4.h>
+#include <common/errors.h>
 
 using namespace myos;
 using namespace myos::common;
@@ -26,9 +27,14 @@ bool InternetProtocolHandler::OnInternetProtocolReceived(uint32_t srcIP_BE, uint
     return false;
 }
 
-void InternetProtocolHandler::Send(uint32_t dstIP_BE, uint8_t* internetprotocolPayload, uint32_t size)
+int32_t InternetProtocolHandler::Send(uint32_t dstIP_BE, uint8_t* internetprotocolPayload, uint32_t size)
 {
-    backend->Send(dstIP_BE, ip_protocol, internetprotocolPayload, size);
+    return backend->Send(dstIP_BE, ip_protocol, internetprotocolPayload, size);
+}
+
+int32_t InternetProtocolHandler::Send(uint32_t dstIP_BE, PacketBuffer* packet)
+{
+    return backend->Send(dstIP_BE, ip_protocol, packet);
 }
 
 
@@ -86,11 +92,28 @@ bool InternetProtocolProvider::OnEtherFrameReceived(uint8_t* etherframePayload,
 }
 
 
-void InternetProtocolProvider::Send(uint32_t dstIP_BE, uint8_t protocol, uint8_t* data, uint32_t size)
+int32_t InternetProtocolProvider::Send(uint32_t dstIP_BE, uint8_t protocol, uint8_t* data, uint32_t size)
 {
+    PacketBuffer* packet = PacketBuffer::Allocate(size);
+    if(packet == 0)
+        return -ENOMEM;
+    
+    uint8_t* databuffer = packet->Data();
+    for(int i = 0; i < size; i++)
+        databuffer[i] = data[i];
     
-    uint8_t* buffer = (uint8_t*)MemoryManager::activeMemoryManager->malloc(sizeof(InternetProtocolV4Message) + size);
-    InternetProtocolV4Message *message = (InternetProtocolV4Message*)buffer;
+    return Send(dstIP_BE, protocol, packet);
+}
+
+int32_t InternetProtocolProvider::Send(uint32_t dstIP_BE, uint8_t protocol, PacketBuffer* packet)
+{
+    uint32_t size = packet->Size();
+    InternetProtocolV4Message *message = (InternetProtocolV4Message*)packet->Push(sizeof(InternetProtocolV4Message));
+    if(message == 0)
+    {
+        packet->Free();
+        return -EINVAL;
+    }
     
     message->version = 4;
     message->headerLength = sizeof(InternetProtocolV4Message)/4;
@@ -109,19 +132,13 @@ void InternetProtocolProvider::Send(uint32_t dstIP_BE, uint8_t protocol, uint8_t
     message->checksum = 0;
     message->checksum = Checksum((uint16_t*)message, sizeof(InternetProtocolV4Message));
     
-    uint8_t* databuffer = buffer + sizeof(InternetProtocolV4Message);
-    for(int i = 0; i < size; i++)
-        databuffer[i] = data[i];
-    
     uint32_t route = dstIP_BE;
     if((dstIP_BE & subnetMask) != (message->srcIP & subnetMask))
         route = gatewayIP;
     
 
-    backend->Send(arp->Resolve(route), this->etherType_BE, buffer, sizeof(InternetProtocolV4Message) + size);
-    
-    
-    MemoryManager::activeMemoryManager->free(buffer);
+    // queued there if the MAC isn't known yet
+    return arp->SendTo(route, this->etherType_BE, packet);
 }
 
 
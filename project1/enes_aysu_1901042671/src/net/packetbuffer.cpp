@@ -0,0 +1,70 @@
+ 
+#include <net/packetbuffer.h>
+using namespace myos;
+using namespace myos::common;
+using namespace myos::net;
+
+
+
+SlabAllocator PacketBuffer::packets("packet", sizeof(PacketBuffer) + PACKET_HEADROOM + PACKET_MTU);
+
+PacketBuffer::PacketBuffer(uint32_t size, bool cached)
+{
+    this->data = (uint8_t*)(this + 1) + PACKET_HEADROOM;
+    this->size = size;
+    this->headroom = PACKET_HEADROOM;
+    this->cached = cached;
+    next = 0;
+}
+
+PacketBuffer* PacketBuffer::Allocate(uint32_t size)
+{
+    // bigger than an MTU is cut by the driver anyway, but it may still be asked for
+    bool cached = size <= PACKET_MTU;
+    void* memory;
+    if(cached)
+        memory = packets.Allocate();
+    else
+        memory = MemoryManager::activeMemoryManager->malloc(sizeof(PacketBuffer) + PACKET_HEADROOM + size);
+    if(memory == 0)
+        return 0;
+    return new (memory) PacketBuffer(size, cached);
+}
+
+void PacketBuffer::Free()
+{
+    if(cached)
+        packets.Free(this);
+    else
+        MemoryManager::activeMemoryManager->free(this);
+}
+
+uint8_t* PacketBuffer::Data()
+{
+    return data;
+}
+
+uint32_t PacketBuffer::Size()
+{
+    return size;
+}
+
+uint8_t* PacketBuffer::Push(uint32_t size)
+{
+    if(size > headroom)
+        return 0;
+    headroom -= size;
+    data -= size;
+    this->size += size;
+    return data;
+}
+
+uint8_t* PacketBuffer::Pull(uint32_t size)
+{
+    if(size > this->size)
+        return 0;
+    headroom += size;
+    data += size;
+    this->size -= size;
+    return data;
+}
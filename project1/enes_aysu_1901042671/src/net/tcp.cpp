@@ -61,7 +61,8 @@ void TransmissionControlProtocolSocket::Disconnect()
 
 
 TransmissionControlProtocolProvider::TransmissionControlProtocolProvider(InternetProtocolProvider* backend)
-: InternetProtocolHandler(backend, 0x06)
+: InternetProtocolHandler(backend, 0x06),
+  socketCache("tcp socket")
 {
     for(int i = 0; i < 65535; i++)
         sockets[i] = 0;
@@ -256,11 +257,11 @@ bool TransmissionControlProtocolProvider::OnInternetProtocolReceived(uint32_t sr
     
 
     if(socket != 0 && socket->state == CLOSED)
-        for(uint16_t i = 0; i < numSockets && socket == 0; i++)
+        for(uint16_t i = 0; i < numSockets; i++)
             if(sockets[i] == socket)
             {
                 sockets[i] = sockets[--numSockets];
-                MemoryManager::activeMemoryManager->free(socket);
+                socketCache.Free(socket);
                 break;
             }
     
@@ -291,12 +292,18 @@ void TransmissionControlProtocolProvider::Send(TransmissionControlProtocolSocket
     uint16_t totalLength = size + sizeof(TransmissionControlProtocolHeader);
     uint16_t lengthInclPHdr = totalLength + sizeof(TransmissionControlProtocolPseudoHeader);
     
-    uint8_t* buffer = (uint8_t*)MemoryManager::activeMemoryManager->malloc(lengthInclPHdr);
+    PacketBuffer* packet = PacketBuffer::Allocate(size);
+    if(packet == 0)
+        return;
     
-    TransmissionControlProtocolPseudoHeader* phdr = (TransmissionControlProtocolPseudoHeader*)buffer;
-    TransmissionControlProtocolHeader* msg = (TransmissionControlProtocolHeader*)(buffer + sizeof(TransmissionControlProtocolPseudoHeader));
-    uint8_t* buffer2 = buffer + sizeof(TransmissionControlProtocolHeader)
-                              + sizeof(TransmissionControlProtocolPseudoHeader);
+    // the only copy on the way down
+    uint8_t* buffer2 = packet->Data();
+    for(int i = 0; i < size; i++)
+        buffer2[i] = data[i];
+    
+    TransmissionControlProtocolHeader* msg = (TransmissionControlProtocolHeader*)packet->Push(sizeof(TransmissionControlProtocolHeader));
+    // only for the checksum, the IPv4 header goes over it afterwards
+    TransmissionControlProtocolPseudoHeader* phdr = (TransmissionControlProtocolPseudoHeader*)packet->Push(sizeof(TransmissionControlProtocolPseudoHeader));
     
     msg->headerSize32 = sizeof(TransmissionControlProtocolHeader)/4;
     msg->srcPort = socket->localPort;
@@ -312,9 +319,6 @@ void TransmissionControlProtocolProvider::Send(TransmissionControlProtocolSocket
     msg->options = ((flags & SYN) != 0) ? 0xB4050402 : 0;
     
     socket->sequenceNumber += size;
-        
-    for(int i = 0; i < size; i++)
-        buffer2[i] = data[i];
     
     phdr->srcIP = socket->localIP;
     phdr->dstIP = socket->remoteIP;
@@ -322,24 +326,21 @@ void TransmissionControlProtocolProvider::Send(TransmissionControlProtocolSocket
     phdr->totalLength = ((totalLength & 0x00FF) << 8) | ((totalLength & 0xFF00) >> 8);    
     
     msg -> checksum = 0;
-    msg -> checksum = InternetProtocolProvider::Checksum((uint16_t*)buffer, lengthInclPHdr);
+    msg -> checksum = InternetProtocolProvider::Checksum((uint16_t*)packet->Data(), lengthInclPHdr);
 
     
-    
-    InternetProtocolHandler::Send(socket->remoteIP, (uint8_t*)msg, totalLength);
-    MemoryManager::activeMemoryManager->free(buffer);
+    packet->Pull(sizeof(TransmissionControlProtocolPseudoHeader));
+    InternetProtocolHandler::Send(socket->remoteIP, packet);
 }
 
 
 
 TransmissionControlProtocolSocket* TransmissionControlProtocolProvider::Connect(uint32_t ip, uint16_t port)
 {
-    TransmissionControlProtocolSocket* socket = (TransmissionControlProtocolSocket*)MemoryManager::activeMemoryManager->malloc(sizeof(TransmissionControlProtocolSocket));
+    TransmissionControlProtocolSocket* socket = socketCache.Allocate(this);
     
     if(socket != 0)
     {
-        new (socket) TransmissionControlProtocolSocket(this);
-        
         socket -> remotePort = port;
         socket -> remoteIP = ip;
         socket -> localPort = freePort++;
@@ -371,12 +372,10 @@ void TransmissionControlProtocolProvider::Disconnect(TransmissionControlProtocol
 
 TransmissionControlProtocolSocket* TransmissionControlProtocolProvider::Listen(uint16_t port)
 {
-    TransmissionControlProtocolSocket* socket = (TransmissionControlProtocolSocket*)MemoryManager::activeMemoryManager->malloc(sizeof(TransmissionControlProtocolSocket));
+    TransmissionControlProtocolSocket* socket = socketCache.Allocate(this);
     
     if(socket != 0)
     {
-        new (socket) TransmissionControlProtocolSocket(this);
-        
         socket -> state = LISTEN;
         socket -> localIP = backend->GetIPAddress();
         socket -> localPort = ((port & 0xFF00)>>8) | ((port & 0x00FF) << 8);
@@ -4,6 +4,7 @@
 using namespace myos;
 using namespace myos::common;
 using namespace myos::net;
+using namespace myos::drivers;
 
 
 
@@ -40,9 +41,9 @@ void UserDatagramProtocolSocket::HandleUserDatagramProtocolMessage(uint8_t* data
         handler->HandleUserDatagramProtocolMessage(this, data, size);
 }
 
-void UserDatagramProtocolSocket::Send(uint8_t* data, uint16_t size)
+int32_t UserDatagramProtocolSocket::Send(uint8_t* data, uint16_t size)
 {
-    backend->Send(this, data, size);
+    return backend->Send(this, data, size);
 }
 
 void UserDatagramProtocolSocket::Disconnect()
@@ -55,7 +56,8 @@ void UserDatagramProtocolSocket::Disconnect()
 
 
 UserDatagramProtocolProvider::UserDatagramProtocolProvider(InternetProtocolProvider* backend)
-: InternetProtocolHandler(backend, 0x11)
+: InternetProtocolHandler(backend, 0x11),
+  socketCache("udp socket")
 {
     for(int i = 0; i < 65535; i++)
         sockets[i] = 0;
@@ -77,7 +79,7 @@ bool UserDatagramProtocolProvider::OnInternetProtocolReceived(uint32_t srcIP_BE,
     uint16_t localPort = msg->dstPort;
     uint16_t remotePort = msg->srcPort;
     
-    
+    SpinlockGuard guard(&lock);
     UserDatagramProtocolSocket* socket = 0;
     for(uint16_t i = 0; i < numSockets && socket == 0; i++)
     {
@@ -108,12 +110,11 @@ bool UserDatagramProtocolProvider::OnInternetProtocolReceived(uint32_t srcIP_BE,
 
 UserDatagramProtocolSocket* UserDatagramProtocolProvider::Connect(uint32_t ip, uint16_t port)
 {
-    UserDatagramProtocolSocket* socket = (UserDatagramProtocolSocket*)MemoryManager::activeMemoryManager->malloc(sizeof(UserDatagramProtocolSocket));
+    SpinlockGuard guard(&lock);
+    UserDatagramProtocolSocket* socket = socketCache.Allocate(this);
     
     if(socket != 0)
     {
-        new (socket) UserDatagramProtocolSocket(this);
-        
         socket -> remotePort = port;
         socket -> remoteIP = ip;
         socket -> localPort = freePort++;
@@ -132,12 +133,11 @@ UserDatagramProtocolSocket* UserDatagramProtocolProvider::Connect(uint32_t ip, u
 
 UserDatagramProtocolSocket* UserDatagramProtocolProvider::Listen(uint16_t port)
 {
-    UserDatagramProtocolSocket* socket = (UserDatagramProtocolSocket*)MemoryManager::activeMemoryManager->malloc(sizeof(UserDatagramProtocolSocket));
+    SpinlockGuard guard(&lock);
+    UserDatagramProtocolSocket* socket = socketCache.Allocate(this);
     
     if(socket != 0)
     {
-        new (socket) UserDatagramProtocolSocket(this);
-        
         socket -> listening = true;
         socket -> localPort = port;
         socket -> localIP = backend->GetIPAddress();
@@ -153,38 +153,41 @@ UserDatagramProtocolSocket* UserDatagramProtocolProvider::Listen(uint16_t port)
 
 void UserDatagramProtocolProvider::Disconnect(UserDatagramProtocolSocket* socket)
 {
-    for(uint16_t i = 0; i < numSockets && socket == 0; i++)
+    SpinlockGuard guard(&lock);
+    for(uint16_t i = 0; i < numSockets; i++)
         if(sockets[i] == socket)
         {
             sockets[i] = sockets[--numSockets];
-            MemoryManager::activeMemoryManager->free(socket);
+            socketCache.Free(socket);
             break;
         }
 }
 
-void UserDatagramProtocolProvider::Send(UserDatagramProtocolSocket* socket, uint8_t* data, uint16_t size)
+int32_t UserDatagramProtocolProvider::Send(UserDatagramProtocolSocket* socket, uint8_t* data, uint16_t size)
 {
     uint16_t totalLength = size + sizeof(UserDatagramProtocolHeader);
-    uint8_t* buffer = (uint8_t*)MemoryManager::activeMemoryManager->malloc(totalLength);
-    uint8_t* buffer2 = buffer + sizeof(UserDatagramProtocolHeader);
+    PacketBuffer* packet = PacketBuffer::Allocate(size);
+    if(packet == 0)
+        return -ENOMEM;
+    
+    // the only copy on the way down
+    uint8_t* buffer2 = packet->Data();
+    for(int i = 0; i < size; i++)
+        buffer2[i] = data[i];
     
-    UserDatagramProtocolHeader* msg = (UserDatagramProtocolHeader*)buffer;
+    UserDatagramProtocolHeader* msg = (UserDatagramProtocolHeader*)packet->Push(sizeof(UserDatagramProtocolHeader));
     
     msg->srcPort = socket->localPort;
     msg->dstPort = socket->remotePort;
     msg->length = ((totalLength & 0x00FF) << 8) | ((totalLength & 0xFF00) >> 8);
     
-    for(int i = 0; i < size; i++)
-        buffer2[i] = data[i];
-    
     msg -> checksum = 0;
-    InternetProtocolHandler::Send(socket->remoteIP, buffer, totalLength);
-
-    MemoryManager::activeMemoryManager->free(buffer);
+    return InternetProtocolHandler::Send(socket->remoteIP, packet);
 }
 
 void UserDatagramProtocolProvider::Bind(UserDatagramProtocolSocket* socket, UserDatagramProtocolHandler* handler)
 {
+    SpinlockGuard guard(&lock);
     socket->handler = handler;
 }
 
@@ -192,3 +195,85 @@ void UserDatagramProtocolProvider::Bind(UserDatagramProtocolSocket* socket, User
 
 
 
+
+
+
+
+UserDatagramProtocolFile::UserDatagramProtocolFile(UserDatagramProtocolSocket* socket)
+{
+    this->socket = socket;
+    head = 0;
+    tail = 0;
+}
+
+UserDatagramProtocolFile::~UserDatagramProtocolFile()
+{
+    // what was never read
+    while(head != tail)
+        Drop(&queue[head++ % UDP_FILE_QUEUE_LENGTH]);
+}
+
+void UserDatagramProtocolFile::Drop(Datagram* datagram)
+{
+    if(datagram->copy != 0)
+        datagram->copy->Free();
+    else if(amd_am79c973::activeNetworkCard != 0)
+        amd_am79c973::activeNetworkCard->ReturnReceiveBuffer(datagram->data);
+}
+
+void UserDatagramProtocolFile::HandleUserDatagramProtocolMessage(UserDatagramProtocolSocket* socket, uint8_t* data, uint16_t size)
+{
+    SpinlockGuard guard(&lock);
+    if(tail - head == UDP_FILE_QUEUE_LENGTH)
+        return;
+
+    Datagram* datagram = &queue[tail % UDP_FILE_QUEUE_LENGTH];
+    datagram->data = data;
+    datagram->size = size;
+    datagram->copy = 0;
+
+    // false for anything that isn't the frame the card is handing up
+    amd_am79c973* nic = amd_am79c973::activeNetworkCard;
+    if(nic == 0 || !nic->KeepReceiveBuffer(data))
+    {
+        datagram->copy = PacketBuffer::Allocate(size);
+        if(datagram->copy == 0)
+            return;
+        datagram->data = datagram->copy->Data();
+        for(uint16_t i = 0; i < size; i++)
+            datagram->data[i] = data[i];
+    }
+    tail++;
+}
+
+int32_t UserDatagramProtocolFile::Read(uint8_t* buffer, uint32_t size)
+{
+    // doesn't wait, 0 ---> nothing arrived yet
+    SpinlockGuard guard(&lock);
+    if(head == tail)
+        return 0;
+
+    Datagram* datagram = &queue[head++ % UDP_FILE_QUEUE_LENGTH];
+    if(size > datagram->size)
+        size = datagram->size;
+    for(uint32_t i = 0; i < size; i++)
+        buffer[i] = datagram->data[i];
+    Drop(datagram);
+    return size;
+}
+
+int32_t UserDatagramProtocolFile::Write(const uint8_t* buffer, uint32_t size)
+{
+    if(size > UDP_MAX_PAYLOAD)
+        size = UDP_MAX_PAYLOAD;
+    // -EAGAIN: nothing was sent, the caller tries again later
+    int32_t result = socket->Send((uint8_t*)buffer, size);
+    return (result < 0) ? result : size;
+}
+
+void UserDatagramProtocolFile::Close()
+{
+    // waits for a delivery into this file on another processor to finish
+    socket->Disconnect();
+    delete this;
+}
@@ -0,0 +1,423 @@
+#include <paging.h>
+#include <syscalls.h>
+
+using namespace myos;
+using namespace myos::common;
+
+
+void printf(char*);
+void printfHex32(uint32_t);
+
+
+// page directory / page table entry bits
+static const uint32_t PAGE_PRESENT = 0x001;
+static const uint32_t PAGE_WRITABLE = 0x002;
+static const uint32_t PAGE_WRITE_THROUGH = 0x008;
+static const uint32_t PAGE_CACHE_DISABLE = 0x010;
+static const uint32_t PAGE_LARGE = 0x080;        // 4 MiB page
+static const uint32_t PAGE_COPYONWRITE = 0x200;  // one of the bits left to the OS
+static const uint32_t PAGE_GUARD = 0x400;        // never present, below a stack
+static const uint32_t PAGE_FRAME = 0xFFFFF000;
+
+static const uint32_t WINDOW_ENTRY = TASK_WINDOW_BASE >> 22;
+
+
+SlabAllocator AddressSpace::cache("address space", sizeof(AddressSpace));
+
+void* AddressSpace::operator new(unsigned size) noexcept
+{
+    return cache.Allocate();
+}
+
+void AddressSpace::operator delete(void* object)
+{
+    cache.Free(object);
+}
+
+AddressSpace::AddressSpace()
+{
+    PagingManager* paging = PagingManager::activePagingManager;
+    directory = (uint32_t*)paging->AllocateFrame();
+    window = (uint32_t*)paging->AllocateFrame();
+
+    if(directory == 0 || window == 0)
+    {
+        if(directory != 0)
+            paging->ReleaseFrame(directory);
+        if(window != 0)
+            paging->ReleaseFrame(window);
+        directory = 0;
+        window = 0;
+        return;
+    }
+
+    for(int i = 0; i < 1024; i++)
+    {
+        directory[i] = paging->kernelDirectory[i];
+        window[i] = 0;
+    }
+    directory[WINDOW_ENTRY] = (uint32_t)window | PAGE_WRITABLE | PAGE_PRESENT;
+}
+
+AddressSpace::~AddressSpace()
+{
+    if(directory == 0)
+        return;
+
+    PagingManager* paging = PagingManager::activePagingManager;
+    for(int i = 0; i < 1024; i++)
+        if(window[i] & PAGE_PRESENT)
+            paging->ReleaseFrame((void*)(window[i] & PAGE_FRAME));
+    paging->ReleaseFrame(window);
+    paging->ReleaseFrame(directory);
+}
+
+uint32_t AddressSpace::PhysicalDirectory()
+{
+    return (uint32_t)directory;
+}
+
+uint32_t* AddressSpace::Entry(uint32_t virtualAddress)
+{
+    if(window == 0 || virtualAddress < TASK_WINDOW_BASE || virtualAddress >= TASK_STACK_TOP)
+        return 0;
+    return &window[(virtualAddress - TASK_WINDOW_BASE) / PAGE_SIZE];
+}
+
+bool AddressSpace::IsActive()
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    return cr3 == (uint32_t)directory;
+}
+
+void AddressSpace::Invalidate(uint32_t virtualAddress)
+{
+    // other address spaces get a fresh TLB when cr3 is loaded
+    if(IsActive())
+        asm volatile("invlpg (%0)" : : "r" (virtualAddress) : "memory");
+}
+
+bool AddressSpace::Map(uint32_t virtualAddress, uint32_t size)
+{
+    PagingManager* paging = PagingManager::activePagingManager;
+    uint32_t end = virtualAddress + size;
+
+    for(uint32_t page = virtualAddress & PAGE_FRAME; page < end; page += PAGE_SIZE)
+    {
+        uint32_t* entry = Entry(page);
+        if(entry == 0)
+            return false;
+        if(*entry & PAGE_PRESENT)
+            continue;
+
+        uint32_t* frame = (uint32_t*)paging->AllocateFrame();
+        if(frame == 0)
+            return false;
+        for(int i = 0; i < 1024; i++)
+            frame[i] = 0;
+
+        *entry = (uint32_t)frame | PAGE_WRITABLE | PAGE_PRESENT;
+        Invalidate(page);
+    }
+    return true;
+}
+
+bool AddressSpace::MapStack(uint32_t size)
+{
+    uint32_t bottom = TASK_STACK_TOP - size;
+    if(size == 0 || size > TASK_WINDOW_SIZE - PAGE_SIZE || (size & ~PAGE_FRAME) != 0)
+        return false;
+    if(!Map(bottom, size))
+        return false;
+
+    // left unmapped, running into it is reported as a stack overflow
+    // instead of silently overwriting whatever lies below
+    *Entry(bottom - PAGE_SIZE) = PAGE_GUARD;
+    return true;
+}
+
+AddressSpace* AddressSpace::Clone()
+{
+    PagingManager* paging = PagingManager::activePagingManager;
+    AddressSpace* child = new AddressSpace();
+    if(child == 0)
+        return 0;
+    if(child->directory == 0)
+    {
+        delete child;
+        return 0;
+    }
+
+    // only the page table entries are copied, both sides lose write
+    // access and whoever writes first gets its own copy of the frame
+    for(int i = 0; i < 1024; i++)
+    {
+        uint32_t entry = window[i];
+        if(!(entry & PAGE_PRESENT))
+        {
+            child->window[i] = entry; // guard pages
+            continue;
+        }
+
+        if(entry & PAGE_WRITABLE)
+        {
+            entry = (entry & ~PAGE_WRITABLE) | PAGE_COPYONWRITE;
+            window[i] = entry;
+        }
+        child->window[i] = entry;
+        paging->ShareFrame((void*)(entry & PAGE_FRAME));
+    }
+
+    // drop the writable translations we may still have cached
+    if(IsActive())
+        asm volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+
+    return child;
+}
+
+bool AddressSpace::Unshare(uint32_t* entry)
+{
+    // two sharers may fault on different processors at the same time
+    SpinlockGuard guard(&FrameAllocator::lock);
+    if(!(*entry & PAGE_PRESENT))
+        return false;
+    if(!(*entry & PAGE_COPYONWRITE))
+        return (*entry & PAGE_WRITABLE) != 0;
+
+    PagingManager* paging = PagingManager::activePagingManager;
+    uint32_t* frame = (uint32_t*)(*entry & PAGE_FRAME);
+
+    // the last user just takes the frame back
+    if(paging->FrameReferences(frame) > 1)
+    {
+        uint32_t* copy = (uint32_t*)paging->AllocateFrame();
+        if(copy == 0)
+            return false;
+        for(int i = 0; i < 1024; i++)
+            copy[i] = frame[i];
+        paging->ReleaseFrame(frame);
+        frame = copy;
+    }
+
+    *entry = (uint32_t)frame | PAGE_WRITABLE | PAGE_PRESENT;
+    return true;
+}
+
+bool AddressSpace::Write(uint32_t virtualAddress, const void* data, uint32_t size)
+{
+    // goes through the identity mapping, so it works on any address space
+    const uint8_t* src = (const uint8_t*)data;
+    while(size > 0)
+    {
+        uint32_t* entry = Entry(virtualAddress);
+        if(entry == 0 || !Unshare(entry))
+            return false;
+        Invalidate(virtualAddress);
+
+        uint32_t offset = virtualAddress & ~PAGE_FRAME;
+        uint32_t chunk = PAGE_SIZE - offset;
+        if(chunk > size)
+            chunk = size;
+
+        uint8_t* dst = (uint8_t*)((*entry & PAGE_FRAME) + offset);
+        for(uint32_t i = 0; i < chunk; i++)
+            dst[i] = src[i];
+
+        virtualAddress += chunk;
+        src += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool AddressSpace::IsGuardPage(uint32_t* directory, uint32_t virtualAddress)
+{
+    if(virtualAddress < TASK_WINDOW_BASE || virtualAddress >= TASK_STACK_TOP)
+        return false;
+    if(!(directory[WINDOW_ENTRY] & PAGE_PRESENT))
+        return false;
+
+    uint32_t* window = (uint32_t*)(directory[WINDOW_ENTRY] & PAGE_FRAME);
+    return (window[(virtualAddress - TASK_WINDOW_BASE) / PAGE_SIZE] & PAGE_GUARD) != 0;
+}
+
+bool AddressSpace::HandleCopyOnWrite(uint32_t* directory, uint32_t virtualAddress)
+{
+    if(virtualAddress < TASK_WINDOW_BASE || virtualAddress >= TASK_STACK_TOP)
+        return false;
+    if(!(directory[WINDOW_ENTRY] & PAGE_PRESENT))
+        return false;
+
+    uint32_t* window = (uint32_t*)(directory[WINDOW_ENTRY] & PAGE_FRAME);
+    uint32_t* entry = &window[(virtualAddress - TASK_WINDOW_BASE) / PAGE_SIZE];
+    if(!(*entry & PAGE_COPYONWRITE))
+        return false;
+    return Unshare(entry);
+}
+
+
+
+
+PagingManager* PagingManager::activePagingManager = 0;
+uint8_t PagingManager::pageFaultStacks[MAX_CPUS][8192];
+
+PagingManager::PagingManager(GlobalDescriptorTable* gdt, size_t memorySize)
+{
+    activePagingManager = this;
+
+    numFrames = memorySize / PAGE_SIZE;
+    frameReferences = (uint16_t*)MemoryManager::activeMemoryManager->malloc(numFrames * sizeof(uint16_t));
+    for(uint32_t i = 0; i < numFrames; i++)
+        frameReferences[i] = 0;
+
+    // identity map the whole 4 GiB with large pages, except the task window
+    kernelDirectory = (uint32_t*)AllocateFrame();
+    for(uint32_t i = 0; i < 1024; i++)
+        kernelDirectory[i] = (i << 22) | PAGE_LARGE | PAGE_WRITABLE | PAGE_PRESENT;
+    kernelDirectory[WINDOW_ENTRY] = 0;
+
+    EnableOnThisCPU(gdt);
+}
+
+void PagingManager::EnableOnThisCPU(GlobalDescriptorTable* gdt)
+{
+    CPU* cpu = CPUManager::Current();
+
+    // a fault on a task's stack can't be handled on that same stack,
+    // so page faults switch to a task of their own (see interrupts.cpp)
+    TaskStateSegment* tss = &cpu->pageFaultTaskStateSegment;
+    tss->cr3 = (uint32_t)kernelDirectory;
+    tss->eip = (uint32_t)&PageFaultTask;
+    tss->eflags = 0x2; // interrupts stay off
+    tss->esp = (uint32_t)&pageFaultStacks[cpu->index][sizeof(pageFaultStacks[0])];
+    tss->cs = gdt->CodeSegmentSelector();
+    tss->ss = gdt->DataSegmentSelector();
+    tss->ds = gdt->DataSegmentSelector();
+    tss->es = gdt->DataSegmentSelector();
+    tss->fs = gdt->DataSegmentSelector();
+    tss->gs = gdt->CPUSegmentSelector();
+
+    // cr3 isn't saved on a task switch, returning from the fault task loads it from here
+    cpu->taskStateSegment.cr3 = (uint32_t)kernelDirectory;
+    cpu->nextDirectory = (uint32_t)kernelDirectory;
+
+    // 4 MiB pages, then paging with write protection also for ring 0
+    asm volatile("mov %%cr4, %%eax; or $0x10, %%eax; mov %%eax, %%cr4" : : : "eax");
+    asm volatile("mov %0, %%cr3" : : "r" (kernelDirectory));
+    asm volatile("mov %%cr0, %%eax; or $0x80010000, %%eax; mov %%eax, %%cr0" : : : "eax");
+}
+
+PagingManager::~PagingManager()
+{
+    if(activePagingManager == this)
+        activePagingManager = 0;
+}
+
+void* PagingManager::AllocateFrame()
+{
+    void* frame = FrameAllocator::activeFrameAllocator->Allocate(0);
+    if(frame == 0)
+        return 0;
+    frameReferences[(uint32_t)frame / PAGE_SIZE] = 1;
+    return frame;
+}
+
+void PagingManager::ShareFrame(void* frame)
+{
+    SpinlockGuard guard(&FrameAllocator::lock);
+    frameReferences[(uint32_t)frame / PAGE_SIZE]++;
+}
+
+void PagingManager::ReleaseFrame(void* frame)
+{
+    SpinlockGuard guard(&FrameAllocator::lock);
+    if(--frameReferences[(uint32_t)frame / PAGE_SIZE] != 0)
+        return;
+    FrameAllocator::activeFrameAllocator->Free(frame, 0);
+}
+
+uint16_t PagingManager::FrameReferences(void* frame)
+{
+    return frameReferences[(uint32_t)frame / PAGE_SIZE];
+}
+
+void PagingManager::MapUncached(uint32_t physicalAddress)
+{
+    // before any address space copies the kernel's entries
+    kernelDirectory[physicalAddress >> 22] |= PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH;
+    asm volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+}
+
+bool PagingManager::IsAccessible(uint32_t address, uint32_t size)
+{
+    uint32_t end = address + size;
+    if(address < PAGE_SIZE || end < address)
+        return false;
+    if(address < TASK_WINDOW_BASE)
+        return end <= numFrames * PAGE_SIZE && end <= TASK_WINDOW_BASE;
+    if(end > TASK_STACK_TOP)
+        return false;
+
+    // the window is only partly mapped, a fault here while the syscall
+    // holds a lock would end the task with the lock still taken
+    uint32_t* directory;
+    asm volatile("mov %%cr3, %0" : "=r" (directory));
+    if(!(directory[WINDOW_ENTRY] & PAGE_PRESENT))
+        return false;
+
+    uint32_t* window = (uint32_t*)(directory[WINDOW_ENTRY] & PAGE_FRAME);
+    for(uint32_t page = address & PAGE_FRAME; page < end; page += PAGE_SIZE)
+        if(!(window[(page - TASK_WINDOW_BASE) / PAGE_SIZE] & PAGE_PRESENT))
+            return false;
+    return true;
+}
+
+void PagingManager::Switch(AddressSpace* addressSpace)
+{
+    // 0 ---> kernel only (the idle loops)
+    CPU* cpu = CPUManager::Current();
+    if(addressSpace != 0)
+        cpu->nextDirectory = addressSpace->PhysicalDirectory();
+    else
+        cpu->nextDirectory = (uint32_t)kernelDirectory;
+}
+
+void PagingManager::HandlePageFault(uint32_t error)
+{
+    uint32_t address;
+    asm volatile("mov %%cr2, %0" : "=r" (address));
+
+    // the interrupted context, saved by the task switch
+    TaskStateSegment* faulting = &CPUManager::Current()->taskStateSegment;
+
+    // write to a copy-on-write page: give the task its own copy and retry
+    if((error & 0x3) == 0x3 && AddressSpace::HandleCopyOnWrite((uint32_t*)faulting->cr3, address))
+        return;
+
+    if(AddressSpace::IsGuardPage((uint32_t*)faulting->cr3, address))
+        printf("\nSTACK OVERFLOW AT 0x");
+    else
+        printf("\nPAGE FAULT AT 0x");
+    printfHex32(address);
+    printf(" EIP 0x");
+    printfHex32(faulting->eip);
+    printf("\n");
+
+    if(faulting->cr3 == (uint32_t)activePagingManager->kernelDirectory)
+    {
+        // not inside a task, nothing sensible to go back to
+        printf("KERNEL HALTED\n");
+        while(1)
+            asm volatile("hlt");
+    }
+
+    // don't retry, let the task exit on the top of its stack instead
+    faulting->eip = (uint32_t)&TerminateFaultingTask;
+    faulting->esp = TASK_STACK_TOP - 16;
+}
+
+void PagingManager::TerminateFaultingTask()
+{
+    exit(-1);
+}
@@ -0,0 +1,123 @@
+#include <slab.h>
+
+using namespace myos;
+using namespace myos::common;
+
+
+SlabAllocator* SlabAllocator::firstCache = 0;
+
+SlabAllocator::SlabAllocator(char* name, uint32_t objectSize)
+{
+    this->name = name;
+    
+    // a free object holds the link, keep them 8 byte aligned
+    if(objectSize < sizeof(FreeObject))
+        objectSize = sizeof(FreeObject);
+    this->objectSize = (objectSize + 7) & ~7;
+    
+    // about a page per slab, but at least 8 objects
+    objectsPerSlab = (4096 - 8) / this->objectSize;
+    if(objectsPerSlab < 8)
+        objectsPerSlab = 8;
+    
+    freeObjects = 0;
+    slabs = 0;
+    stats = {this->objectSize, 0, 0, 0, 0, 0};
+    
+    // no heap is needed yet, so caches can be static objects
+    nextCache = firstCache;
+    firstCache = this;
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    for(SlabAllocator** cache = &firstCache; *cache != 0; cache = &(*cache)->nextCache)
+        if(*cache == this)
+        {
+            *cache = nextCache;
+            break;
+        }
+    
+    // the owner makes sure nothing is in use anymore
+    while(slabs != 0)
+    {
+        void* slab = slabs;
+        slabs = *(void**)slab;
+        MemoryManager::activeMemoryManager->free(slab);
+    }
+}
+
+bool SlabAllocator::Grow()
+{
+    if(MemoryManager::activeMemoryManager == 0)
+        return false;
+    
+    uint8_t* slab = (uint8_t*)MemoryManager::activeMemoryManager->malloc(8 + objectsPerSlab * objectSize);
+    if(slab == 0)
+        return false;
+    
+    *(void**)slab = slabs;
+    slabs = slab;
+    stats.slabs++;
+    
+    // push back to front, so the objects are handed out in address order
+    uint8_t* object = slab + 8 + objectsPerSlab * objectSize;
+    for(uint32_t i = 0; i < objectsPerSlab; i++)
+    {
+        object -= objectSize;
+        ((FreeObject*)object)->next = freeObjects;
+        freeObjects = (FreeObject*)object;
+    }
+    return true;
+}
+
+void* SlabAllocator::Allocate()
+{
+    SpinlockGuard guard(&lock);
+    if(freeObjects == 0 && !Grow())
+    {
+        stats.failures++;
+        return 0;
+    }
+    
+    FreeObject* object = freeObjects;
+    freeObjects = object->next;
+    
+    stats.allocations++;
+    if(++stats.inUse > stats.peakInUse)
+        stats.peakInUse = stats.inUse;
+    return object;
+}
+
+void SlabAllocator::Free(void* object)
+{
+    if(object == 0)
+        return;
+    
+    SpinlockGuard guard(&lock);
+    // LIFO, the next Allocate gets the object that is still in the cache
+    ((FreeObject*)object)->next = freeObjects;
+    freeObjects = (FreeObject*)object;
+    stats.inUse--;
+}
+
+char* SlabAllocator::GetName()
+{
+    return name;
+}
+
+uint32_t SlabAllocator::GetObjectSize()
+{
+    return objectSize;
+}
+
+SlabAllocator* SlabAllocator::GetNext()
+{
+    return nextCache;
+}
+
+void SlabAllocator::GetStatistics(SlabStatistics* stats)
+{
+    SpinlockGuard guard(&lock);
+    *stats = this->stats;
+}
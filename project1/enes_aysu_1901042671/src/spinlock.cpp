@@ -0,0 +1,73 @@
+#include <spinlock.h>
+#include <cpu.h>
+
+using namespace myos;
+using namespace myos::common;
+
+
+Spinlock::Spinlock()
+{
+    locked = 0;
+    owner = 0;
+    depth = 0;
+    flags = 0;
+}
+
+Spinlock::~Spinlock()
+{
+}
+
+void Spinlock::Lock()
+{
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+
+    // before the boot processor loads its GDT this is some constant,
+    // which is fine as long as nobody else runs yet
+    void* self = CPUManager::Current();
+    if(owner == self)
+    {
+        depth++;
+        return;
+    }
+
+    uint32_t taken = 1;
+    while(true)
+    {
+        asm volatile("xchg %0, %1" : "+r" (taken), "+m" (locked) : : "memory");
+        if(taken == 0)
+            break;
+        // wait without hammering the cache line
+        while(locked)
+            asm volatile("pause");
+        taken = 1;
+    }
+
+    owner = self;
+    depth = 1;
+    this->flags = flags;
+}
+
+void Spinlock::Unlock()
+{
+    if(--depth != 0)
+        return;
+
+    uint32_t flags = this->flags;
+    owner = 0;
+    asm volatile("" : : : "memory");
+    locked = 0;
+    asm volatile("push %0; popf" : : "r" (flags) : "memory", "cc");
+}
+
+
+SpinlockGuard::SpinlockGuard(Spinlock* lock)
+{
+    this->lock = lock;
+    lock->Lock();
+}
+
+SpinlockGuard::~SpinlockGuard()
+{
+    lock->Unlock();
+}
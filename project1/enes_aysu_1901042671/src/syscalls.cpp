@@ -1,81 +1,490 @@
-
 #include <syscalls.h>
+#include <net/udp.h>
+#include <hardwarecommunication/tsc.h>
  
 using namespace myos;
 using namespace myos::common;
 using namespace myos::hardwarecommunication;
- 
+using namespace myos::net;
+
+// syscallstubs.s
+extern "C" void syscall_sysenter();
+
+static const uint32_t IA32_SYSENTER_CS = 0x174;
+static const uint32_t IA32_SYSENTER_ESP = 0x175;
+static const uint32_t IA32_SYSENTER_EIP = 0x176;
+
+// sysenter starts on these, the stub moves to the caller's stack right away
+static uint32_t entryStacks[MAX_CPUS][16];
+
+
+constexpr SyscallHandler::Syscall SyscallHandler::syscalls[NUM_SYSCALLS] = {
+    { &SyscallHandler::Version,         true,  { ARG_NONE,   ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::GetPid,          true,  { ARG_NONE,   ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::Fork,            false, { ARG_NONE,   ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::Exit,            false, { ARG_VALUE,  ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::Printf,          true,  { ARG_STRING, ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::GetCPid,         true,  { ARG_NONE,   ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::WaitPid,         false, { ARG_VALUE,  ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::GetTaskStats,    true,  { ARG_VALUE,  ARG_OBJECT, ARG_NONE  }, sizeof(TaskStatistics) },
+    { &SyscallHandler::GetHeapStats,    true,  { ARG_NONE,   ARG_OBJECT, ARG_NONE  }, sizeof(HeapStatistics) },
+    { &SyscallHandler::ForkBatch,       false, { ARG_OBJECT, ARG_NONE,   ARG_NONE  }, sizeof(BatchParameters) },
+    { &SyscallHandler::Sleep,           false, { ARG_VALUE,  ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::Read,            true,  { ARG_VALUE,  ARG_BUFFER, ARG_VALUE }, 0 },
+    { &SyscallHandler::Write,           true,  { ARG_VALUE,  ARG_BUFFER, ARG_VALUE }, 0 },
+    { &SyscallHandler::Open,            true,  { ARG_STRING, ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::Close,           true,  { ARG_VALUE,  ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::MapMemory,       true,  { ARG_VALUE,  ARG_NONE,   ARG_NONE  }, 0 },
+    { &SyscallHandler::Socket,          true,  { ARG_VALUE,  ARG_VALUE,  ARG_NONE  }, 0 },
+    { &SyscallHandler::GetSyscallStats, true,  { ARG_VALUE,  ARG_OBJECT, ARG_NONE  }, sizeof(SyscallStatistics) },
+    { &SyscallHandler::GetInterruptStats, true, { ARG_VALUE,  ARG_OBJECT, ARG_NONE  }, sizeof(InterruptStatistics) },
+};
+
+SyscallHandler* SyscallHandler::activeSyscallHandler = 0;
+bool SyscallHandler::fastEntry = false;
+UserDatagramProtocolProvider* SyscallHandler::udp = 0;
+SyscallStatistics SyscallHandler::statistics[MAX_CPUS][NUM_SYSCALLS];
+
 SyscallHandler::SyscallHandler(InterruptManager* interruptManager, uint8_t InterruptNumber)
 :    InterruptHandler(interruptManager, InterruptNumber  + interruptManager->HardwareInterruptOffset())
 {
+    activeSyscallHandler = this;
 }
 
 SyscallHandler::~SyscallHandler()
 {
+    if(activeSyscallHandler == this)
+        activeSyscallHandler = 0;
+}
+
+static void WriteModelSpecificRegister(uint32_t msr, uint32_t value)
+{
+    asm volatile("wrmsr" :: "c" (msr), "a" (value), "d" (0));
+}
+
+void SyscallHandler::EnableFastEntryOnThisCPU(GlobalDescriptorTable* gdt)
+{
+    // CPUID.1:EDX bit 11
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    asm volatile("cpuid" : "+a" (eax), "=b" (ebx), "+c" (ecx), "=d" (edx));
+    if(!(edx & (1 << 11)))
+        return;
+
+    uint32_t index = CPUManager::Current()->index;
+    WriteModelSpecificRegister(IA32_SYSENTER_CS, gdt->CodeSegmentSelector());
+    WriteModelSpecificRegister(IA32_SYSENTER_ESP, (uint32_t)&entryStacks[index + 1]);
+    WriteModelSpecificRegister(IA32_SYSENTER_EIP, (uint32_t)&syscall_sysenter);
+    fastEntry = true;
+}
+
+bool SyscallHandler::FastEntry()
+{
+    return fastEntry;
+}
+
+void SyscallHandler::UseNetwork(UserDatagramProtocolProvider* udp)
+{
+    SyscallHandler::udp = udp;
 }
 
 
 void printf(char*);
 
-int myos::getPid() {
-    int ret;
-    asm("int $0x80" : "=c"(ret) : "a"(1));
+// sysenter for what never switches tasks, int 0x80 without it
+static uint32_t FastSyscall(uint32_t number, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0)
+{
+    uint32_t ret;
+    if(!SyscallHandler::FastEntry())
+    {
+        asm volatile("int $0x80" : "=c" (ret) : "a" (number), "b" (a), "d" (b), "S" (c) : "memory");
+        return ret;
+    }
+
+    // the stub comes back to 1: on this stack
+    uint32_t clobbered;
+    asm volatile("mov %%esp, %%ecx\n\t"
+                 "mov $1f, %%edx\n\t"
+                 "sysenter\n"
+                 "1:"
+                 : "=c" (ret), "=d" (clobbered)
+                 : "a" (number), "b" (a), "S" (b), "D" (c)
+                 : "memory", "cc");
     return ret;
 }
 
+int myos::getAbiVersion() {
+    return FastSyscall(SYSCALL_VERSION);
+}
+
+int myos::getPid() {
+    return FastSyscall(SYSCALL_GETPID);
+}
+
 void myos:: fork() {
-    asm("int $0x80" :: "a"(2));
+    asm("int $0x80" :: "a"(SYSCALL_FORK));
+}
+
+// like fork, the child runs in the batch class
+void myos::forkBatch(const BatchParameters* parameters) {
+    asm("int $0x80" :: "a"(SYSCALL_FORKBATCH), "b"(parameters) : "memory");
 }
 
-void myos::exit() {
-    asm("int $0x80" :: "a"(3));
+void myos::exit(common::int32_t status) {
+    asm("int $0x80" :: "a"(SYSCALL_EXIT), "b"(status));
 }
 
 int myos::getCPid() {
-    int ret;
-    asm("int $0x80" : "=c"(ret) : "a"(5));
-    return ret;
+    return FastSyscall(SYSCALL_GETCPID);
 }
 
-int myos::waitpid(common::uint8_t wPid)
+// blocks until the child wPid (-1 ---> any child) exits
+int myos::waitpid(common::int32_t wPid, common::int32_t* status)
 {
-    int ret;
-    asm("int $0x20" : "=c" (ret) : "a"(6), "b"(wPid));
+    int ret, code;
+    asm("int $0x80" : "=c" (ret), "=d" (code) : "a"(SYSCALL_WAITPID), "b"(wPid));
+    if(ret > 0 && status != 0)
+        *status = code;
     return ret;
 }
 
-uint32_t SyscallHandler::HandleInterrupt(uint32_t esp)
+// pid 0 reads the calling task's counters
+int myos::getTaskStats(common::uint32_t pid, TaskStatistics* stats)
+{
+    return FastSyscall(SYSCALL_GETTASKSTATS, pid, (uint32_t)stats);
+}
+
+// -ENOSYS if the kernel was built without HEAPSTATISTICS
+int myos::getHeapStats(HeapStatistics* stats)
+{
+    return FastSyscall(SYSCALL_GETHEAPSTATS, 0, (uint32_t)stats);
+}
+
+// gives the CPU up for at least that long
+void myos::usleep(common::uint32_t microseconds)
+{
+    asm("int $0x80" :: "a"(SYSCALL_USLEEP), "b"(microseconds));
+}
+
+int myos::read(int fd, void* buffer, common::uint32_t size)
+{
+    return FastSyscall(SYSCALL_READ, fd, (uint32_t)buffer, size);
+}
+
+int myos::write(int fd, const void* buffer, common::uint32_t size)
+{
+    return FastSyscall(SYSCALL_WRITE, fd, (uint32_t)buffer, size);
+}
+
+int myos::open(const char* path)
+{
+    return FastSyscall(SYSCALL_OPEN, (uint32_t)path);
+}
+
+int myos::close(int fd)
+{
+    return FastSyscall(SYSCALL_CLOSE, fd);
+}
+
+void* myos::mmap(common::uint32_t size)
+{
+    uint32_t ret = FastSyscall(SYSCALL_MMAP, size);
+    if(ret >= (uint32_t)-MAX_ERROR)
+        return 0;
+    return (void*)ret;
+}
+
+int myos::socket(common::uint32_t ip, common::uint16_t port)
+{
+    return FastSyscall(SYSCALL_SOCKET, ip, port);
+}
+
+int myos::getSyscallStats(common::uint32_t number, SyscallStatistics* stats)
+{
+    return FastSyscall(SYSCALL_GETSYSCALLSTATS, number, (uint32_t)stats);
+}
+
+int myos::getInterruptStats(common::uint8_t interrupt, InterruptStatistics* stats)
+{
+    return FastSyscall(SYSCALL_GETINTERRUPTSTATS, interrupt, (uint32_t)stats);
+}
+
+
+uint32_t SyscallHandler::Argument(CPUState* cpu, uint32_t index)
+{
+    if(index == 0)
+        return cpu->ebx;
+    if(index == 1)
+        return cpu->edx;
+    return cpu->esi;
+}
+
+bool SyscallHandler::Validate(const Syscall* syscall, CPUState* cpu)
+{
+    PagingManager* paging = PagingManager::activePagingManager;
+    for(uint32_t i = 0; i < 3; i++)
+    {
+        uint32_t address = Argument(cpu, i);
+        switch(syscall->arguments[i])
+        {
+            case ARG_STRING:
+                for(uint32_t length = 0; ; length++)
+                {
+                    if(length == SYSCALL_MAX_STRING)
+                        return false;
+                    // a page at a time
+                    if((length == 0 || (address + length) % PAGE_SIZE == 0)
+                    && !paging->IsAccessible(address + length, 1))
+                        return false;
+                    if(((char*)address)[length] == '\0')
+                        break;
+                }
+                break;
+            case ARG_BUFFER:
+                if(!paging->IsAccessible(address, Argument(cpu, i + 1)))
+                    return false;
+                break;
+            case ARG_OBJECT:
+                if(!paging->IsAccessible(address, syscall->objectSize))
+                    return false;
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+uint32_t SyscallHandler::Version(uint32_t esp)
+{
+    ((CPUState*)esp)->ecx = SYSCALL_ABI_VERSION;
+    return esp;
+}
+
+uint32_t SyscallHandler::GetPid(uint32_t esp)
+{
+    ((CPUState*)esp)->ecx = InterruptHandler::os_getPid();
+    return esp;
+}
+
+uint32_t SyscallHandler::Fork(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    cpu->ecx = (InterruptHandler::os_fork(cpu) < 0) ? -ENOMEM : 0;
+    return InterruptHandler::HandleInterrupt(esp);
+}
+
+uint32_t SyscallHandler::Exit(uint32_t esp)
+{
+    // switch away right now, a finished task must not run on
+    // until the next timer tick
+    if(InterruptHandler::os_exit(((CPUState*)esp)->ebx))
+        return InterruptHandler::os_reschedule(esp);
+    return esp;
+}
+
+uint32_t SyscallHandler::Printf(uint32_t esp)
+{
+    printf((char*)((CPUState*)esp)->ebx);
+    return esp;
+}
+
+uint32_t SyscallHandler::GetCPid(uint32_t esp)
+{
+    ((CPUState*)esp)->ecx = InterruptHandler::os_getCPid();
+    return esp;
+}
+
+uint32_t SyscallHandler::WaitPid(uint32_t esp)
+{
+    // no exited child yet, sleep until ExitTask hands one over
+    CPUState* cpu = (CPUState*)esp;
+    if(InterruptHandler::os_waitPid(cpu))
+        return InterruptHandler::os_reschedule(esp);
+    if(cpu->ecx == (uint32_t)-1)
+        cpu->ecx = -ECHILD;
+    return esp;
+}
+
+uint32_t SyscallHandler::GetTaskStats(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    cpu->ecx = (InterruptHandler::os_getTaskStats(cpu->ebx, (TaskStatistics*)cpu->edx) == 0) ? 0 : -ESRCH;
+    return esp;
+}
+
+uint32_t SyscallHandler::GetHeapStats(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    cpu->ecx = MemoryManager::activeMemoryManager->GetStatistics((HeapStatistics*)cpu->edx) ? 0 : -ENOSYS;
+    return esp;
+}
+
+uint32_t SyscallHandler::ForkBatch(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    cpu->ecx = (InterruptHandler::os_fork(cpu, (BatchParameters*)cpu->ebx) < 0) ? -ENOMEM : 0;
+    return InterruptHandler::HandleInterrupt(esp);
+}
+
+uint32_t SyscallHandler::Sleep(uint32_t esp)
+{
+    if(InterruptHandler::os_sleep(((CPUState*)esp)->ebx))
+        return InterruptHandler::os_reschedule(esp);
+    return esp;
+}
+
+
+uint32_t SyscallHandler::Read(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    File* file = TaskManager::activeTaskManager->GetFile(cpu->ebx);
+    cpu->ecx = (file == 0) ? -EBADF : file->Read((uint8_t*)cpu->edx, cpu->esi);
+    return esp;
+}
+
+uint32_t SyscallHandler::Write(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    File* file = TaskManager::activeTaskManager->GetFile(cpu->ebx);
+    cpu->ecx = (file == 0) ? -EBADF : file->Write((uint8_t*)cpu->edx, cpu->esi);
+    return esp;
+}
+
+uint32_t SyscallHandler::Open(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    // Validate made sure it is terminated
+    char* path = (char*)cpu->ebx;
+    uint32_t length = 0;
+    while(path[length] != '\0')
+        length++;
+    if(length >= MAX_PATH)
+    {
+        cpu->ecx = -ENAMETOOLONG;
+        return esp;
+    }
+
+    File* file = DeviceFiles::Open(path);
+    cpu->ecx = (file == 0) ? -ENOENT : TaskManager::activeTaskManager->AddFile(file);
+    return esp;
+}
+
+uint32_t SyscallHandler::Close(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    cpu->ecx = TaskManager::activeTaskManager->CloseFile(cpu->ebx);
+    return esp;
+}
+
+uint32_t SyscallHandler::MapMemory(uint32_t esp)
 {
     CPUState* cpu = (CPUState*)esp;
-    
+    uint32_t address = TaskManager::activeTaskManager->MapMemory(cpu->ebx);
+    cpu->ecx = (address == 0) ? -ENOMEM : address;
+    return esp;
+}
 
-    switch(cpu->eax)
+uint32_t SyscallHandler::Socket(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    if(udp == 0)
     {
-        case 1:
-            cpu->ecx = InterruptHandler::os_getPid();
-            break;
-        // Syscall 2: fork
-        case 2:
-            cpu->ecx = InterruptHandler::os_fork(cpu);
-            return InterruptHandler::HandleInterrupt(esp);
-            break;
-        // Syscall 3: exit
-        case 3:
-            if(InterruptHandler::os_exit()) {
-                cpu->ecx = InterruptHandler::HandleInterrupt(esp);
-            }
-            break;   
-        // Syscall 4: printf
-        case 4:
-            printf((char*)cpu->ebx);
-            break;
-        // Syscall 5: getPid
-        case 5:
-            cpu->ecx = InterruptHandler::os_getCPid();
-            break;
-        default:
-            break;
+        cpu->ecx = -ENOSYS;
+        return esp;
     }
+
+    uint16_t port = cpu->edx;
+    UserDatagramProtocolSocket* socket = (cpu->ebx == 0) ? udp->Listen(port) : udp->Connect(cpu->ebx, port);
+    if(socket == 0)
+    {
+        cpu->ecx = -ENOMEM;
+        return esp;
+    }
+    UserDatagramProtocolFile* file = new UserDatagramProtocolFile(socket);
+    if(file == 0)
+    {
+        socket->Disconnect();
+        cpu->ecx = -ENOMEM;
+        return esp;
+    }
+    udp->Bind(socket, file);
+
+    // no descriptor left closes it again
+    cpu->ecx = TaskManager::activeTaskManager->AddFile(file);
     return esp;
 }
 
+uint32_t SyscallHandler::GetSyscallStats(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    if(cpu->ebx >= NUM_SYSCALLS)
+    {
+        cpu->ecx = -EINVAL;
+        return esp;
+    }
+
+    SumCycles((SyscallStatistics*)cpu->edx, &statistics[0][cpu->ebx], NUM_SYSCALLS);
+    cpu->ecx = 0;
+    return esp;
+}
+
+uint32_t SyscallHandler::GetInterruptStats(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    if(cpu->ebx > 0xFF)
+    {
+        cpu->ecx = -EINVAL;
+        return esp;
+    }
+    InterruptManager::GetStatistics(cpu->ebx, (InterruptStatistics*)cpu->edx);
+    cpu->ecx = 0;
+    return esp;
+}
+
+
+uint32_t SyscallHandler::Dispatch(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    uint32_t number = cpu->eax;
+    const Syscall* syscall = &syscalls[number];
+    if(!Validate(syscall, cpu))
+    {
+        cpu->ecx = -EFAULT;
+        return esp;
+    }
+
+    uint64_t start = ReadTimeStampCounter();
+    uint32_t next = (this->*syscall->handler)(esp);
+    uint32_t cycles = (uint32_t)(ReadTimeStampCounter() - start);
+
+    // still the same processor, a task that switched away only leaves it afterwards
+    CountCycles(&statistics[CPUManager::Current()->index][number], cycles);
+    return next;
+}
+
+uint32_t SyscallHandler::HandleInterrupt(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+    InterruptHandler::os_accountSyscall();
+
+    if(cpu->eax >= NUM_SYSCALLS)
+    {
+        cpu->ecx = -ENOSYS;
+        return esp;
+    }
+    return Dispatch(esp);
+}
+
+void SyscallHandler::HandleFastEntry(CPUState* cpu)
+{
+    SyscallHandler* handler = activeSyscallHandler;
+    handler->os_accountSyscall();
+
+    // what might reschedule has to come through int 0x80
+    if(cpu->eax >= NUM_SYSCALLS || !syscalls[cpu->eax].fast)
+    {
+        cpu->ecx = -ENOSYS;
+        return;
+    }
+    handler->Dispatch((uint32_t)cpu);
+}
@@ -0,0 +1,43 @@
+# sysenter entry, IA32_SYSENTER_EIP points here (SyscallHandler::EnableFastEntryOnThisCPU)
+#
+# everything runs in ring 0, so there is no sysexit: the caller passes its
+# stack in ecx and where to go on in edx, the arguments that int 0x80 takes
+# in edx and esi come in esi and edi. The frame built on the caller's stack
+# is a CPUState like int_bottom's, the handler never switches tasks on it.
+
+.section .text
+
+.extern _ZN4myos14SyscallHandler15HandleFastEntryEPNS_8CPUStateE
+
+.global syscall_sysenter
+syscall_sysenter:
+    mov %ecx, %esp
+
+    pushl $0x202 # eflags, interrupts back on when done
+    pushl %cs
+    pushl %edx   # eip
+    pushl $0     # error
+
+    pushl %ebp
+    pushl %edi
+    pushl %edi   # esi
+    pushl %esi   # edx
+    pushl %ecx
+    pushl %ebx
+    pushl %eax
+
+    pushl %esp
+    call _ZN4myos14SyscallHandler15HandleFastEntryEPNS_8CPUStateE
+    add $4, %esp
+
+    popl %eax
+    popl %ebx
+    popl %ecx    # the result
+    add $12, %esp # esi and edi are still the caller's, C preserves them
+    popl %ebp
+
+    add $4, %esp
+    popl %edx
+    add $8, %esp
+    sti
+    jmp *%edx
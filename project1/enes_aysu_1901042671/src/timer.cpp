@@ -0,0 +1,347 @@
+
+#include <timer.h>
+#include <hardwarecommunication/apic.h>
+#include <hardwarecommunication/port.h>
+#include <hardwarecommunication/tsc.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::hardwarecommunication;
+
+
+// a * b / c without __udivdi3, the quotient has to fit into 32 bits
+static uint32_t MulDiv(uint32_t a, uint32_t b, uint32_t c)
+{
+    uint32_t quotient, remainder;
+    asm("mull %3; divl %4" : "=a" (quotient), "=&d" (remainder) : "a" (a), "rm" (b), "rm" (c) : "cc");
+    return quotient;
+}
+
+// a / b as 32.32 fixed point, for a < b
+static uint32_t Fraction(uint32_t a, uint32_t b)
+{
+    uint32_t quotient, remainder;
+    asm("divl %4" : "=a" (quotient), "=d" (remainder) : "a" (0), "d" (a), "rm" (b) : "cc");
+    return quotient;
+}
+
+
+Timer::Timer(void (*callback)(void* data), void* data)
+{
+    this->callback = callback;
+    this->data = data;
+    deadline = 0;
+    slot = 0;
+    next = 0;
+    prev = 0;
+    pending = false;
+}
+
+Timer::~Timer()
+{
+    if(pending && TimerManager::activeTimerManager != 0)
+        TimerManager::activeTimerManager->Cancel(this);
+}
+
+bool Timer::Pending()
+{
+    return pending;
+}
+
+
+
+TimerManager* TimerManager::activeTimerManager = 0;
+uint64_t TimerManager::bootCycles = 0;
+uint32_t TimerManager::microsecondsPerCycle = 0;
+
+TimerManager::TimerManager()
+{
+    activeTimerManager = this;
+    apic = false;
+    vector = 0;
+    apicCounts = 0;
+
+    // cycles in 10 ms, at most 42 GHz
+    uint64_t start = ReadTimeStampCounter();
+    PITDelay(10000);
+    uint32_t cycles = (uint32_t)(ReadTimeStampCounter() - start);
+    bootCycles = start;
+    microsecondsPerCycle = Fraction(10000, cycles);
+
+    for(uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for(uint32_t i = 0; i < TIMER_WHEEL_SLOTS; i++)
+            wheel[level][i] = 0;
+    wheelTime = 0;
+    for(uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+        nextTick[i] = 0;
+        armed[i] = 0;
+    }
+    nextGlobalTick = SCHEDULER_TICK;
+    ticks = 0;
+}
+
+TimerManager::~TimerManager()
+{
+    if(activeTimerManager == this)
+        activeTimerManager = 0;
+}
+
+uint64_t TimerManager::Now()
+{
+    uint64_t cycles = ReadTimeStampCounter() - bootCycles;
+    return (cycles >> 32) * microsecondsPerCycle
+        + (((cycles & 0xFFFFFFFF) * microsecondsPerCycle) >> 32);
+}
+
+uint32_t TimerManager::Ticks()
+{
+    // counted from the clock, ticks that nobody took while idle count too
+    SpinlockGuard guard(&lock);
+    uint64_t now = Now();
+    while(nextGlobalTick <= now)
+    {
+        nextGlobalTick += SCHEDULER_TICK;
+        ticks++;
+    }
+    return ticks;
+}
+
+void TimerManager::Insert(Timer* timer)
+{
+    // the lowest level whose slots still tell the deadlines apart
+    uint64_t expires = timer->deadline >> TIMER_SLOT_SHIFT;
+    if(expires < wheelTime)
+        expires = wheelTime;
+    uint64_t delta = expires - wheelTime;
+    uint32_t level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_LEVEL_SHIFT * (level + 1))))
+        level++;
+
+    Timer** slot = &wheel[level][(expires >> (TIMER_LEVEL_SHIFT * level)) % TIMER_WHEEL_SLOTS];
+    timer->slot = slot;
+    timer->prev = 0;
+    timer->next = *slot;
+    if(*slot != 0)
+        (*slot)->prev = timer;
+    *slot = timer;
+    timer->pending = true;
+}
+
+void TimerManager::Unlink(Timer* timer)
+{
+    if(timer->prev != 0)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if(timer->next != 0)
+        timer->next->prev = timer->prev;
+    timer->slot = 0;
+    timer->next = 0;
+    timer->prev = 0;
+    timer->pending = false;
+}
+
+void TimerManager::Cascade(uint32_t level, uint32_t index)
+{
+    // spread a slot over the levels below, it is about to come up
+    Timer* timer = wheel[level][index];
+    wheel[level][index] = 0;
+    while(timer != 0)
+    {
+        Timer* next = timer->next;
+        Insert(timer);
+        timer = next;
+    }
+}
+
+void TimerManager::Add(Timer* timer, uint32_t microseconds)
+{
+    SpinlockGuard guard(&lock);
+    if(timer->pending)
+        Unlink(timer);
+
+    timer->deadline = Now() + microseconds;
+    Insert(timer);
+
+    // the boot processor may be asleep until much later
+    if(timer->deadline < armed[0])
+    {
+        if(CPUManager::Current()->index == 0)
+        {
+            armed[0] = timer->deadline;
+            Arm(microseconds);
+        }
+        else
+            CPUManager::Wake(0);
+    }
+}
+
+bool TimerManager::Cancel(Timer* timer)
+{
+    // false ---> it already expired (the callback may still be running)
+    SpinlockGuard guard(&lock);
+    if(!timer->pending)
+        return false;
+    Unlink(timer);
+    return true;
+}
+
+uint64_t TimerManager::NextExpiry(uint64_t now)
+{
+    uint64_t earliest = now + MAX_TIMER_INTERVAL;
+
+    // level 0 is in order of time, the first slot in use is enough
+    for(uint32_t i = 0; i < TIMER_WHEEL_SLOTS; i++)
+    {
+        Timer* timer = wheel[0][(wheelTime + i) % TIMER_WHEEL_SLOTS];
+        for(; timer != 0; timer = timer->next)
+            if(timer->deadline < earliest)
+                earliest = timer->deadline;
+        if(earliest < now + MAX_TIMER_INTERVAL)
+            break;
+    }
+
+    // nothing above level 0 is due before its slot cascades, so the next
+    // slot in use on each level is an early enough wake-up; the timers
+    // themselves are looked at once they are down on level 0
+    for(uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        uint32_t shift = TIMER_LEVEL_SHIFT * level;
+        for(uint32_t i = 1; i <= TIMER_WHEEL_SLOTS; i++)
+        {
+            uint64_t slot = (wheelTime >> shift) + i;
+            uint64_t cascade = slot << (shift + TIMER_SLOT_SHIFT);
+            if(cascade >= earliest)
+                break;
+            if(wheel[level][slot % TIMER_WHEEL_SLOTS] != 0)
+            {
+                earliest = cascade;
+                break;
+            }
+        }
+    }
+    return earliest;
+}
+
+void TimerManager::RunExpired(uint64_t now)
+{
+    Timer* expired = 0;
+
+    lock.Lock();
+    uint64_t last = now >> TIMER_SLOT_SHIFT;
+    while(true)
+    {
+        // the slot of now is looked at again, it may still have later timers
+        Timer* timer = wheel[0][wheelTime % TIMER_WHEEL_SLOTS];
+        while(timer != 0)
+        {
+            Timer* next = timer->next;
+            if(timer->deadline <= now)
+            {
+                Unlink(timer);
+                timer->next = expired;
+                expired = timer;
+            }
+            timer = next;
+        }
+        if(wheelTime >= last)
+            break;
+
+        // every time a level goes round, the next slot above comes down
+        wheelTime++;
+        for(uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if(wheelTime & (((uint64_t)1 << (TIMER_LEVEL_SHIFT * level)) - 1))
+                break;
+            Cascade(level, (wheelTime >> (TIMER_LEVEL_SHIFT * level)) % TIMER_WHEEL_SLOTS);
+        }
+    }
+    lock.Unlock();
+
+    // without the lock, a callback may add timers
+    while(expired != 0)
+    {
+        Timer* timer = expired;
+        expired = timer->next;
+        timer->next = 0;
+        timer->callback(timer->data);
+    }
+}
+
+void TimerManager::UseLocalAPIC(uint8_t vector)
+{
+    this->vector = vector;
+    apicCounts = LocalAPIC::CalibrateTimer();
+    apic = true;
+}
+
+void TimerManager::StartOnThisCPU()
+{
+    uint32_t cpu = CPUManager::Current()->index;
+    SpinlockGuard guard(&lock);
+    nextTick[cpu] = Now() + SCHEDULER_TICK;
+    armed[cpu] = nextTick[cpu];
+    Arm(SCHEDULER_TICK);
+}
+
+void TimerManager::Arm(uint32_t microseconds)
+{
+    if(microseconds < MIN_TIMER_INTERVAL)
+        microseconds = MIN_TIMER_INTERVAL;
+    if(microseconds > MAX_TIMER_INTERVAL)
+        microseconds = MAX_TIMER_INTERVAL;
+
+    if(apic)
+    {
+        LocalAPIC::StartOneShot(vector, MulDiv(microseconds, apicCounts, 10000));
+        return;
+    }
+
+    // PIT channel 0, mode 0 (interrupt on terminal count), 1.193182 MHz
+    uint32_t count = MulDiv(microseconds, 1193182, 1000000);
+    if(count > 0xFFFF)
+        count = 0xFFFF;
+    Port8Bit command(0x43);
+    Port8Bit channel0(0x40);
+    command.Write(0x30);
+    channel0.Write(count & 0xFF);
+    channel0.Write(count >> 8);
+}
+
+bool TimerManager::HandleInterrupt()
+{
+    uint32_t cpu = CPUManager::Current()->index;
+    uint64_t now = Now();
+    if(cpu == 0)
+        RunExpired(now);
+
+    SpinlockGuard guard(&lock);
+    if(now < nextTick[cpu])
+        return false;
+    nextTick[cpu] = now + SCHEDULER_TICK;
+    return true;
+}
+
+void TimerManager::Rearm(bool idle)
+{
+    uint32_t cpu = CPUManager::Current()->index;
+    SpinlockGuard guard(&lock);
+    uint64_t now = Now();
+
+    // tickless while idle, then only a timer or another processor wakes it
+    uint64_t next = now + MAX_TIMER_INTERVAL;
+    if(!idle && nextTick[cpu] <= now)
+        nextTick[cpu] = now + SCHEDULER_TICK; // was idle until just now
+    if(!idle && nextTick[cpu] < next)
+        next = nextTick[cpu];
+    if(cpu == 0)
+    {
+        uint64_t expiry = NextExpiry(now);
+        if(expiry < next)
+            next = expiry;
+    }
+
+    armed[cpu] = next;
+    Arm((next > now) ? (uint32_t)(next - now) : 0);
+}